@@ -31,7 +31,39 @@ class AbsDensity {
         \param [in] x the point at which to calculate the PDF
         \return PDF value
     */
-    virtual Double_t density(std::vector<Double_t> &x) = 0;    
+    virtual Double_t density(std::vector<Double_t> &x) = 0;
+
+    //! Calculate PDF value at the given point. Non-allocating interface. 
+    /*! 
+        The default implementation copies the point into a vector and calls density(std::vector<Double_t>&). 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    virtual Double_t density(const Double_t* x, UInt_t dim) const;
+
+    //! Calculate PDF values for a batch of points
+    /*!
+        Points are passed as a structure of arrays: x[var][i] is the value of the variable var for the i-th point.
+        The default implementation calls density() for each point, binned densities override it with
+        a faster loop.
+        \param [in]  numPoints number of points
+        \param [in]  x array of pointers (one per phase space variable) to arrays of numPoints coordinates
+        \param [out] result array of numPoints PDF values
+    */
+    virtual void densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result);
+
+    //! Calculate PDF value and its gradient over the coordinates at the given point
+    /*! 
+        The default implementation uses central finite differences with the step of 1e-5 of the 
+        phase space range in each variable. Binned densities override it with the analytic derivative 
+        of the interpolation. 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \param [out] grad array of dim partial derivatives of the PDF
+        \return PDF value
+    */
+    virtual Double_t densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const;
 
     //! Return phase space definition for this PDF
     /*!    
@@ -92,6 +124,34 @@ class AbsDensity {
         \return the PDF value at this point. 
     */ 
     Double_t generate(std::vector<Double_t> &x); 
+
+    //! Generate a single point using one of the independent random number streams. 
+    /*! 
+        Can be called concurrently from several threads as long as each thread uses its own stream. 
+        The majorant has to be set (or estimated by a previous call to generate()) beforehand; 
+        it is not updated by this method. 
+        \param [out] x the generated point
+        \param [in] stream number of the random number stream
+        \return the PDF value at this point. 
+    */ 
+    Double_t generate(std::vector<Double_t> &x, UInt_t stream); 
+
+    //! Create independent random number streams, e.g. one per thread. 
+    /*! 
+        \param [in] numStreams number of streams
+        \param [in] seed base seed. The stream seeds are derived from it. If seed=0, it is drawn from the main generator. 
+    */ 
+    void setRandomStreams(UInt_t numStreams, UInt_t seed = 0); 
+
+    //! Return the number of random number streams
+    UInt_t numRandomStreams(void) const { return m_rndStreams.size(); }
+
+    //! Return the random number generator of the stream
+    /*! 
+        \param [in] stream number of the random number stream
+        \return random number generator
+    */ 
+    TRandom3* randomStream(UInt_t stream) { return &(m_rndStreams[stream]); }
     
     //! Generate a sample of points within the phase space according to the PDF using accept-reject method. 
     /*! 
@@ -120,6 +180,9 @@ class AbsDensity {
 
     //! Random number generator
     TRandom3 m_rnd;
+
+    //! Independent random number streams for use from several threads
+    std::vector<TRandom3> m_rndStreams;
 };
 
 #endif
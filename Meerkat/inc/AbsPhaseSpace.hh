@@ -33,6 +33,15 @@ class AbsPhaseSpace {
     */ 
     virtual Bool_t withinLimits(std::vector<Double_t> &x) = 0; 
 
+    //! Check if the point is within phase space limits. Non-allocating interface. 
+    /*! 
+      The default implementation copies the point into a vector and calls withinLimits(std::vector<Double_t>&). 
+      \param [in] x pointer to the point coordinates
+      \param [in] dim number of coordinates
+      \return true if the point is within phase space limits, false otherwise
+    */ 
+    virtual Bool_t withinLimits(const Double_t* x, UInt_t dim) const; 
+
     //! Return lower allowed limit of the variable
     /*! 
       \param [in] var number of the variable 
@@ -56,6 +65,17 @@ class AbsPhaseSpace {
     */ 
     virtual Bool_t limits(UInt_t var, std::vector<Double_t> &x, Double_t* lower, Double_t* upper) = 0; 
 
+    //! Return limits (lower and upper) for the variable at a certain point of the phase space. Non-allocating interface. 
+    /*! 
+      The default implementation copies the point into a vector and calls limits(UInt_t, std::vector<Double_t>&, Double_t*, Double_t*). 
+      \param [in] var number of the variable
+      \param [in] x pointer to the point coordinates
+      \param [in] dim number of coordinates
+      \param [out] lower lower limit
+      \param [out] upper upper limit
+    */ 
+    virtual Bool_t limits(UInt_t var, const Double_t* x, UInt_t dim, Double_t* lower, Double_t* upper) const; 
+
     //! Return the name of the phase space
     /*! 
           \return Name of the phase space
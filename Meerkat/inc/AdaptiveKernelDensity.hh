@@ -2,6 +2,9 @@
 #define ADAPTIVE_KERNEL_DENSITY
 
 #include "AbsDensity.hh"
+#include "GridEngine.hh"
+#include "BinnedOptions.hh"
+#include "StencilCache.hh"
 
 #include "TMath.h"
 
@@ -28,6 +31,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -39,7 +43,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0, 
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 1-dimensional adaptive kernel PDF from the sample of points in an NTuple with weight. 
@@ -56,6 +61,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -68,7 +74,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0, 
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 2-dimensional adaptive kernel PDF from the sample of points in an NTUple. 
@@ -87,6 +94,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -98,7 +106,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 2-dimensional adaptive kernel PDF from the sample of points in an NTuple with weight. 
@@ -118,6 +127,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -130,7 +140,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 3-dimensional adaptive kernel PDF from the sample of points in an NTuple. 
@@ -152,6 +163,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -163,7 +175,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 3-dimensional adaptive kernel PDF from the sample of points in an NTuple with weight. 
@@ -186,6 +199,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -198,7 +212,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 4-dimensional adaptive kernel PDF from the sample of points in an NTuple. 
@@ -223,6 +238,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -234,7 +250,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 4-dimensional adaptive kernel PDF from the sample of points in an NTuple with weight. 
@@ -260,6 +277,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -272,7 +290,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 5-dimensional adaptive kernel PDF from the sample of points in an NTuple. 
@@ -300,6 +319,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -311,7 +331,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 5-dimensional adaptive kernel PDF from the sample of points in an NTuple with weight. 
@@ -340,6 +361,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -352,7 +374,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for adaptive kernel PDF of arbitrary dimensionality from the sample of points in an NTUple. 
@@ -368,6 +391,7 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     AdaptiveKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -379,7 +403,8 @@ class AdaptiveKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0, 
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Destructor
@@ -409,7 +434,35 @@ class AdaptiveKernelDensity : public AbsDensity {
         \param [in] x point
         \return PDF value
     */ 
-    Double_t density(std::vector<Double_t> &x);
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF density at the point (non-allocating interface)
+    /*! 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
+
+    //! Calculate PDF values for a batch of points. The interpolation weights are shared between 
+    //! the estimated and approximation maps, and the approximation PDF is evaluated for the whole batch at once. 
+    /*!
+        \param [in]  numPoints number of points
+        \param [in]  x array of pointers (one per phase space variable) to arrays of numPoints coordinates
+        \param [out] result array of numPoints PDF values
+    */
+    void densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result);
+
+    //! Calculate PDF value and its gradient at the point. The derivatives of the estimated and 
+    //! approximation map interpolations are exact; the gradient of the approximation PDF is 
+    //! provided by its own densityGradient(). 
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \param [out] grad array of dim partial derivatives of the PDF
+        \return PDF value
+    */
+    Double_t densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const;
 
     //! Return the phase space
     /*! 
@@ -426,6 +479,91 @@ class AdaptiveKernelDensity : public AbsDensity {
     //! Normalise the PDF such that the average PDF value over the allowed phase space equals to 1
     void normalise(void); 
 
+    //! Switch to the baked single-map mode. The final PDF (including the approximation PDF and the 
+    //! fractional mode setting at the time of the call) is calculated in the grid nodes and stored 
+    //! in the estimated map, and the approximation map is released. density() then only needs 
+    //! a single interpolation. Note that the baked PDF is an interpolation of the product rather 
+    //! than the product of interpolations, so the values between the nodes differ slightly. 
+    void bake(void); 
+
+    //! Return true if the density is in the baked single-map mode
+    Bool_t isBaked(void) const { return m_baked; }
+
+    //! Set the memory layout of the maps. With a non-zero tile size the maps are stored in hypercubic tiles 
+    //! of tileSize nodes in each variable, which improves the locality of interpolation and kernel deposition 
+    //! in large 4D and 5D maps. The map values are preserved. 
+    /*! 
+        \param [in] tileSize number of nodes along each edge of a tile, 0 for the row-major layout
+    */ 
+    void setTileSize(UInt_t tileSize); 
+
+    //! Set the sparse memory layout of the maps, in which only the tiles near the phase space are stored 
+    //! (see GridEngine::init()). This saves most of the memory for non-rectangular phase spaces in many dimensions. 
+    //! The maps are filled directly in the sparse layout if it is selected in the constructor options. 
+    //! The summed-volume integral table is not available in the sparse layout. The map values are preserved. 
+    /*! 
+        \param [in] sparse if true, use the sparse layout
+    */ 
+    void setSparse(Bool_t sparse = true); 
+
+    //! Return true if the maps use the sparse layout
+    Bool_t isSparse(void) const { return m_grid.layout() == GridEngine::kSparse; }
+
+    //! Return the options of the maps and of their filling given to the constructor
+    const BinnedOptions &options(void) const { return m_options; }
+
+    //! Set the storage precision of the maps. With reduced precision (float or 16-bit quantised) 
+    //! the maps are filled in double precision and packed afterwards, and the PDF is interpolated 
+    //! directly in the packed maps. The precision can also be given in the constructor options. 
+    /*! 
+        \param [in] precision storage precision
+    */ 
+    void setPrecision(GridMap::Precision precision); 
+
+    //! Return the storage precision of the maps
+    GridMap::Precision precision(void) const { return m_packedMap.precision(); }
+
+    //! Set the interpolation method of the maps. The cubic interpolation is smooth and reaches the accuracy 
+    //! of the multilinear one with a coarser grid. Negative values of the cubic interpolation near sharp edges 
+    //! are truncated at zero. integral() always uses the multilinear interpolation. 
+    /*! 
+        \param [in] interpolation interpolation method
+    */ 
+    void setInterpolation(GridEngine::Interpolation interpolation) { m_interpolation = interpolation; }
+
+    //! Return the interpolation method of the maps
+    GridEngine::Interpolation interpolation(void) const { return m_interpolation; }
+
+    //! Return the grid geometry of the binned maps
+    const GridEngine &grid(void) const { return m_grid; }
+
+    //! Return the estimated map. In the baked mode it contains the final PDF values in grid nodes. 
+    //! The vector is empty if the maps are stored with reduced precision. 
+    const std::vector<Double_t> &map(void) const { return m_map; }
+
+    //! Build the summed-volume table of the map used by integral(). Only available in the baked 
+    //! single-map mode, where the map contains the final PDF values, and not in the sparse layout. 
+    void buildIntegralTable(void); 
+
+    //! Calculate the exact integral of the PDF interpolation over an axis-aligned box. 
+    //! buildIntegralTable() has to be called first. The cost is independent of the map size. 
+    /*!
+        \param [in] lower array of lower box limits in each variable
+        \param [in] upper array of upper box limits in each variable
+        \return integral over the box (the part of the box outside of the grid is ignored)
+    */
+    Double_t integral(const Double_t* lower, const Double_t* upper) const; 
+
+    //! Calculate the exact integral of the PDF interpolation over an axis-aligned box
+    /*!
+        \param [in] lower vector of lower box limits in each variable
+        \param [in] upper vector of upper box limits in each variable
+        \return integral over the box
+    */
+    Double_t integral(std::vector<Double_t> &lower, std::vector<Double_t> &upper) const { 
+      return integral(&(lower[0]), &(upper[0])); 
+    }
+
   private: 
 
     //! Common initialise method used by all constructors. 
@@ -475,6 +613,34 @@ class AdaptiveKernelDensity : public AbsDensity {
 
     void fillMapFromDensity(AbsDensity* theDensity, UInt_t toyEvents = 0); 
 
+    //! Change the memory layout of the maps preserving their values
+    /*! 
+        \param [in] tileSize number of nodes along each edge of a tile
+        \param [in] sparse if true, use the sparse layout
+    */ 
+    void changeLayout(UInt_t tileSize, Bool_t sparse); 
+
+    //! Interpolate the map and, unless the density is baked, the approximation map at a point 
+    //! with the selected interpolation method. In the baked mode the approximation value is set to 1. 
+    /*! 
+        \param [in] x point
+        \param [out] e interpolated value of the map
+        \param [out] a interpolated value of the approximation map
+        \return false if the point is outside the grid (the values are then not set)
+    */ 
+    Bool_t interpolateMaps(const Double_t* x, Double_t* e, Double_t* a) const; 
+
+    //! Interpolate a map and calculate its gradient with the selected interpolation method
+    /*! 
+        \param [in] map map in double precision
+        \param [in] packedMap map with reduced precision (used if not empty)
+        \param [in] x point
+        \param [out] grad array of partial derivatives
+        \return interpolated value
+    */ 
+    Double_t interpolateMapGradient(const std::vector<Double_t> &map, const GridMap &packedMap, 
+                                    const Double_t* x, Double_t* grad) const; 
+
     //! Calculate the raw density using the binned map (estimated or approximation) at a given point
     /*! 
         \param [in] map reference to the bin map
@@ -482,12 +648,25 @@ class AdaptiveKernelDensity : public AbsDensity {
     */ 
     Double_t mapDensity(std::vector<Double_t> &map, std::vector<Double_t> &x);
 
+    //! Pack the maps into the storage with reduced precision and release the double precision maps. 
+    //! Does nothing if the precision is double or the maps are already packed. 
+    void packMaps(void); 
+
+    //! Restore the double precision maps from the packed storage
+    void unpackMaps(void); 
+
     /// Bin map of estimated PDF
     std::vector<Double_t> m_map;
 
     /// Bin map of approximation PDF convolved with the kernel
     std::vector<Double_t> m_approxMap; 
 
+    /// Bin map of estimated PDF stored with reduced precision (empty in double precision)
+    GridMap m_packedMap; 
+
+    /// Bin map of approximation PDF stored with reduced precision (empty in double precision or baked mode)
+    GridMap m_packedApproxMap; 
+
     /// Vector of bin numbers in each variable
     std::vector<UInt_t> m_binning;
 
@@ -506,9 +685,24 @@ class AdaptiveKernelDensity : public AbsDensity {
     /// Cached dimensionality of the phase space
     UInt_t m_dim;
 
+    /// Grid geometry and specialised interpolation and kernel deposition routines
+    GridEngine m_grid; 
+
+    /// Cache of the kernel stencils used while the maps are filled (see BinnedOptions::stencilSubdivisions)
+    StencilCache m_stencils; 
+
     /// Fractional mode flag
     Bool_t m_fractionalMode; 
 
+    /// Baked single-map mode flag
+    Bool_t m_baked; 
+
+    /// Interpolation method of the maps
+    GridEngine::Interpolation m_interpolation; 
+
+    /// Summed-volume table of the baked map for box integrals (empty until built)
+    std::vector<Double_t> m_integralTable; 
+
     /// Minimum value of the width scale PDF to be used for scaling
     Double_t m_minValue; 
 
@@ -521,6 +715,9 @@ class AdaptiveKernelDensity : public AbsDensity {
     /// Maximum width scale factor
     Double_t m_maxScale; 
 
+    /// Options of the maps and of their filling
+    BinnedOptions m_options; 
+
 };
 
 #endif
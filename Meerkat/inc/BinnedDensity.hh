@@ -2,6 +2,8 @@
 #define BINNED_DENSITY
 
 #include "AbsDensity.hh"
+#include "GridEngine.hh"
+#include "BinnedOptions.hh"
 
 #include "TMath.h"
 
@@ -14,7 +16,19 @@ class BinnedDensity : public AbsDensity {
 
   public: 
 
+    //! Operation used to combine several densities node by node
+    enum Operation {
+      kSum     = 0,  //!< sum of the densities
+      kProduct = 1,  //!< product of the densities
+      kRatio   = 2   //!< 1st density divided by all the others (zero in the nodes where a divisor is zero)
+    };
+
     //! Constructor that creates the binned density from any AbsDensity of the dimensionality up to five. 
+    //! The map is normalised such that its average over the nodes inside the phase space equals to 1. 
+    //! The lazy filling is enabled for this density only by a non-zero options.lazyBlockSize: the nodes are then 
+    //! evaluated block by block the first time the interpolation uses them, and the map keeps the values of the 
+    //! input density without normalisation (its average is not known until all nodes are filled). 
+    //! Call fillAllBlocks() and normalise() to obtain the same map as without the lazy filling. 
     /*!  
         \param [in] pdfName PDF name
         \param [in] thePhaseSpace phase space
@@ -24,6 +38,7 @@ class BinnedDensity : public AbsDensity {
         \param [in] bins3 number of bins in 3rd variable
         \param [in] bins4 number of bins in 4th variable
         \param [in] bins5 number of bins in 5th variable
+        \param [in] options options of the map layout, precision and filling (including the lazy block size)
     */ 
     BinnedDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -32,29 +47,57 @@ class BinnedDensity : public AbsDensity {
                   UInt_t bins2 = 0, 
                   UInt_t bins3 = 0, 
                   UInt_t bins4 = 0, 
-                  UInt_t bins5 = 0);
+                  UInt_t bins5 = 0, 
+                  const BinnedOptions &options = BinnedOptions());
 
     //! Constructor that creates the binned density from any AbsDensity of arbitrary dimensionality. 
+    //! The input density is evaluated in the grid nodes in batches, so the constructor can also be used 
+    //! to resample another binned density to a coarser or finer grid. A BinnedDensity or BinnedKernelDensity 
+    //! defined on the same nodes is copied from its stored map without interpolation. 
+    //! The normalisation and the lazy filling are the same as for the constructor with the fixed dimensionality. 
     /*! 
         \param [in] pdfName PDF name
         \param [in] thePhaseSpace phase space
         \param [in] binning vector of bin numbers for each variable. Vector size should match the dimensionality of the phase space. 
         \param [in] d input density
+        \param [in] options options of the map layout, precision and filling (including the lazy block size)
+    */ 
+    BinnedDensity(const char* pdfName, 
+                  AbsPhaseSpace* thePhaseSpace, 
+                  std::vector<UInt_t> &binning, 
+                  AbsDensity* d, 
+                  const BinnedOptions &options = BinnedOptions());
+
+    //! Constructor that combines two or more densities node by node into a new binned density 
+    //! (e.g. the ratio of two efficiency maps). The densities are evaluated in the grid nodes as in the constructor 
+    //! from a single density: the binned densities defined on the same nodes contribute their stored maps directly, 
+    //! the other ones are resampled to this grid. The combined map is not normalised (see normalise()). 
+    /*! 
+        \param [in] pdfName PDF name
+        \param [in] thePhaseSpace phase space
+        \param [in] binning vector of bin numbers for each variable. Vector size should match the dimensionality of the phase space. 
+        \param [in] densities vector of input densities (at least one)
+        \param [in] op operation applied to the node values in the order of the densities
+        \param [in] options options of the map layout, precision and filling (the lazy filling is not used)
     */ 
     BinnedDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
                   std::vector<UInt_t> &binning, 
-                  AbsDensity* d);
+                  std::vector<AbsDensity*> &densities, 
+                  Operation op, 
+                  const BinnedOptions &options = BinnedOptions()); 
 
     //! Constructor that reads the binned density from a file. The dimensionality of the density stored in the file should match the dimensionality of the phase space. 
     /*! 
         \param [in] pdfName PDF name
         \param [in] thePhaseSpace phase space
         \param [in] fileName input file name
+        \param [in] options options of the map layout and precision (the filling options are not used)
     */ 
     BinnedDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
-                  const char* fileName); 
+                  const char* fileName, 
+                  const BinnedOptions &options = BinnedOptions()); 
 
     //! Destructor
     virtual ~BinnedDensity(); 
@@ -100,7 +143,33 @@ class BinnedDensity : public AbsDensity {
         \param [in] x point
         \return PDF value
     */ 
-    Double_t density(std::vector<Double_t> &x);
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF density at the point (non-allocating interface)
+    /*! 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
+
+    //! Calculate PDF values for a batch of points
+    /*!
+        \param [in]  numPoints number of points
+        \param [in]  x array of pointers (one per phase space variable) to arrays of numPoints coordinates
+        \param [out] result array of numPoints PDF values
+    */
+    void densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result);
+
+    //! Calculate PDF value and its gradient at the point. The gradient is the exact derivative 
+    //! of the multilinear interpolation inside the grid cell containing the point. 
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \param [out] grad array of dim partial derivatives of the PDF
+        \return PDF value
+    */
+    Double_t densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const;
 
     //! Return the phase space
     /*! 
@@ -108,8 +177,155 @@ class BinnedDensity : public AbsDensity {
     */ 
     AbsPhaseSpace* phaseSpace() { return m_phaseSpace; }
 
+    //! Add another density to this one node by node: map = map + c*d. 
+    //! Input density is evaluated in the nodes of this grid. A BinnedDensity or BinnedKernelDensity defined 
+    //! on the same nodes contributes its stored node values directly, other densities are interpolated. 
+    /*! 
+        \param [in] d density to add
+        \param [in] c scale factor
+    */ 
+    void add(AbsDensity* d, Double_t c = 1.); 
+
+    //! Multiply this density by another one node by node
+    /*! 
+        \param [in] d density to multiply by
+    */ 
+    void multiply(AbsDensity* d); 
+
+    //! Divide this density by another one node by node. Nodes where the divisor is zero are set to zero. 
+    /*! 
+        \param [in] d density to divide by
+    */ 
+    void divide(AbsDensity* d); 
+
+    //! Scale the map by a constant factor
+    /*! 
+        \param [in] c scale factor
+    */ 
+    void scale(Double_t c); 
+
+    //! Normalise the map such that its average over the nodes inside the phase space equals to 1
+    void normalise(void); 
+
+    //! Set the memory layout of the map. With a non-zero tile size the map is stored in hypercubic tiles 
+    //! of tileSize nodes in each variable, which improves the locality of interpolation in large 4D and 5D maps. 
+    //! The map values are preserved. The layout of the new map can also be given in the constructor options. 
+    /*! 
+        \param [in] tileSize number of nodes along each edge of a tile, 0 for the row-major layout
+    */ 
+    void setTileSize(UInt_t tileSize); 
+
+    //! Switch the map to the sparse tiled layout, where only the tiles overlapping the phase space 
+    //! are stored (see GridEngine). Saves memory for non-rectangular phase spaces such as Dalitz plots. 
+    //! The values in the nodes outside the stored tiles read as zero. 
+    /*! 
+        \param [in] sparse true for the sparse layout, false for the dense one
+    */ 
+    void setSparse(Bool_t sparse = true); 
+
+    //! Return true if the map uses the sparse tiled layout
+    Bool_t isSparse(void) const { return m_grid.sparse(); } 
+
+    //! Set the storage precision of the map. With reduced precision (float or 16-bit quantised) 
+    //! the map is packed after it is filled and the PDF is interpolated directly in the packed map. 
+    //! The precision of the new map can also be given in the constructor options. 
+    /*! 
+        \param [in] precision storage precision
+    */ 
+    void setPrecision(GridMap::Precision precision); 
+
+    //! Return the storage precision of the map
+    GridMap::Precision precision(void) const { return m_packedMap.precision(); }
+
+    //! Set the interpolation method. The cubic interpolation is smooth and reaches the accuracy 
+    //! of the multilinear one with a coarser grid. It can undershoot near sharp edges, so negative 
+    //! values are truncated at zero. integral() always uses the multilinear interpolation. 
+    /*! 
+        \param [in] interpolation interpolation method
+    */ 
+    void setInterpolation(GridEngine::Interpolation interpolation) { m_interpolation = interpolation; }
+
+    //! Return the interpolation method
+    GridEngine::Interpolation interpolation(void) const { return m_interpolation; }
+
+    //! Set the number of threads used to evaluate the input density in the grid nodes in add(), multiply() 
+    //! and divide() (the constructors use BinnedOptions::fillThreads). With more than one thread, the input density 
+    //! should support concurrent calls of densityBatch(). The resulting map does not depend on the number of threads. 
+    /*! 
+        \param [in] numThreads number of threads
+    */ 
+    void setFillThreads(UInt_t numThreads) { m_options.fillThreads = (numThreads > 0) ? numThreads : 1; }
+
+    //! Return the number of threads used to evaluate the input density in the grid nodes
+    UInt_t fillThreads() const { return m_options.fillThreads; }
+
+    //! Return the options of the map. The layout and precision follow setTileSize(), setSparse() and setPrecision().
+    const BinnedOptions &options(void) const { return m_options; }
+
+    //! Return the block size of the lazy filling (0 if the map is completely filled). 
+    //! The lazily filled map is not normalised (see the constructor). 
+    UInt_t lazyBlockSize(void) const { return m_lazyBlockSize; }
+
+    //! Return the number of blocks filled so far in the lazy mode
+    UInt_t filledBlocks(void) const; 
+
+    //! Evaluate the input density in all nodes which are not filled yet and leave the lazy mode. 
+    //! Called automatically by the functions which need the complete map (algebra, normalisation, writing, integrals). 
+    void fillAllBlocks(void); 
+
+    //! Write the blocks filled so far in the lazy mode into a text file, 
+    //! so that they can be reused by readFilledBlocks() in the next job. 
+    /*! 
+        \param [in] fileName output file name
+    */ 
+    void writeFilledBlocks(const char* fileName); 
+
+    //! Read the blocks written by writeFilledBlocks() into the lazily filled map. 
+    //! The binning and the block size should match the ones of this map. 
+    /*! 
+        \param [in] fileName input file name
+    */ 
+    void readFilledBlocks(const char* fileName); 
+
+    //! Return the grid geometry of the binned map
+    const GridEngine &grid(void) const { return m_grid; }
+
+    //! Return the map of PDF values in grid nodes (empty if the map is stored with reduced precision, 
+    //! zero in the nodes not filled yet in the lazy mode)
+    const std::vector<Double_t> &map(void) const { return m_map; }
+
+    //! Build the summed-volume table of the map used by integral(). Not available in the sparse layout. 
+    void buildIntegralTable(void); 
+
+    //! Calculate the exact integral of the PDF interpolation over an axis-aligned box. 
+    //! buildIntegralTable() has to be called first. The cost is independent of the map size. 
+    /*!
+        \param [in] lower array of lower box limits in each variable
+        \param [in] upper array of upper box limits in each variable
+        \return integral over the box (the part of the box outside of the grid is ignored)
+    */
+    Double_t integral(const Double_t* lower, const Double_t* upper) const; 
+
+    //! Calculate the exact integral of the PDF interpolation over an axis-aligned box
+    /*!
+        \param [in] lower vector of lower box limits in each variable
+        \param [in] upper vector of upper box limits in each variable
+        \return integral over the box
+    */
+    Double_t integral(std::vector<Double_t> &lower, std::vector<Double_t> &upper) const { 
+      return integral(&(lower[0]), &(upper[0])); 
+    }
+
   private: 
 
+    //! Set up the grid and the empty map. 
+    /*! 
+        \param [in] thePhaseSpace phase space
+        \param [in] binning vector of bin numbers for each variable. Vector size should match the dimensionality of the phase space. 
+    */ 
+    void initGrid(AbsPhaseSpace* thePhaseSpace, 
+                  std::vector<UInt_t> &binning); 
+
     //! Common initalisation function used by both constructors from an AbsDensity. 
     /*! 
         \param [in] thePhaseSpace phase space
@@ -120,8 +336,107 @@ class BinnedDensity : public AbsDensity {
               std::vector<UInt_t> &binning, 
               AbsDensity* d);
 
-    //! Map of PDF values in bins
-    std::vector<Double_t> m_map;
+    //! Evaluate a density in all grid nodes. 
+    /*! 
+        \param [in] d density
+        \param [out] values vector of density values in the nodes (same layout as the map)
+        \return average density value over the nodes inside the phase space
+    */ 
+    Double_t nodeValues(AbsDensity* d, std::vector<Double_t> &values); 
+
+    //! Pack the map into the storage with reduced precision and release the double precision map. 
+    //! Does nothing if the precision is double or the map is already packed. 
+    void packMap(void); 
+
+    //! Restore the double precision map from the packed storage
+    void unpackMap(void); 
+
+    //! Copy the node values of a binned density defined on the same nodes 
+    //! (BinnedDensity or BinnedKernelDensity) into the layout of this map. 
+    /*! 
+        \param [in] d density
+        \param [out] values vector of density values in the nodes (same layout as the map)
+        \return false if the density is not binned on the same nodes, then the values are not filled
+    */ 
+    Bool_t storedNodeValues(AbsDensity* d, std::vector<Double_t> &values) const; 
+
+    //! Return the average of the node values over the nodes inside the phase space
+    /*! 
+        \param [in] values vector of values in the nodes (same layout as the map)
+        \return average value
+    */ 
+    Double_t phaseSpaceAverage(const std::vector<Double_t> &values) const; 
+
+    //! Combine the double precision map with the node values of another density
+    /*! 
+        \param [in] values vector of values in the nodes (same layout as the map)
+        \param [in] op operation
+        \param [in] c scale factor of the values (sum only)
+    */ 
+    void combineMap(const std::vector<Double_t> &values, Operation op, Double_t c = 1.); 
+
+    //! Evaluate a density in the chunks of grid nodes taken from a shared counter until all chunks are done. 
+    //! Called from each thread of nodeValues(). 
+    /*! 
+        \param [in] d density
+        \param [in,out] nextChunk counter of the chunks taken (updated atomically)
+        \param [in,out] doneNodes counter of the nodes evaluated (updated atomically)
+        \param [out] values vector of density values in the nodes (same layout as the map)
+        \param [out] inPhsp vector of flags of the nodes inside the phase space (logical order of the nodes)
+        \param [in] progress print the progress messages
+    */ 
+    void nodeValuesRange(AbsDensity* d, UInt_t* nextChunk, UInt_t* doneNodes, 
+                         std::vector<Double_t> &values, std::vector<Char_t> &inPhsp, Bool_t progress); 
+
+    //! Set up the block structure of the lazy filling
+    /*! 
+        \param [in] blockSize number of nodes along each edge of a block
+    */ 
+    void initLazy(UInt_t blockSize); 
+
+    //! Rebuild the map in a new memory layout preserving its values
+    /*! 
+        \param [in] tileSize tile size
+        \param [in] sparse sparse layout flag
+    */ 
+    void changeLayout(UInt_t tileSize, Bool_t sparse); 
+
+    //! Print the size of the sparse map after initialisation and check that it fits into memory
+    void checkSparseSize(void); 
+
+    //! Fill the blocks containing the vertices of the grid cell of a point
+    /*! 
+        \param [in] x point
+    */ 
+    void ensureFilled(const Double_t* x) const; 
+
+    //! Evaluate the input density in the nodes of a block and mark the block as filled. 
+    //! Can be called from several threads at once. 
+    /*! 
+        \param [in] block block index
+    */ 
+    void fillBlock(UInt_t block) const; 
+
+    //! Return the coordinates and the map indices of the nodes of a block
+    /*! 
+        \param [in] block block index
+        \param [out] nodes vectors of node coordinates in each variable
+        \param [out] index vector of map indices of the nodes
+    */ 
+    void blockNodes(UInt_t block, std::vector< std::vector<Double_t> > &nodes, std::vector<UInt_t> &index) const; 
+
+    //! Return the map value in a node from the storage in use
+    /*! 
+        \param [in] index map index of the node
+        \return map value
+    */ 
+    Double_t mapValue(UInt_t index) const { return (m_packedMap.size() > 0) ? m_packedMap.value(index) : m_map[index]; }
+
+    //! Map of PDF values in bins (filled by the const interpolation calls in the lazy mode)
+    mutable std::vector<Double_t> m_map;
+
+    //! Map of PDF values stored with reduced precision (empty in double precision)
+    GridMap m_packedMap; 
 
     //! Vector of bin numbers for each variable
     std::vector<UInt_t> m_binning;
@@ -132,6 +447,33 @@ class BinnedDensity : public AbsDensity {
     //! Reference to the input density
     AbsDensity* m_density; 
 
+    //! Grid geometry and specialised interpolation routines
+    GridEngine m_grid; 
+
+    //! Interpolation method
+    GridEngine::Interpolation m_interpolation; 
+
+    //! Summed-volume table of the map for box integrals (empty until built)
+    std::vector<Double_t> m_integralTable; 
+
+    //! Block size of the lazy filling (0 if the map is completely filled)
+    UInt_t m_lazyBlockSize; 
+
+    //! Number of blocks in each variable
+    std::vector<UInt_t> m_blockCount; 
+
+    //! Block index stride in each variable
+    std::vector<UInt_t> m_blockStride; 
+
+    //! Block filled flags (accessed atomically)
+    mutable std::vector<Char_t> m_blockFilled; 
+
+    //! Spin lock flags of the blocks
+    mutable std::vector<Char_t> m_blockLocks; 
+
+    //! Options of the map layout, precision and filling
+    BinnedOptions m_options; 
+
 };
 
 #endif
@@ -2,11 +2,16 @@
 #define BINNED_KERNEL_DENSITY
 
 #include "AbsDensity.hh"
+#include "GridEngine.hh"
+#include "BinnedOptions.hh"
+#include "StencilCache.hh"
 
 #include "TMath.h"
 
 #include <vector>
 
+class GridConvolution; 
+
 class BinnedKernelDensity : public AbsDensity {
 
   public: 
@@ -23,6 +28,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -33,7 +39,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0, 
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 1-dimensional kernel PDF with binned interpolation from the sample of points in an NTuple with weight. 
@@ -49,6 +56,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -60,7 +68,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0, 
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 2-dimensional kernel PDF with binned interpolation from the sample of points in an NTUple. 
@@ -78,6 +87,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -88,7 +98,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 2-dimensional kernel PDF with binned interpolation from the sample of points in an NTuple with weight. 
@@ -107,6 +118,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -118,7 +130,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 3-dimensional kernel PDF with binned interpolation from the sample of points in an NTUple. 
@@ -139,6 +152,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
 
     BinnedKernelDensity(const char* pdfName, 
@@ -150,7 +164,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 3-dimensional kernel PDF with binned interpolation from the sample of points in an NTuple with weight. 
@@ -172,6 +187,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
 
     BinnedKernelDensity(const char* pdfName, 
@@ -184,7 +200,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 4-dimensional kernel PDF with binned interpolation from the sample of points in an NTuple. 
@@ -208,6 +225,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -218,7 +236,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 4-dimensional kernel PDF with binned interpolation from the sample of points in an NTuple with weight. 
@@ -243,6 +262,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -254,7 +274,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 5-dimensional kernel PDF with binned interpolation from the sample of points in an NTuple. 
@@ -281,6 +302,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -291,7 +313,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for 5-dimensional kernel PDF with binned interpolation from the sample of points in an NTuple with weight. 
@@ -319,6 +342,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -330,7 +354,8 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0,
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Constructor for kernel PDF with binned interpolation of arbitrary dimensionality from the sample of points in an NTuple. 
@@ -345,6 +370,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
     */ 
     BinnedKernelDensity(const char* pdfName, 
                   AbsPhaseSpace* thePhaseSpace, 
@@ -355,7 +381,44 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0, 
                   UInt_t maxEvents = 0,
-                  UInt_t skipEvents = 0
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
+                  );
+
+    //! Constructor for kernel PDF with binned interpolation of arbitrary dimensionality from the sample of points in an NTuple, 
+    //! which chooses the coarsest binning in each variable that keeps the interpolation error within the tolerance. 
+    //! The error is the RMS difference between the PDFs with the trial binning and with the binning twice finer in one 
+    //! of the variables (scaled as for the quadratic interpolation error), summed over the variables and 
+    //! divided by the average PDF value, over the random points in the phase space. 
+    //! The search starts from the node spacing equal to the kernel width and builds dim+1 trial PDFs per iteration 
+    //! (typically 2-3 iterations). The trial PDFs use at most 100000 NTuple events (every n-th event across the whole 
+    //! range, so that a sorted NTuple gives an unbiased subsample) and toy events, so the cost of the search 
+    //! does not grow with the sample size beyond that, and the statistical noise of the subsample 
+    //! makes the estimated error conservative. The trial PDFs are built with the same options as this density. 
+    /*! 
+        \param [in] pdfName PDF name
+        \param [in] thePhaseSpace phase space
+        \param [in] tree ROOT NTuple 
+        \param [in] vars vector of variable names. The size of vector should match the dimensionality of phase space or be larger by one.
+        \param [in] width vector of kernel widths. The size of vector should match the dimensionality of phase space.
+        \param [in] tolerance maximum relative interpolation error
+        \param [in] approx approximation PDF. Uniform approximation is used for approx=0
+        \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
+        \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
+        \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] options options of the map layout, precision and filling
+    */ 
+    BinnedKernelDensity(const char* pdfName, 
+                  AbsPhaseSpace* thePhaseSpace, 
+                  TTree* tree, 
+                  std::vector<TString> &vars, 
+                  std::vector<Double_t> &width, 
+                  Double_t tolerance, 
+                  AbsDensity* approx = 0, 
+                  UInt_t toyEvents = 0, 
+                  UInt_t maxEvents = 0,
+                  UInt_t skipEvents = 0, 
+                  const BinnedOptions &options = BinnedOptions()
                   );
 
     //! Destructor
@@ -385,7 +448,35 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] x point
         \return PDF value
     */
-    Double_t density(std::vector<Double_t> &x);
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF density at the point (non-allocating interface)
+    /*! 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
+
+    //! Calculate PDF values for a batch of points. The interpolation weights are shared between 
+    //! the estimated and approximation maps, and the approximation PDF is evaluated for the whole batch at once. 
+    /*!
+        \param [in]  numPoints number of points
+        \param [in]  x array of pointers (one per phase space variable) to arrays of numPoints coordinates
+        \param [out] result array of numPoints PDF values
+    */
+    void densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result);
+
+    //! Calculate PDF value and its gradient at the point. The derivatives of the estimated and 
+    //! approximation map interpolations are exact; the gradient of the approximation PDF is 
+    //! provided by its own densityGradient(). 
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \param [out] grad array of dim partial derivatives of the PDF
+        \return PDF value
+    */
+    Double_t densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const;
 
     //! Return the phase space
     /*! 
@@ -402,8 +493,115 @@ class BinnedKernelDensity : public AbsDensity {
     //! Normalise the PDF such that the average PDF value over the allowed phase space equals to 1
     void normalise(void); 
 
+    //! Switch to the baked single-map mode. The final PDF (including the approximation PDF and the 
+    //! fractional mode setting at the time of the call) is calculated in the grid nodes and stored 
+    //! in the estimated map, and the approximation map is released. density() then only needs 
+    //! a single interpolation. Note that the baked PDF is an interpolation of the product rather 
+    //! than the product of interpolations, so the values between the nodes differ slightly. 
+    void bake(void); 
+
+    //! Return true if the density is in the baked single-map mode
+    Bool_t isBaked(void) const { return m_baked; }
+
+    //! Calculate the PDF values in the grid nodes from the stored maps (the values which bake() stores). 
+    //! Unless the density is baked, the approximation PDF is evaluated in the nodes in batches. 
+    /*! 
+        \param [out] values vector of PDF values in the nodes (same layout as the map, zero in the nodes 
+                     which are not stored in the sparse layout)
+    */ 
+    void nodeDensities(std::vector<Double_t> &values) const; 
+
+    //! Set the memory layout of the maps. With a non-zero tile size the maps are stored in hypercubic tiles 
+    //! of tileSize nodes in each variable, which improves the locality of interpolation and kernel deposition 
+    //! in large 4D and 5D maps. The map values are preserved. 
+    /*! 
+        \param [in] tileSize number of nodes along each edge of a tile, 0 for the row-major layout
+    */ 
+    void setTileSize(UInt_t tileSize); 
+
+    //! Set the sparse memory layout of the maps, in which only the tiles near the phase space are stored 
+    //! (see GridEngine::init()). This saves most of the memory for non-rectangular phase spaces in many dimensions. 
+    //! The maps are filled directly in the sparse layout if it is selected in the constructor options. 
+    //! The summed-volume integral table is not available in the sparse layout. The map values are preserved. 
+    /*! 
+        \param [in] sparse if true, use the sparse layout
+    */ 
+    void setSparse(Bool_t sparse = true); 
+
+    //! Return true if the maps use the sparse layout
+    Bool_t isSparse(void) const { return m_grid.layout() == GridEngine::kSparse; }
+
+    //! Set the storage precision of the maps. With reduced precision (float or 16-bit quantised) 
+    //! the maps are filled in double precision and packed afterwards, and the PDF is interpolated 
+    //! directly in the packed maps. The precision can also be given in the constructor options. 
+    /*! 
+        \param [in] precision storage precision
+    */ 
+    void setPrecision(GridMap::Precision precision); 
+
+    //! Return the options of the maps and of their filling given to the constructor
+    const BinnedOptions &options(void) const { return m_options; }
+
+    //! Return the numbers of bins in each variable
+    const std::vector<UInt_t> &binning(void) const { return m_binning; }
+
+    //! Return the estimated relative interpolation error of the automatically chosen binning, 
+    //! or 0 if the binning was given explicitly
+    Double_t binningError(void) const { return m_binningError; }
+
+    //! Return the storage precision of the maps
+    GridMap::Precision precision(void) const { return m_packedMap.precision(); }
+
+    //! Set the interpolation method of the maps. The cubic interpolation is smooth and reaches the accuracy 
+    //! of the multilinear one with a coarser grid. Negative values of the cubic interpolation near sharp edges 
+    //! are truncated at zero. integral() always uses the multilinear interpolation. 
+    /*! 
+        \param [in] interpolation interpolation method
+    */ 
+    void setInterpolation(GridEngine::Interpolation interpolation) { m_interpolation = interpolation; }
+
+    //! Return the interpolation method of the maps
+    GridEngine::Interpolation interpolation(void) const { return m_interpolation; }
+
+    //! Return the grid geometry of the binned maps
+    const GridEngine &grid(void) const { return m_grid; }
+
+    //! Return the estimated map. In the baked mode it contains the final PDF values in grid nodes. 
+    //! The vector is empty if the maps are stored with reduced precision. 
+    const std::vector<Double_t> &map(void) const { return m_map; }
+
+    //! Build the summed-volume table of the map used by integral(). Only available in the baked 
+    //! single-map mode, where the map contains the final PDF values, and not in the sparse layout. 
+    void buildIntegralTable(void); 
+
+    //! Calculate the exact integral of the PDF interpolation over an axis-aligned box. 
+    //! buildIntegralTable() has to be called first. The cost is independent of the map size. 
+    /*!
+        \param [in] lower array of lower box limits in each variable
+        \param [in] upper array of upper box limits in each variable
+        \return integral over the box (the part of the box outside of the grid is ignored)
+    */
+    Double_t integral(const Double_t* lower, const Double_t* upper) const; 
+
+    //! Calculate the exact integral of the PDF interpolation over an axis-aligned box
+    /*!
+        \param [in] lower vector of lower box limits in each variable
+        \param [in] upper vector of upper box limits in each variable
+        \return integral over the box
+    */
+    Double_t integral(std::vector<Double_t> &lower, std::vector<Double_t> &upper) const { 
+      return integral(&(lower[0]), &(upper[0])); 
+    }
+
   private: 
 
+    //! Constructor of an empty density, which is then filled by init(). Used for the trial densities of the binning selection. 
+    /*! 
+        \param [in] pdfName PDF name
+        \param [in] options map options
+    */ 
+    BinnedKernelDensity(const char* pdfName, const BinnedOptions &options); 
+
     //! Common initialise method used by all constructors. 
     /*! 
         \param [in] thePhaseSpace phase space
@@ -415,6 +613,7 @@ class BinnedKernelDensity : public AbsDensity {
         \param [in] toyEvents number of toy events for MC convolution of the approximation PDF. Use binned convolution if toyEvents=0
         \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
         \param [in] skipEvents number of NTuple events to skip from the beginning
+        \param [in] stride only every stride-th NTuple event is read (used for the trial densities of the binning selection)
     */ 
     void init(AbsPhaseSpace* thePhaseSpace, 
                   TTree* tree, 
@@ -424,7 +623,26 @@ class BinnedKernelDensity : public AbsDensity {
                   AbsDensity* approx = 0, 
                   UInt_t toyEvents = 0, 
                   UInt_t maxEvents = 0, 
-                  UInt_t skipEvents = 0 
+                  UInt_t skipEvents = 0, 
+                  UInt_t stride = 1 
+                  );
+
+    //! Choose the coarsest binning which keeps the estimated interpolation error within the tolerance. 
+    //! Parameters are the same as for the constructor. 
+    /*! 
+        \param [out] error estimated relative interpolation error with the chosen binning
+        \return vector of numbers of bins
+    */ 
+    std::vector<UInt_t> chooseBinning(AbsPhaseSpace* thePhaseSpace, 
+                  TTree* tree, 
+                  std::vector<TString> &vars, 
+                  std::vector<Double_t> &width, 
+                  Double_t tolerance, 
+                  AbsDensity* approx, 
+                  UInt_t toyEvents, 
+                  UInt_t maxEvents, 
+                  UInt_t skipEvents, 
+                  Double_t* error
                   );
 
     //! Convert an N-dimensional iterator vector into a linear bin index in the bin map
@@ -442,10 +660,73 @@ class BinnedKernelDensity : public AbsDensity {
     */ 
     void addToMap(std::vector<Double_t> &map, std::vector<Double_t> &point, Double_t weight = 1.); 
 
-    void fillMapFromTree( TTree* tree, std::vector<TString> &vars, UInt_t maxEvents = 0, UInt_t skipEvents = 0);
+    //! Add a kernel density of a single data point to the binned map. 
+    /*! 
+        \param [in] map pointer to the binned map
+        \param [in] point array of data point coordinates
+        \param [in] weight point weight
+    */ 
+    void addToMap(std::vector<Double_t> &map, const Double_t* point, Double_t weight); 
+
+    void fillMapFromTree( TTree* tree, std::vector<TString> &vars, UInt_t maxEvents = 0, UInt_t skipEvents = 0, UInt_t stride = 1);
+
+    //! Deposit the kernels of a part of a block of events. Called from each filling thread. 
+    /*! 
+        \param [in,out] map map (or its copy owned by the thread)
+        \param [in] points event coordinates (dim values per event)
+        \param [in] weights event weights
+        \param [in] part index of the range of events in the static partition
+        \param [in] numParts number of ranges in the static partition
+        \param [in,out] nextChunk counter of the chunks for the dynamic distribution, 0 for the static partition
+    */ 
+    void depositEvents(std::vector<Double_t>* map, const std::vector<Double_t>* points, 
+                       const std::vector<Double_t>* weights, UInt_t part, UInt_t numParts, UInt_t* nextChunk); 
+
+    //! Set up the FFT convolution with the kernel of the density and print the padded grid and its memory
+    /*! 
+        \param [out] convolution convolution
+        \return false if the padded grid is too large, then the kernels are deposited directly
+    */ 
+    Bool_t initConvolution(GridConvolution &convolution); 
+
+    //! Add the copies of the map filled by the threads to the map in a range of nodes
+    /*! 
+        \param [in] shards map copies of the threads (the first one is unused)
+        \param [in] part index of the range of nodes
+        \param [in] numParts number of ranges
+    */ 
+    void reduceShards(std::vector< std::vector<Double_t> >* shards, UInt_t part, UInt_t numParts); 
 
     void fillMapFromDensity(AbsDensity* density, UInt_t toyEvents = 0); 
 
+    //! Change the memory layout of the maps preserving their values
+    /*! 
+        \param [in] tileSize number of nodes along each edge of a tile
+        \param [in] sparse if true, use the sparse layout
+    */ 
+    void changeLayout(UInt_t tileSize, Bool_t sparse); 
+
+    //! Interpolate the map and, unless the density is baked, the approximation map at a point 
+    //! with the selected interpolation method. In the baked mode the approximation value is set to 1. 
+    /*! 
+        \param [in] x point
+        \param [out] e interpolated value of the map
+        \param [out] a interpolated value of the approximation map
+        \return false if the point is outside the grid (the values are then not set)
+    */ 
+    Bool_t interpolateMaps(const Double_t* x, Double_t* e, Double_t* a) const; 
+
+    //! Interpolate a map and calculate its gradient with the selected interpolation method
+    /*! 
+        \param [in] map map in double precision
+        \param [in] packedMap map with reduced precision (used if not empty)
+        \param [in] x point
+        \param [out] grad array of partial derivatives
+        \return interpolated value
+    */ 
+    Double_t interpolateMapGradient(const std::vector<Double_t> &map, const GridMap &packedMap, 
+                                    const Double_t* x, Double_t* grad) const; 
+
     //! Calculate the raw density using the binned map (estimated or approximation) at a given point
     /*! 
         \param [in] map reference to the bin map
@@ -453,12 +734,25 @@ class BinnedKernelDensity : public AbsDensity {
     */ 
     Double_t mapDensity(std::vector<Double_t> &map, std::vector<Double_t> &x);
 
+    //! Pack the maps into the storage with reduced precision and release the double precision maps. 
+    //! Does nothing if the precision is double or the maps are already packed. 
+    void packMaps(void); 
+
+    //! Restore the double precision maps from the packed storage
+    void unpackMaps(void); 
+
     /// Bin map of estimated PDF
     std::vector<Double_t> m_map;
 
     /// Bin map of approximation PDF convolved with the kernel
     std::vector<Double_t> m_approxMap; 
 
+    /// Bin map of estimated PDF stored with reduced precision (empty in double precision)
+    GridMap m_packedMap; 
+
+    /// Bin map of approximation PDF stored with reduced precision (empty in double precision or baked mode)
+    GridMap m_packedApproxMap; 
+
     /// Vector of bin numbers in each variable
     std::vector<UInt_t> m_binning;
 
@@ -474,9 +768,30 @@ class BinnedKernelDensity : public AbsDensity {
     /// Cached dimensionality of the phase space
     UInt_t m_dim;
 
+    /// Grid geometry and specialised interpolation and kernel deposition routines
+    GridEngine m_grid; 
+
+    /// Cache of the kernel stencils used while the maps are filled (see BinnedOptions::stencilSubdivisions)
+    StencilCache m_stencils; 
+
     /// Fractional mode flag
     Bool_t m_fractionalMode; 
 
+    /// Baked single-map mode flag
+    Bool_t m_baked; 
+
+    /// Interpolation method of the maps
+    GridEngine::Interpolation m_interpolation; 
+
+    /// Estimated interpolation error of the automatically chosen binning
+    Double_t m_binningError; 
+
+    /// Summed-volume table of the baked map for box integrals (empty until built)
+    std::vector<Double_t> m_integralTable; 
+
+    /// Options of the maps and of their filling
+    BinnedOptions m_options; 
+
 };
 
 #endif
@@ -0,0 +1,96 @@
+#ifndef BINNED_OPTIONS
+#define BINNED_OPTIONS
+
+#include "GridMap.hh"
+
+#include "TMath.h"
+
+/// Options of the binned maps and of their filling, passed to the constructors of the binned densities
+/// (BinnedDensity, BinnedKernelDensity, AdaptiveKernelDensity). Each density keeps its own copy, so the options
+/// of one density do not affect any other one. The default options give the row-major maps in double precision
+/// filled in a single thread, as the constructors without the options.
+
+struct BinnedOptions {
+
+  //! Method of the convolution of the node values with the kernel when the maps of the kernel densities are filled
+  enum Convolution {
+    kDirect = 0,  //!< deposition of the kernels over their footprints
+    kFFT    = 1   //!< fast Fourier transform on the zero-padded grid
+  };
+
+  //! Constructor with the default options
+  BinnedOptions() :
+    tileSize(0),
+    sparse(false),
+    precision(GridMap::kDouble),
+    fillThreads(1),
+    lazyBlockSize(0),
+    reproducibleFill(true),
+    linearBinning(false),
+    dataConvolution(kDirect),
+    approxConvolution(kDirect),
+    stencilSubdivisions(0),
+    stencilScaleSteps(64),
+    stencilMaxMemory(256*1024*1024) {}
+
+  //! Number of nodes along each edge of a tile of the map layout, 0 for the row-major layout.
+  //! Tiles keep the neighbouring nodes in all variables close in memory for large 4D and 5D maps (see GridEngine).
+  UInt_t tileSize;
+
+  //! Sparse map layout: only the tiles near the phase space are stored (see GridEngine::init()).
+  //! Saves most of the memory for non-rectangular phase spaces in many dimensions.
+  Bool_t sparse;
+
+  //! Storage precision of the maps. With reduced precision the maps are filled in double precision,
+  //! packed afterwards and interpolated directly in the packed storage (see GridMap).
+  GridMap::Precision precision;
+
+  //! Number of threads filling the map: evaluation of the input density in the grid nodes for BinnedDensity
+  //! (the density should then support concurrent calls of densityBatch()), deposition of the NTuple events
+  //! for BinnedKernelDensity (each additional thread keeps its own copy of the map).
+  UInt_t fillThreads;
+
+  //! BinnedDensity from an AbsDensity only: block size of the lazy filling, 0 to fill the map in the constructor.
+  //! With a non-zero block size the nodes are evaluated in hypercubic blocks of lazyBlockSize nodes in each variable
+  //! the first time the interpolation uses a block. The lazily filled map is NOT normalised
+  //! (see BinnedDensity::lazyBlockSize()).
+  UInt_t lazyBlockSize;
+
+  //! BinnedKernelDensity only: each filling thread deposits a fixed contiguous range of every block of events,
+  //! so that the map is bit-identical between runs with the same number of threads. Otherwise the events
+  //! are distributed dynamically, which balances the load better but makes the map depend on the scheduling
+  //! at the level of rounding errors.
+  Bool_t reproducibleFill;
+
+  //! BinnedKernelDensity only: the weight of each NTuple event is distributed between the vertices of its grid cell
+  //! with the multilinear interpolation weights, and the kernels are then deposited once per non-empty node.
+  //! The filling time scales with the grid size rather than with the sample size, the error is of second order
+  //! in the node spacing relative to the kernel width.
+  Bool_t linearBinning;
+
+  //! BinnedKernelDensity only: convolution method for the map of the NTuple events.
+  //! The FFT convolution is applied to the linearly binned events, its cost does not depend on the kernel width.
+  //! The grid is padded in each variable to a power of two not smaller than the number of bins plus the kernel
+  //! half-width in nodes, and the convolution keeps four double arrays over the padded grid (the transforms
+  //! of the node values and of the kernel), i.e. 32 bytes per padded node. Padded grids larger than 2^25 nodes
+  //! (1 GiB) are not used, the kernels are then deposited directly. The events are deposited in a single thread.
+  Convolution dataConvolution;
+
+  //! BinnedKernelDensity only: convolution method for the approximation map filled in the grid nodes (toyEvents=0).
+  //! The FFT result equals the direct deposition up to rounding. The memory is the same as for dataConvolution.
+  Convolution approxConvolution;
+
+  //! Number of sub-nodes per grid cell of the kernel stencil cache (see StencilCache),
+  //! 0 to deposit the kernels of the kernel densities directly
+  UInt_t stencilSubdivisions;
+
+  //! Number of steps of the width scale lattice of the stencil cache per doubling of the scale
+  //! (AdaptiveKernelDensity only)
+  UInt_t stencilScaleSteps;
+
+  //! Maximum memory of the stencil cache in bytes
+  ULong64_t stencilMaxMemory;
+
+};
+
+#endif
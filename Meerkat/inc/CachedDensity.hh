@@ -0,0 +1,167 @@
+#ifndef CACHED_DENSITY
+#define CACHED_DENSITY
+
+#include "AbsDensity.hh"
+#include "AbsPhaseSpace.hh"
+
+#include "TMath.h"
+
+#include <vector>
+
+/// Class that memoises the values of another density, e.g. an expensive FormulaDensity or kernel density
+/// used as the approximation or width scale density of the kernel densities. The phase space is divided
+/// into a fine grid of cells of the size tolerance*(upper-lower) in each variable, and the value of the
+/// wrapped density in the centre of a cell is used for all points of that cell, so the result does not depend 
+/// on the order of the evaluations. The points of the cells whose centre is outside the phase space are 
+/// evaluated directly. With zero tolerance the values are reused only for exactly the same points. 
+/// The cells are kept in a fixed-size hash table (a new cell replaces the cell stored in the same slot), 
+/// so the memory is bounded. The cache can be used from several threads at once.
+
+class CachedDensity : public AbsDensity {
+
+  public:
+
+    //! Constructor
+    /*!
+      \param [in] pdfName PDF name
+      \param [in] d density to be cached
+      \param [in] tolerance cell size as a fraction of the phase space range in each variable, 0 for exact points
+      \param [in] cacheSize number of hash table slots (rounded up to a power of 2)
+    */
+    CachedDensity(const char* pdfName,
+                  AbsDensity* d,
+                  Double_t tolerance = 0.,
+                  UInt_t cacheSize = 1048576);
+
+    //! Destructor
+    virtual ~CachedDensity();
+
+    //! Calculate PDF value at the given point
+    /*!
+        \param [in] x the point at which to calculate the PDF
+        \return PDF value
+    */
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF value at the given point (non-allocating interface)
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
+
+    //! Calculate PDF values for a batch of points. The points missing in the cache are
+    //! evaluated by the wrapped density in a single batch.
+    /*!
+        \param [in]  numPoints number of points
+        \param [in]  x array of pointers (one per phase space variable) to arrays of numPoints coordinates
+        \param [out] result array of numPoints PDF values
+    */
+    void densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result);
+
+    //! Calculate PDF value and its gradient. The gradient is not cached, the call is passed to the wrapped density.
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \param [out] grad array of dim partial derivatives of the PDF
+        \return PDF value
+    */
+    Double_t densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const;
+
+    //! Return phase space definition for this PDF (the phase space of the wrapped density)
+    /*!
+       \return PDF phase space
+    */
+    AbsPhaseSpace* phaseSpace() { return m_phaseSpace; }
+
+    //! Discard the cached values. Has to be called if the wrapped density is changed (e.g. its parameters).
+    void clear(void);
+
+    //! Return the number of evaluations taken from the cache
+    ULong64_t hits(void) const;
+
+    //! Return the number of evaluations of the wrapped density
+    ULong64_t misses(void) const;
+
+  private:
+
+    //! Calculate the cell key of a point and the hash table slot of the key
+    /*!
+        \param [in] x array of pointers to the coordinate arrays
+        \param [in] i point index in the coordinate arrays
+        \param [out] key array of m_dim key elements
+        \return slot index
+    */
+    UInt_t cellKey(const Double_t* const* x, UInt_t i, Long64_t* key) const;
+
+    //! Look up the key in the slot
+    /*!
+        \param [in] slot slot index
+        \param [in] key array of m_dim key elements
+        \param [out] value cached value
+        \return true if the key was found
+    */
+    Bool_t lookup(UInt_t slot, const Long64_t* key, Double_t* value) const;
+
+    //! Calculate the point at which the value of a cell is evaluated: the cell centre, 
+    //! or the point itself for zero tolerance
+    /*!
+        \param [in] x array of pointers to the coordinate arrays
+        \param [in] i point index in the coordinate arrays
+        \param [in] key array of m_dim key elements of the cell of the point
+        \param [out] centre array of m_dim coordinates
+        \return false if the cell centre is outside the phase space (the value of the point is not cached)
+    */
+    Bool_t cellCentre(const Double_t* const* x, UInt_t i, const Long64_t* key, Double_t* centre) const;
+
+    //! Store the value of the key in the slot
+    /*!
+        \param [in] slot slot index
+        \param [in] key array of m_dim key elements
+        \param [in] value density value
+    */
+    void store(UInt_t slot, const Long64_t* key, Double_t value) const;
+
+    //! Wrapped density
+    AbsDensity* m_density;
+
+    //! Reference to phase space
+    AbsPhaseSpace* m_phaseSpace;
+
+    //! Cached dimensionality of the phase space
+    UInt_t m_dim;
+
+    //! Cell size as a fraction of the phase space range
+    Double_t m_tolerance;
+
+    //! Lower phase space limits
+    std::vector<Double_t> m_lower;
+
+    //! Inverse cell sizes in each variable
+    std::vector<Double_t> m_invCell;
+
+    //! Number of slots minus one (the number of slots is a power of 2)
+    UInt_t m_mask;
+
+    //! Keys of the cells stored in the slots (m_dim elements per slot)
+    mutable std::vector<Long64_t> m_keys;
+
+    //! Cached values
+    mutable std::vector<Double_t> m_values;
+
+    //! Slot occupancy flags
+    mutable std::vector<Char_t> m_filled;
+
+    //! Spin lock flags of the slots
+    mutable std::vector<Char_t> m_locks;
+
+    //! Number of cache hits
+    mutable ULong64_t m_hits;
+
+    //! Number of cache misses
+    mutable ULong64_t m_misses;
+
+};
+
+#endif
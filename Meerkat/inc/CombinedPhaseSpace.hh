@@ -51,7 +51,16 @@ class CombinedPhaseSpace : public AbsPhaseSpace {
       \param [in] x point vector
       \return true if the point is within phase space limits, false otherwise
     */ 
-    Bool_t withinLimits(std::vector<Double_t> &x); 
+    Bool_t withinLimits(std::vector<Double_t> &x) { return withinLimits(&(x[0]), x.size()); }
+
+    //! Check if the point is within phase space limits (non-allocating interface). 
+    //! Components are passed the sub-ranges of the point array. 
+    /*! 
+      \param [in] x pointer to the point coordinates
+      \param [in] dim number of coordinates
+      \return true if the point is within phase space limits, false otherwise
+    */ 
+    Bool_t withinLimits(const Double_t* x, UInt_t dim) const; 
 
     //! Return lower allowed limit of the variable
     /*! 
@@ -77,7 +86,23 @@ class CombinedPhaseSpace : public AbsPhaseSpace {
     Bool_t limits(UInt_t var, 
                   std::vector<Double_t> &x, 
                   Double_t* lower, 
-                  Double_t* upper); 
+                  Double_t* upper) {
+      return limits(var, &(x[0]), x.size(), lower, upper); 
+    }
+
+    //! Return limits (lower and upper) for the variable at the certain point of the phase space (non-allocating interface)
+    /*! 
+      \param [in] var number of the variable
+      \param [in] x pointer to the point coordinates
+      \param [in] dim number of coordinates
+      \param [out] lower lower limit
+      \param [out] upper upper limit
+    */ 
+    Bool_t limits(UInt_t var, 
+                  const Double_t* x, 
+                  UInt_t dim, 
+                  Double_t* lower, 
+                  Double_t* upper) const; 
 
   private: 
 
@@ -90,6 +115,9 @@ class CombinedPhaseSpace : public AbsPhaseSpace {
     //! vector of component phase spaces
     std::vector<AbsPhaseSpace*> m_phspList; 
 
+    //! Vector of cached dimensionalities of component phase spaces
+    std::vector<UInt_t> m_phspDim; 
+
     //! Vector of cached lower limits in each variable
     std::vector<Double_t> m_lowerLimit;
     
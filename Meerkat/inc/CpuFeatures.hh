@@ -0,0 +1,60 @@
+#ifndef CPU_FEATURES
+#define CPU_FEATURES
+
+#include "TMath.h"
+
+// Variants of the vectorised kernels for the wider instruction sets are compiled
+// with the GCC target pragmas, which are only available for x86 in GCC 5 and later
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define MEERKAT_CPU_DISPATCH 1
+#endif
+
+/// Class that detects the vector instruction sets supported by the CPU. The library is built 
+/// for the baseline instruction set of the architecture (SSE2 on x86-64), and the hot kernels 
+/// of the grid interpolation, kernel deposition and unbinned kernel sums are additionally 
+/// compiled for AVX2 and AVX-512. The widest variant supported by the CPU is selected at run time, 
+/// so the same library can be used on heterogeneous nodes. 
+
+class CpuFeatures {
+
+  public: 
+
+    //! Instruction set level
+    enum Level {
+      kBaseline = 0, //!< Baseline instruction set of the build (SSE2 on x86-64)
+      kAVX2     = 1, //!< AVX2
+      kAVX512   = 2  //!< AVX-512F
+    }; 
+
+    //! Return the widest instruction set supported by the CPU and the build. 
+    //! The CPU is queried once, on the first call from any thread. 
+    static Level detected(void); 
+
+    //! Return the instruction set level used by the kernels selected afterwards
+    static Level level(void); 
+
+    //! Limit the instruction set level used by the kernels selected afterwards (e.g. to compare 
+    //! the results of the variants). Levels above the detected one are reduced to the detected level. 
+    /*! 
+        \param [in] level instruction set level
+    */ 
+    static void setLevel(Level level); 
+
+    //! Return the name of the instruction set level
+    /*! 
+        \param [in] level instruction set level
+        \return name
+    */ 
+    static const char* name(Level level); 
+
+  private: 
+
+    //! Query the CPU and print the detected level
+    static Level detect(void); 
+
+    //! Level in use (-1 for the detected level), accessed atomically
+    static Int_t m_level; 
+
+};
+
+#endif
@@ -43,7 +43,15 @@ class DalitzPhaseSpace : public AbsPhaseSpace {
       \param [in] x point 
       \return true in the point is within the phase space, false otherwise
     */ 
-    Bool_t withinLimits(std::vector<Double_t> &x); 
+    Bool_t withinLimits(std::vector<Double_t> &x) { return withinLimits(&(x[0]), x.size()); }
+
+    //! Check if the point is within the phase space limits (non-allocating interface)
+    /*! 
+      \param [in] x pointer to the point coordinates
+      \param [in] dim number of coordinates
+      \return true in the point is within the phase space, false otherwise
+    */ 
+    Bool_t withinLimits(const Double_t* x, UInt_t dim) const; 
 
     //! Get lower limit
     /*! 
@@ -66,7 +74,19 @@ class DalitzPhaseSpace : public AbsPhaseSpace {
       \param [out] lower lower limit
       \param [out] upper upper limit
     */ 
-    Bool_t limits(UInt_t var, std::vector<Double_t> &x, Double_t* lower, Double_t* upper); 
+    Bool_t limits(UInt_t var, std::vector<Double_t> &x, Double_t* lower, Double_t* upper) {
+      return limits(var, &(x[0]), x.size(), lower, upper); 
+    }
+
+    //! Return limits (lower and upper) for the variable at the certain point of the phase space (non-allocating interface)
+    /*! 
+      \param [in] var number of the variable
+      \param [in] x pointer to the point coordinates
+      \param [in] dim number of coordinates
+      \param [out] lower lower limit
+      \param [out] upper upper limit
+    */ 
+    Bool_t limits(UInt_t var, const Double_t* x, UInt_t dim, Double_t* lower, Double_t* upper) const; 
 
   private: 
   
@@ -0,0 +1,156 @@
+#ifndef DENSITY_DATASET
+#define DENSITY_DATASET
+
+#include "AbsDensity.hh"
+#include "AbsPhaseSpace.hh"
+#include "GridEngine.hh"
+
+#include "TMath.h"
+#include "TTree.h"
+#include "TString.h"
+
+#include <vector>
+
+/// Class that holds a fixed set of points (e.g. data or normalisation MC sample of a fit)
+/// and the values of a density evaluated in these points. The values are calculated once
+/// (optionally in several threads) and then can be accessed without calling the density.
+/// For binned densities, the grid cells and interpolation weights of the points can be cached
+/// so that the values can be quickly recalculated for another map defined on the same grid.
+
+class DensityDataset {
+
+  public:
+
+    //! Constructor of an empty dataset
+    /*!
+        \param [in] dataName dataset name
+        \param [in] thePhaseSpace phase space
+    */
+    DensityDataset(const char* dataName,
+                   AbsPhaseSpace* thePhaseSpace);
+
+    //! Destructor
+    virtual ~DensityDataset();
+
+    //! Read the points from an NTuple. All entries are stored (including those outside the phase space),
+    //! so the point index corresponds to the entry number minus skipEvents.
+    /*!
+        \param [in] tree ROOT NTuple
+        \param [in] vars vector of variable names. The size of vector should match the dimensionality of phase space.
+        \param [in] maxEvents maximum number of events to read from NTuple. Read all events if maxEvents=0
+        \param [in] skipEvents number of NTuple events to skip from the beginning
+    */
+    void readTuple(TTree* tree, std::vector<TString> &vars, UInt_t maxEvents = 0, UInt_t skipEvents = 0);
+
+    //! Copy the points from arrays
+    /*!
+        \param [in] numPoints number of points
+        \param [in] x array of pointers (one per phase space variable) to arrays of numPoints coordinates
+    */
+    void setPoints(UInt_t numPoints, const Double_t* const* x);
+
+    //! Set the number of threads used for evaluation
+    /*!
+        \param [in] numThreads number of threads
+    */
+    void setThreads(UInt_t numThreads) { m_numThreads = (numThreads > 0) ? numThreads : 1; }
+
+    //! Evaluate the density in all points of the dataset.
+    //! With more than one thread, the density should support concurrent calls of densityBatch().
+    /*!
+        \param [in] density density to evaluate
+        \return vector of density values
+    */
+    const std::vector<Double_t> &evaluate(AbsDensity* density);
+
+    //! Find and cache the cells and interpolation weights of all points for the grid
+    /*!
+        \param [in] grid grid geometry of the binned map
+    */
+    void bindGrid(const GridEngine &grid);
+
+    //! Evaluate the interpolation of a map in all points of the dataset.
+    //! bindGrid() has to be called first with the grid on which the map is defined.
+    //! The multilinear interpolation uses the cached cells. The cubic interpolation (for the maps of the densities
+    //! in the cubic mode) is evaluated from the point coordinates and, as in the densities, negative values are set to zero.
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] interpolation interpolation method of the density the map belongs to
+        \return vector of interpolated values (zero for the points outside of the grid)
+    */
+    const std::vector<Double_t> &evaluateMap(const std::vector<Double_t> &map,
+                                             GridEngine::Interpolation interpolation = GridEngine::kLinear);
+
+    //! Return the number of points
+    UInt_t size(void) const { return m_size; }
+
+    //! Return the array of coordinates of all points in one variable
+    /*!
+        \param [in] var number of the variable
+        \return array of coordinates
+    */
+    const Double_t* coordinates(UInt_t var) const { return &(m_coord[var][0]); }
+
+    //! Return the vector of values calculated by the last call of evaluate() or evaluateMap()
+    const std::vector<Double_t> &values(void) const { return m_values; }
+
+    //! Return the value in a point calculated by the last call of evaluate() or evaluateMap()
+    /*!
+        \param [in] i point index
+        \return value
+    */
+    Double_t value(UInt_t i) const { return m_values[i]; }
+
+    //! Return the name of the dataset
+    const char* name(void) { return m_name; }
+
+  private:
+
+    //! Evaluate the map for a range of points
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] interpolation interpolation method
+        \param [in] first index of the first point
+        \param [in] last index after the last point
+    */
+    void evaluateMapRange(const std::vector<Double_t> &map, GridEngine::Interpolation interpolation, UInt_t first, UInt_t last);
+
+    //! Dataset name
+    char m_name[256];
+
+    //! Reference to the phase space
+    AbsPhaseSpace* m_phaseSpace;
+
+    //! Cached dimensionality of the phase space
+    UInt_t m_dim;
+
+    //! Number of points
+    UInt_t m_size;
+
+    //! Number of threads used for evaluation
+    UInt_t m_numThreads;
+
+    //! Point coordinates, one vector per variable
+    std::vector< std::vector<Double_t> > m_coord;
+
+    //! Values calculated in the points
+    std::vector<Double_t> m_values;
+
+    //! Copy of the grid geometry for the cached cells
+    GridEngine m_grid;
+
+    //! Flag that the cells are cached
+    Bool_t m_gridBound;
+
+    //! Flags that the points are inside the grid
+    std::vector<Char_t> m_cellInside;
+
+    //! Cached node numbers of the lowest cell vertices (m_dim values per point)
+    std::vector<UInt_t> m_cellIndex;
+
+    //! Cached fractional positions of the points inside the cells (m_dim values per point)
+    std::vector<Double_t> m_cellFrac;
+
+};
+
+#endif
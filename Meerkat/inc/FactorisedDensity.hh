@@ -48,7 +48,34 @@ class FactorisedDensity : public AbsDensity {
         \param [in] x the point at which to calculate the PDF
         \return PDF value
     */
-    Double_t density(std::vector<Double_t> &x);
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF value at the given point (non-allocating interface). 
+    //! Components are passed the sub-ranges of the point array. 
+    /*! 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
+
+    //! Calculate PDF values for a batch of points. Each component is evaluated for the whole batch 
+    //! using its own subset of the coordinate arrays. 
+    /*!
+        \param [in]  numPoints number of points
+        \param [in]  x array of pointers (one per phase space variable) to arrays of numPoints coordinates
+        \param [out] result array of numPoints PDF values
+    */
+    void densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result);
+
+    //! Calculate PDF value and its gradient at the point using the gradients of the components
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \param [out] grad array of dim partial derivatives of the PDF
+        \return PDF value
+    */
+    Double_t densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const;
 
     //! Return phase space definition for this PDF
     /*!
@@ -71,6 +98,9 @@ class FactorisedDensity : public AbsDensity {
     
     //! Vector of density components
     std::vector<AbsDensity*> m_densityComponents; 
+
+    //! Vector of cached dimensionalities of density components
+    std::vector<UInt_t> m_componentDim; 
     
     //! Cached dimensionality of the phase space
     UInt_t m_dim; 
@@ -42,7 +42,15 @@ class FormulaDensity : public AbsDensity {
         \param [in] x the point at which to calculate the PDF
         \return PDF value (equals 1 inside phase space, 0 outside it)
     */
-    Double_t density(std::vector<Double_t> &x);
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF value at the given point (non-allocating interface)
+    /*! 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
 
     //! Return phase space definition for this PDF
     /*!    
@@ -0,0 +1,98 @@
+#ifndef GRID_CONVOLUTION
+#define GRID_CONVOLUTION
+
+#include "TMath.h"
+
+#include <vector>
+
+class GridEngine;
+
+/// Class that convolves the values in the grid nodes with the parabolic kernel used by
+/// GridEngine::deposit() by means of the fast Fourier transform. The result is the same as
+/// the deposition of a kernel centred at every node with the weight equal to the node value
+/// (kernels are truncated at the grid edges), but the cost is O(M log M) in the number of nodes M
+/// instead of the product of the number of nodes and the kernel footprint.
+/// The grid is zero-padded to a power of two in each variable, so that the kernels do not wrap
+/// around the edges.
+
+class GridConvolution {
+
+  public:
+
+    //! Constructor of an empty convolution
+    GridConvolution();
+
+    //! Destructor
+    ~GridConvolution();
+
+    //! Set up the padded grid and calculate the Fourier transform of the kernel
+    /*!
+        \param [in] grid grid of the maps (has to stay valid while the convolution is used)
+        \param [in] width array of kernel widths in each variable
+        \return false if the padded grid is too large
+    */
+    Bool_t init(const GridEngine* grid, const Double_t* width);
+
+    //! Add the convolution of the node values with the kernel to the map
+    /*!
+        \param [in] values values in the grid nodes (same layout as the map)
+        \param [in,out] map map the convolution is added to
+    */
+    void convolve(const std::vector<Double_t> &values, std::vector<Double_t> &map) const;
+
+    //! Return the number of nodes of the padded grid
+    UInt_t paddedSize() const { return m_size; }
+
+    //! Return the number of nodes of the padded grid in a variable
+    /*!
+        \param [in] var variable
+        \return number of nodes
+    */
+    UInt_t paddedBins(UInt_t var) const { return m_padded[var]; }
+
+  private:
+
+    //! Calculate the Fourier transform of the padded grid in place
+    /*!
+        \param [in,out] re real parts
+        \param [in,out] im imaginary parts
+        \param [in] sign sign of the exponent, -1 for the forward and +1 for the (unnormalised) inverse transform
+    */
+    void transform(std::vector<Double_t> &re, std::vector<Double_t> &im, Int_t sign) const;
+
+    //! Calculate the Fourier transform of a line of the padded grid in place
+    /*!
+        \param [in,out] re real parts
+        \param [in,out] im imaginary parts
+        \param [in] var variable along the line
+        \param [in] sign sign of the exponent
+    */
+    void transformLine(Double_t* re, Double_t* im, UInt_t var, Int_t sign) const;
+
+    /// Grid of the maps
+    const GridEngine* m_grid;
+
+    /// Number of nodes of the padded grid in each variable (powers of two)
+    std::vector<UInt_t> m_padded;
+
+    /// Strides of the padded grid (1st variable runs fastest)
+    std::vector<UInt_t> m_stride;
+
+    /// Total number of nodes of the padded grid
+    UInt_t m_size;
+
+    /// Cosines of the twiddle factors in each variable
+    std::vector< std::vector<Double_t> > m_cos;
+
+    /// Sines of the twiddle factors in each variable
+    std::vector< std::vector<Double_t> > m_sin;
+
+    /// Real part of the Fourier transform of the kernel
+    std::vector<Double_t> m_kernelRe;
+
+    /// Imaginary part of the Fourier transform of the kernel
+    std::vector<Double_t> m_kernelIm;
+
+};
+
+#endif
@@ -0,0 +1,503 @@
+#ifndef GRID_ENGINE
+#define GRID_ENGINE
+
+#include "AbsPhaseSpace.hh"
+#include "GridMap.hh"
+
+#include "TMath.h"
+
+#include <vector>
+
+class GridEngine;
+
+//! Pointer to the function that finds the grid cell containing a point
+typedef Bool_t (*GridLocateFunc)(const GridEngine &grid, const Double_t* x, UInt_t* cell, Double_t* frac);
+
+//! Pointer to the function that interpolates a map inside a known grid cell
+typedef Double_t (*GridInterpolateCellFunc)(const GridEngine &grid, const Double_t* map, const UInt_t* cell, const Double_t* frac);
+
+//! Pointer to the function that interpolates a single map at a point
+typedef Double_t (*GridInterpolateFunc)(const GridEngine &grid, const Double_t* map, const Double_t* x);
+
+//! Pointer to the function that interpolates two maps at a point using the same weights
+typedef Bool_t (*GridInterpolate2Func)(const GridEngine &grid, const Double_t* map1, const Double_t* map2,
+                                       const Double_t* x, Double_t* value1, Double_t* value2);
+
+//! Pointer to the function that interpolates a map and calculates its gradient at a point
+typedef Bool_t (*GridGradientFunc)(const GridEngine &grid, const Double_t* map, const Double_t* x,
+                                   Double_t* value, Double_t* grad);
+
+//! Pointer to the function that adds a parabolic kernel to a map
+typedef Bool_t (*GridDepositFunc)(const GridEngine &grid, Double_t* map, const Double_t* point,
+                                  const Double_t* width, Double_t widthScale, Double_t weight);
+
+//! Pointers to the interpolation functions for the maps stored in single precision
+typedef Double_t (*GridInterpolateFloatFunc)(const GridEngine &grid, const Float_t* map, const Double_t* x);
+typedef Bool_t (*GridInterpolate2FloatFunc)(const GridEngine &grid, const Float_t* map1, const Float_t* map2,
+                                            const Double_t* x, Double_t* value1, Double_t* value2);
+typedef Bool_t (*GridGradientFloatFunc)(const GridEngine &grid, const Float_t* map, const Double_t* x,
+                                        Double_t* value, Double_t* grad);
+
+//! Pointers to the interpolation functions for the quantised maps
+typedef Double_t (*GridInterpolateShortFunc)(const GridEngine &grid, const UShort_t* map, const Double_t* x);
+typedef Bool_t (*GridInterpolate2ShortFunc)(const GridEngine &grid, const UShort_t* map1, const UShort_t* map2,
+                                            const Double_t* x, Double_t* value1, Double_t* value2);
+typedef Bool_t (*GridGradientShortFunc)(const GridEngine &grid, const UShort_t* map, const Double_t* x,
+                                        Double_t* value, Double_t* grad);
+
+//! Table of the grid functions selected for the grid dimensionality and map layout
+struct GridKernels {
+  GridInterpolateFunc interpolate;
+  GridInterpolate2Func interpolate2;
+  GridGradientFunc gradient;
+  GridInterpolateFloatFunc interpolateFloat;
+  GridInterpolate2FloatFunc interpolate2Float;
+  GridGradientFloatFunc gradientFloat;
+  GridInterpolateShortFunc interpolateShort;
+  GridInterpolate2ShortFunc interpolate2Short;
+  GridGradientShortFunc gradientShort;
+  GridDepositFunc deposit;
+  GridLocateFunc locate;
+  GridInterpolateCellFunc interpolateCell;
+};
+
+/// Class that holds the geometry of the rectangular grid of nodes used by the binned densities,
+/// and performs multilinear interpolation and kernel deposition on the maps defined on this grid.
+/// Grid parameters (axis origins, inverse node spacings, map offsets) are cached at initialisation,
+/// and the implementation specialised for the grid dimensionality (1 to 5) is selected at that point.
+/// Grids of higher dimensionality use the generic implementation.
+/// The map address of a node is the sum of per-variable offsets of its node numbers. The default layout
+/// is row-major (1st variable runs fastest). Optionally, the map can be stored in hypercubic tiles,
+/// which keeps the neighbouring nodes in all variables close in memory for large 4D and 5D maps.
+/// In the sparse layout only the tiles near the phase space are stored, which saves most of the memory
+/// for the non-rectangular phase spaces (e.g. Dalitz plots) in many dimensions. The address of a node is then
+/// the base of its tile, looked up from the sum of per-variable tile offsets, plus the sum of offsets inside the tile.
+
+class GridEngine {
+
+  public:
+
+    //! Interpolation method of the maps
+    enum Interpolation {
+      kLinear = 0,  //!< multilinear interpolation of the 2^N vertices of the cell
+      kCubic  = 1   //!< Catmull-Rom cubic interpolation of the 4^N nearest nodes
+    };
+
+    //! Map layout
+    enum Layout {
+      kRowMajor = 0,  //!< all nodes in row-major order
+      kTiled    = 1,  //!< all nodes in hypercubic tiles
+      kSparse   = 2   //!< only the tiles near the phase space
+    };
+
+    //! Constructor of an empty grid. init() has to be called before the grid can be used.
+    GridEngine();
+
+    //! Destructor
+    ~GridEngine();
+
+    //! Initialise the grid from the phase space limits and binning. 
+    //! In the sparse layout, a grid cell intersects the phase space if one of its vertices or its centre is inside, 
+    //! and the tiles of all nodes used by the interpolation of such a cell (including the cubic one) are stored. 
+    //! Slivers of the phase space that pass between these points are missed, cellStored() identifies their cells. 
+    //! All other tiles share a single zero tile at the beginning of the map, which is never written by the kernel deposition. 
+    /*!
+        \param [in] thePhaseSpace phase space. Grid spans the range between its lower and upper limits.
+        \param [in] binning vector of numbers of nodes in each variable. Vector size should match the dimensionality of the phase space.
+        \param [in] tileSize number of nodes along each edge of a tile of the map layout, 0 for the row-major layout 
+                    (or for tiles of 4 nodes in the sparse layout)
+        \param [in] sparse if true, store only the tiles near the phase space
+        \return true if the grid is valid (each variable has at least two nodes)
+    */
+    Bool_t init(AbsPhaseSpace* thePhaseSpace, std::vector<UInt_t> &binning, UInt_t tileSize = 0, Bool_t sparse = false);
+
+    //! Return dimensionality of the grid
+    UInt_t dimensionality() const { return m_dim; }
+
+    //! Return total number of nodes in the grid
+    UInt_t nodes() const { return m_nodes; }
+
+    //! Return the size of the map array (larger than the number of nodes for the padded tiled layout)
+    UInt_t size() const { return m_size; }
+
+    //! Return the tile size of the map layout (0 for the row-major layout)
+    UInt_t tileSize() const { return m_tileSize; }
+
+    //! Return the map layout
+    Layout layout() const { return m_layout; }
+
+    //! Return true if the map layout is sparse
+    Bool_t sparse() const { return m_sparse; }
+
+    //! Return the number of stored tiles in the sparse layout, not counting the shared zero tile
+    UInt_t storedTiles() const { return (m_layout == kSparse) ? m_size/m_tileVolume - 1 : 0; }
+
+    //! Return true if the map entry belongs to a stored node. In the sparse layout the nodes of the tiles which 
+    //! are not stored share the zero tile, and their values should not be written. 
+    /*!
+        \param [in] index map index returned by iterToIndex()
+        \return true if the node is stored
+    */
+    Bool_t isStored(UInt_t index) const { return index >= m_sharedSize; }
+
+    //! Return the number of nodes in the variable
+    /*!
+        \param [in] var number of the variable
+        \return number of nodes
+    */
+    UInt_t bins(UInt_t var) const { return m_binning[var]; }
+
+    //! Return the coordinate of the node
+    /*!
+        \param [in] var number of the variable
+        \param [in] i node number in this variable
+        \return coordinate of the node
+    */
+    Double_t nodeCoordinate(UInt_t var, UInt_t i) const { return m_lower[var] + (Double_t)i*m_step[var]; }
+
+    //! Convert an N-dimensional iterator vector into a linear node index in the map
+    /*!
+        \param [in] iter iterator vector
+        \return node index in the map
+    */
+    UInt_t iterToIndex(const UInt_t* iter) const;
+
+    //! Return true if the other grid has the same nodes (binning and limits), possibly with a different map layout
+    /*!
+        \param [in] grid other grid
+        \return true if the nodes are the same
+    */
+    Bool_t sameNodes(const GridEngine &grid) const;
+
+    //! Copy a map defined on the same nodes, but possibly with a different layout, into the layout of this grid. 
+    //! The nodes which are not stored in this grid are skipped.
+    /*!
+        \param [in] source grid of the source map
+        \param [in] sourceMap source map
+        \param [out] map map in the layout of this grid
+    */
+    void convert(const GridEngine &source, const std::vector<Double_t> &sourceMap, std::vector<Double_t> &map) const;
+
+    //! Calculate multilinear interpolation of the map at a point
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \return interpolated value, or 0 if the point is outside the grid
+    */
+    Double_t interpolate(const std::vector<Double_t> &map, const Double_t* x) const {
+      return m_kernels.interpolate(*this, &(map[0]), x);
+    }
+
+    //! Calculate multilinear interpolation of two maps at a point. Interpolation weights are calculated once.
+    /*!
+        \param [in] map1 1st map
+        \param [in] map2 2nd map
+        \param [in] x point
+        \param [out] value1 interpolated value of the 1st map
+        \param [out] value2 interpolated value of the 2nd map
+        \return false if the point is outside the grid
+    */
+    Bool_t interpolate(const std::vector<Double_t> &map1, const std::vector<Double_t> &map2, const Double_t* x,
+                       Double_t* value1, Double_t* value2) const {
+      return m_kernels.interpolate2(*this, &(map1[0]), &(map2[0]), x, value1, value2);
+    }
+
+    //! Calculate multilinear interpolation of a map stored with reduced precision at a point
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \return interpolated value, or 0 if the point is outside the grid
+    */
+    Double_t interpolate(const GridMap &map, const Double_t* x) const;
+
+    //! Calculate multilinear interpolation of two maps stored with the same reduced precision at a point
+    /*!
+        \param [in] map1 1st map
+        \param [in] map2 2nd map
+        \param [in] x point
+        \param [out] value1 interpolated value of the 1st map
+        \param [out] value2 interpolated value of the 2nd map
+        \return false if the point is outside the grid
+    */
+    Bool_t interpolate(const GridMap &map1, const GridMap &map2, const Double_t* x,
+                       Double_t* value1, Double_t* value2) const;
+
+    //! Calculate multilinear interpolation of a map stored with reduced precision and its gradient at a point
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \param [out] grad array of partial derivatives over each variable
+        \return interpolated value, or 0 (with zero gradient) if the point is outside the grid
+    */
+    Double_t interpolateGradient(const GridMap &map, const Double_t* x, Double_t* grad) const;
+
+    //! Calculate multilinear interpolation of the map and its gradient at a point. 
+    //! The gradient is the exact derivative of the interpolant inside the cell containing the point. 
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \param [out] grad array of partial derivatives over each variable
+        \return interpolated value, or 0 (with zero gradient) if the point is outside the grid
+    */
+    Double_t interpolateGradient(const std::vector<Double_t> &map, const Double_t* x, Double_t* grad) const;
+
+    //! Calculate the Catmull-Rom cubic interpolation of the map at a point. The interpolation passes through 
+    //! the node values, and its first derivatives are continuous across the cell boundaries. The missing nodes 
+    //! beyond the grid edges are replaced by the linear extrapolation of the two edge nodes. 
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \return interpolated value, or 0 if the point is outside the grid
+    */
+    Double_t interpolateCubic(const std::vector<Double_t> &map, const Double_t* x) const;
+
+    //! Calculate the Catmull-Rom cubic interpolation of a map stored with reduced precision at a point
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \return interpolated value, or 0 if the point is outside the grid
+    */
+    Double_t interpolateCubic(const GridMap &map, const Double_t* x) const;
+
+    //! Calculate the Catmull-Rom cubic interpolation of two maps at a point. Interpolation weights are calculated once.
+    /*!
+        \param [in] map1 1st map
+        \param [in] map2 2nd map
+        \param [in] x point
+        \param [out] value1 interpolated value of the 1st map
+        \param [out] value2 interpolated value of the 2nd map
+        \return false if the point is outside the grid
+    */
+    Bool_t interpolateCubic(const std::vector<Double_t> &map1, const std::vector<Double_t> &map2, const Double_t* x,
+                            Double_t* value1, Double_t* value2) const;
+
+    //! Calculate the Catmull-Rom cubic interpolation of two maps stored with reduced precision at a point
+    /*!
+        \param [in] map1 1st map
+        \param [in] map2 2nd map
+        \param [in] x point
+        \param [out] value1 interpolated value of the 1st map
+        \param [out] value2 interpolated value of the 2nd map
+        \return false if the point is outside the grid
+    */
+    Bool_t interpolateCubic(const GridMap &map1, const GridMap &map2, const Double_t* x,
+                            Double_t* value1, Double_t* value2) const;
+
+    //! Calculate the Catmull-Rom cubic interpolation of the map and its exact gradient at a point
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \param [out] grad array of partial derivatives over each variable
+        \return interpolated value, or 0 (with zero gradient) if the point is outside the grid
+    */
+    Double_t interpolateCubicGradient(const std::vector<Double_t> &map, const Double_t* x, Double_t* grad) const;
+
+    //! Calculate the Catmull-Rom cubic interpolation of a map stored with reduced precision and its gradient at a point
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] x point
+        \param [out] grad array of partial derivatives over each variable
+        \return interpolated value, or 0 (with zero gradient) if the point is outside the grid
+    */
+    Double_t interpolateCubicGradient(const GridMap &map, const Double_t* x, Double_t* grad) const;
+
+    //! Build the summed-volume (prefix-sum) table of the map. Each entry is the sum of the map values in 
+    //! all nodes with lower or equal indices in each variable, weighted by the integrals of their 
+    //! multilinear basis functions. The table is not available in the sparse layout. 
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [out] table summed-volume table (same layout as the map)
+    */
+    void cumulate(const std::vector<Double_t> &map, std::vector<Double_t> &table) const;
+
+    //! Calculate the exact integral of the multilinear interpolation of the map over an axis-aligned box 
+    //! using the summed-volume table. The cost does not depend on the grid size: at most 6 table nodes per variable 
+    //! are used, and only 2 when the box limits coincide with the grid nodes. The box is clipped to the grid limits. 
+    //! Not available in the sparse layout.
+    /*!
+        \param [in] table summed-volume table built by cumulate()
+        \param [in] lower array of lower box limits in each variable
+        \param [in] upper array of upper box limits in each variable
+        \return integral over the box
+    */
+    Double_t integrate(const std::vector<Double_t> &table, const Double_t* lower, const Double_t* upper) const;
+
+    //! Find the grid cell containing the point
+    /*!
+        \param [in] x point
+        \param [out] cell array of node numbers of the lowest vertex of the cell in each variable
+        \param [out] frac array of fractional positions of the point inside the cell in each variable
+        \return false if the point is outside the grid
+    */
+    Bool_t locate(const Double_t* x, UInt_t* cell, Double_t* frac) const {
+      return m_kernels.locate(*this, x, cell, frac);
+    }
+
+    //! Calculate multilinear interpolation of the map inside the cell found by locate(). 
+    //! The result is identical to interpolate() at the same point. 
+    /*!
+        \param [in] map map of values in grid nodes
+        \param [in] cell array of node numbers of the lowest vertex of the cell
+        \param [in] frac array of fractional positions of the point inside the cell
+        \return interpolated value
+    */
+    Double_t interpolateCell(const std::vector<Double_t> &map, const UInt_t* cell, const Double_t* frac) const {
+      return m_kernels.interpolateCell(*this, &(map[0]), cell, frac);
+    }
+
+    //! Add a parabolic kernel centred at a point to the map
+    /*!
+        \param [in,out] map map of values in grid nodes
+        \param [in] point kernel centre
+        \param [in] width vector of kernel widths in each variable
+        \param [in] widthScale scale factor applied to all kernel widths
+        \param [in] weight kernel weight
+        \return false (and the map is left untouched) if the node spacing is larger than the kernel width
+    */
+    Bool_t deposit(std::vector<Double_t> &map, const Double_t* point, const Double_t* width,
+                   Double_t widthScale = 1., Double_t weight = 1.) const {
+      return m_kernels.deposit(*this, &(map[0]), point, width, widthScale, weight);
+    }
+
+    //! Distribute the weight of a point between the vertices of its grid cell with the multilinear 
+    //! interpolation weights (linear binning). Vertices outside the stored tiles of a sparse map are skipped. 
+    /*!
+        \param [in,out] map map of values in grid nodes
+        \param [in] point point
+        \param [in] weight point weight
+        \return false if the point is outside the grid
+    */
+    Bool_t scatter(std::vector<Double_t> &map, const Double_t* point, Double_t weight = 1.) const;
+
+    //! Return false if a vertex of the grid cell of the point is not stored in the sparse layout 
+    //! (the phase space intersects the cell, but none of the points tested by init() is inside). 
+    /*!
+        \param [in] x point
+        \return true if all vertices of the cell are stored, or the layout is not sparse
+    */
+    Bool_t cellStored(const Double_t* x) const;
+
+    //! Return array of lower limits of the grid
+    const Double_t* lowerLimits() const { return &(m_lower[0]); }
+
+    //! Return array of upper limits of the grid
+    const Double_t* upperLimits() const { return &(m_upper[0]); }
+
+    //! Return array of inverse node spacings
+    const Double_t* invSteps() const { return &(m_invStep[0]); }
+
+    //! Return array of numbers of nodes
+    const UInt_t* binning() const { return &(m_binning[0]); }
+
+    //! Return array of map offsets of the nodes in one variable. The map index of a node is the sum of the offsets in all variables.
+    /*!
+        \param [in] var number of the variable
+        \return array of offsets indexed by the node number
+    */
+    const UInt_t* axisOffsets(UInt_t var) const { return &(m_axisOffset[var][0]); }
+
+    //! Return array of tile index offsets of the nodes in one variable (sparse layout only). The tile index of a node 
+    //! is the sum of the offsets in all variables, and its map index is the tile base plus the sum of axisOffsets().
+    /*!
+        \param [in] var number of the variable
+        \return array of tile index offsets indexed by the node number
+    */
+    const UInt_t* tileOffsets(UInt_t var) const { return &(m_tileOffset[var][0]); }
+
+    //! Return array of map offsets of the tiles indexed by the tile index (sparse layout only)
+    const UInt_t* tileBases() const { return &(m_tileBase[0]); }
+
+    //! Return array of map strides in each variable (row-major layout only)
+    const UInt_t* strides() const { return &(m_stride[0]); }
+
+    //! Return array of map offsets of the vertices of a grid cell relative to its lowest vertex (row-major layout only)
+    const UInt_t* vertexOffsets() const { return &(m_vertexOffset[0]); }
+
+  private:
+
+    //! Build the tile tables of the sparse layout: find the tiles near the phase space and assign their map offsets
+    /*!
+        \param [in] thePhaseSpace phase space
+    */
+    void initSparse(AbsPhaseSpace* thePhaseSpace);
+
+    //! Return the integral of the 1D basis (hat) function of the node
+    /*!
+        \param [in] var number of the variable
+        \param [in] i node number in this variable
+        \return integral of the basis function
+    */
+    Double_t nodeArea(UInt_t var, UInt_t i) const;
+
+    //! Add the coefficients of the summed-volume table nodes which give the integral of the interpolant
+    //! in one variable from the lower grid limit to x
+    /*!
+        \param [in] var number of the variable
+        \param [in] x upper integration limit
+        \param [in] sign factor applied to the coefficients
+        \param [in,out] index list of node numbers
+        \param [in,out] coeff list of coefficients
+    */
+    void cumulativeCoefficients(UInt_t var, Double_t x, Double_t sign,
+                                std::vector<Int_t> &index, std::vector<Double_t> &coeff) const;
+
+    //! Grid dimensionality
+    UInt_t m_dim;
+
+    //! Total number of nodes
+    UInt_t m_nodes;
+
+    //! Size of the map array
+    UInt_t m_size;
+
+    //! Tile size of the map layout (0 for row-major)
+    UInt_t m_tileSize;
+
+    //! Sparse layout flag
+    Bool_t m_sparse;
+
+    //! Map layout
+    Layout m_layout;
+
+    //! Number of nodes in a tile
+    UInt_t m_tileVolume;
+
+    //! Size of the shared zero tile at the beginning of the map (0 if the layout is not sparse)
+    UInt_t m_sharedSize;
+
+    //! Number of nodes in each variable
+    std::vector<UInt_t> m_binning;
+
+    //! Lower limit in each variable
+    std::vector<Double_t> m_lower;
+
+    //! Upper limit in each variable
+    std::vector<Double_t> m_upper;
+
+    //! Node spacing in each variable
+    std::vector<Double_t> m_step;
+
+    //! Inverse node spacing in each variable
+    std::vector<Double_t> m_invStep;
+
+    //! Map offsets of the nodes in each variable (offsets inside the tile in the sparse layout)
+    std::vector< std::vector<UInt_t> > m_axisOffset;
+
+    //! Tile index offsets of the nodes in each variable (sparse layout only)
+    std::vector< std::vector<UInt_t> > m_tileOffset;
+
+    //! Map offsets of the tiles, or 0 (the shared zero tile) for the tiles which are not stored (sparse layout only)
+    std::vector<UInt_t> m_tileBase;
+
+    //! Map stride in each variable in the row-major layout
+    std::vector<UInt_t> m_stride;
+
+    //! Map offsets of the 2^N cell vertices in the row-major layout
+    std::vector<UInt_t> m_vertexOffset;
+
+    //! Grid functions for the grid dimensionality and map layout
+    GridKernels m_kernels;
+
+};
+
+#endif
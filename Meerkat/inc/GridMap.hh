@@ -0,0 +1,112 @@
+#ifndef GRID_MAP
+#define GRID_MAP
+
+#include "TMath.h"
+
+#include <vector>
+
+/// Class that stores the values of a binned map in grid nodes with a selectable precision:
+/// double, float, or 16-bit integers quantised with a per-map offset and scale.
+/// The binned densities fill their maps in double precision and then pack them into this storage
+/// to reduce the memory footprint of the evaluation. Since the multilinear interpolation is linear
+/// in the node values, the quantised map is interpolated in integers and then transformed.
+
+class GridMap {
+
+  public:
+
+    //! Storage precision of the map values
+    enum Precision {
+      kDouble = 0,  //!< 64-bit floating point
+      kFloat  = 1,  //!< 32-bit floating point
+      kShort  = 2   //!< 16-bit unsigned integer with per-map offset and scale
+    };
+
+    //! Constructor of an empty map in double precision
+    GridMap();
+
+    //! Destructor
+    ~GridMap();
+
+    //! Set the storage precision. The values stored before are discarded.
+    /*!
+        \param [in] precision storage precision
+    */
+    void setPrecision(Precision precision);
+
+    //! Return the storage precision
+    Precision precision() const { return m_precision; }
+
+    //! Store the values with the current precision
+    /*!
+        \param [in] values vector of values in double precision
+    */
+    void pack(const std::vector<Double_t> &values);
+
+    //! Copy the stored values into a vector in double precision
+    /*!
+        \param [out] values vector of values
+    */
+    void unpack(std::vector<Double_t> &values) const;
+
+    //! Release the stored values
+    void clear();
+
+    //! Return the number of stored values
+    UInt_t size() const { return m_size; }
+
+    //! Return the memory used by the stored values in bytes
+    ULong64_t bytes() const;
+
+    //! Return a stored value
+    /*!
+        \param [in] index map index
+        \return value converted to double precision
+    */
+    Double_t value(UInt_t index) const {
+      if (m_precision == kFloat) return m_float[index];
+      if (m_precision == kShort) return m_offset + m_scale*(Double_t)m_short[index];
+      return m_double[index];
+    }
+
+    //! Return the array of values in double precision (kDouble only)
+    const Double_t* doubleData() const { return &(m_double[0]); }
+
+    //! Return the array of values in single precision (kFloat only)
+    const Float_t* floatData() const { return &(m_float[0]); }
+
+    //! Return the array of quantised values (kShort only)
+    const UShort_t* shortData() const { return &(m_short[0]); }
+
+    //! Return the offset of the quantised values
+    Double_t offset() const { return m_offset; }
+
+    //! Return the scale of the quantised values
+    Double_t scale() const { return m_scale; }
+
+  private:
+
+    //! Storage precision
+    Precision m_precision;
+
+    //! Number of stored values
+    UInt_t m_size;
+
+    //! Values in double precision
+    std::vector<Double_t> m_double;
+
+    //! Values in single precision
+    std::vector<Float_t> m_float;
+
+    //! Quantised values
+    std::vector<UShort_t> m_short;
+
+    //! Value corresponding to the quantised value 0
+    Double_t m_offset;
+
+    //! Value of one quantisation step
+    Double_t m_scale;
+
+};
+
+#endif
@@ -12,6 +12,8 @@
 #include <vector>
 
 typedef std::vector<Double_t> TPhspVector; 
+
+//! Points of a cell stored by variable: one vector of coordinates for each phase space variable
 typedef std::vector<TPhspVector> TCell; 
 
 /// Class that describes the unbinned kernel density. 
@@ -71,7 +73,9 @@ class KernelDensity : public AbsDensity {
                                   const char* var3, const char* var4, 
                                   const char* var5, const char* var6, UInt_t maxEvents = 0);
 
-    Double_t density(std::vector<Double_t> &x);
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    Double_t density(const Double_t* x, UInt_t dim) const;
 
     AbsPhaseSpace* phaseSpace() { return m_phaseSpace; }
 
@@ -79,9 +83,9 @@ class KernelDensity : public AbsDensity {
 
     UInt_t numCells(void); 
 
-    Int_t cellIndex(std::vector<Double_t> &x); 
+    Int_t cellIndex(const Double_t* x) const; 
 
-    Double_t rawDensity(std::vector<Double_t> &x, std::vector<TCell> &vector); 
+    Double_t rawDensity(const Double_t* x, const std::vector<TCell> &vector) const; 
 
     AbsPhaseSpace* m_phaseSpace; 
 
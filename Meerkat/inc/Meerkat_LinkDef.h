@@ -17,6 +17,10 @@
 #pragma link C++ class UniformDensity+;
 #pragma link C++ class FormulaDensity+;
 #pragma link C++ class FactorisedDensity+;
+#pragma link C++ class CachedDensity+;
+#pragma link C++ class RefinedBinnedDensity+;
+#pragma link C++ class DensityDataset+;
+#pragma link C++ class BinnedOptions+;
 
 #pragma link C++ class CombinedPhaseSpace+;
 #pragma link C++ class DalitzPhaseSpace+;
@@ -40,7 +40,10 @@ class ParametricPhaseSpace : public AbsPhaseSpace {
     UInt_t dimensionality() { return m_dim; }
 
     //! Check if the point is within the phase space limits
-    Bool_t withinLimits(std::vector<Double_t> &x); 
+    Bool_t withinLimits(std::vector<Double_t> &x) { return withinLimits(&(x[0]), x.size()); }
+
+    //! Check if the point is within the phase space limits (non-allocating interface)
+    Bool_t withinLimits(const Double_t* x, UInt_t dim) const; 
 
     //! Get lower limit
     Double_t lowerLimit(UInt_t var); 
@@ -55,7 +58,12 @@ class ParametricPhaseSpace : public AbsPhaseSpace {
       \param [out] lower lower limit
       \param [out] upper upper limit
     */ 
-    Bool_t limits(UInt_t var, std::vector<Double_t> &x, Double_t* lower, Double_t* upper); 
+    Bool_t limits(UInt_t var, std::vector<Double_t> &x, Double_t* lower, Double_t* upper) {
+      return limits(var, &(x[0]), x.size(), lower, upper); 
+    }
+
+    //! Return limits (lower and upper) for the variable at the certain point of the phase space (non-allocating interface)
+    Bool_t limits(UInt_t var, const Double_t* x, UInt_t dim, Double_t* lower, Double_t* upper) const; 
 
   private: 
   
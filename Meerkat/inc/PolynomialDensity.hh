@@ -10,6 +10,8 @@
 /// Class that describes the polynomial density
 /// which can be fitted to the data sample from NTuple
 /// The phase space dimensionality must be either 1 or 2
+/// The fit in the constructor uses file-scope state, while the density evaluation 
+/// only uses the fitted parameters and can be called from several threads. 
 
 class PolynomialDensity : public AbsDensity {
 
@@ -61,7 +63,16 @@ class PolynomialDensity : public AbsDensity {
         \param [in] x the point at which to calculate the PDF
         \return PDF value (equals 1 inside phase space, 0 outside it)
     */
-    Double_t density(std::vector<Double_t> &x);
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF value at the given point (non-allocating interface). 
+    //! Only uses the fitted parameters stored in the object, so can be called from several threads. 
+    /*! 
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
 
     //! Return phase space definition for this PDF
     /*!    
@@ -85,6 +96,9 @@ class PolynomialDensity : public AbsDensity {
     
     //! Power of the polynomial
     UInt_t m_power; 
+
+    //! Centre of the phase space in each variable (origin of the polynomial)
+    Double_t m_middle[2]; 
 }; 
 
 #endif
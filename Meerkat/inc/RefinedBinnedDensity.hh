@@ -0,0 +1,149 @@
+#ifndef REFINED_BINNED_DENSITY
+#define REFINED_BINNED_DENSITY
+
+#include "AbsDensity.hh"
+#include "AbsPhaseSpace.hh"
+
+#include "TMath.h"
+
+#include <vector>
+
+/// Class that describes the PDF which is a multilinear interpolation on a locally refined
+/// hierarchical grid (quadtree, octree and their N-dimensional analogues). The phase space is covered
+/// by a coarse root grid, and each cell is recursively split into 2^N subcells while the multilinear
+/// interpolation of its vertices differs from the input density by more than the tolerance in any of
+/// the 3^N points of its subcell vertices. Flat regions are thus stored with a few large cells,
+/// and the nodes are concentrated near narrow structures and sharp edges.
+/// Inside each cell the interpolation is identical to the one of BinnedDensity. At the boundaries
+/// between cells of different size the interpolation is discontinuous within the tolerance.
+/// Structures narrower than the root cells may be missed by the refinement test,
+/// so the root grid should resolve their positions.
+
+class RefinedBinnedDensity : public AbsDensity {
+
+  public:
+
+    //! Constructor that creates the refined binned density from any AbsDensity
+    /*!
+        \param [in] pdfName PDF name
+        \param [in] thePhaseSpace phase space
+        \param [in] binning vector of numbers of root grid nodes in each variable. Vector size should match the dimensionality of the phase space.
+        \param [in] d input density
+        \param [in] tolerance maximum interpolation error relative to the average density
+        \param [in] maxDepth maximum number of cell subdivisions
+    */
+    RefinedBinnedDensity(const char* pdfName,
+                         AbsPhaseSpace* thePhaseSpace,
+                         std::vector<UInt_t> &binning,
+                         AbsDensity* d,
+                         Double_t tolerance = 0.01,
+                         UInt_t maxDepth = 6);
+
+    //! Destructor
+    virtual ~RefinedBinnedDensity();
+
+    //! Return the value of the PDF in a point
+    /*!
+        \param [in] x point
+        \return PDF value
+    */
+    Double_t density(std::vector<Double_t> &x) { return density(&(x[0]), x.size()); }
+
+    //! Calculate PDF density at the point (non-allocating interface)
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \return PDF value, or 0 outside of the grid
+    */
+    Double_t density(const Double_t* x, UInt_t dim) const;
+
+    //! Calculate PDF value and its gradient at the point. The gradient is the exact derivative
+    //! of the multilinear interpolation inside the cell containing the point.
+    /*!
+        \param [in] x pointer to the point coordinates
+        \param [in] dim number of coordinates
+        \param [out] grad array of dim partial derivatives of the PDF
+        \return PDF value
+    */
+    Double_t densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const;
+
+    //! Return the phase space
+    /*!
+        \return phase space
+    */
+    AbsPhaseSpace* phaseSpace() { return m_phaseSpace; }
+
+    //! Return the total number of cells of all levels
+    UInt_t cells(void) const { return m_cells.size(); }
+
+    //! Return the number of leaf cells (cells which are not subdivided)
+    UInt_t leaves(void) const { return m_vertices.size() >> m_dim; }
+
+    //! Return the number of stored nodes (vertices of the leaf cells)
+    UInt_t nodes(void) const { return m_values.size(); }
+
+    //! Return the maximum subdivision level of the leaf cells
+    UInt_t depth(void) const { return m_depth; }
+
+    //! Return the memory used by the cell tree, the vertex indices and the node values in bytes
+    ULong64_t bytes(void) const;
+
+  private:
+
+    //! Find the leaf cell containing the point
+    /*!
+        \param [in] x point
+        \param [out] frac array of fractional positions of the point inside the leaf cell in each variable
+        \param [out] level subdivision level of the leaf cell
+        \param [out] found false if the point is outside of the grid (the other outputs are then not set)
+        \return leaf number
+    */
+    UInt_t locate(const Double_t* x, Double_t* frac, UInt_t* level, Bool_t* found) const;
+
+    //! Build the cell tree level by level
+    /*!
+        \param [in] d input density
+        \param [in] tolerance maximum interpolation error relative to the average density
+        \param [in] maxDepth maximum number of cell subdivisions
+    */
+    void build(AbsDensity* d, Double_t tolerance, UInt_t maxDepth);
+
+    //! Reference to the phase space definition
+    AbsPhaseSpace* m_phaseSpace;
+
+    //! Dimensionality of the phase space
+    UInt_t m_dim;
+
+    //! Numbers of root grid nodes in each variable
+    std::vector<UInt_t> m_binning;
+
+    //! Root grid cell index stride in each variable
+    std::vector<UInt_t> m_stride;
+
+    //! Lower grid limits
+    std::vector<Double_t> m_lower;
+
+    //! Upper grid limits
+    std::vector<Double_t> m_upper;
+
+    //! Inverse root cell sizes
+    std::vector<Double_t> m_invStep;
+
+    //! Index of the first of the 2^N subcells of each split cell, or the leaf number with the highest bit set
+    //! for the leaf cells. Cells are stored level by level, root cells first.
+    //! The subcell number has bit j set for the upper half in variable j.
+    std::vector<UInt_t> m_cells;
+
+    //! Node indices of the 2^N vertices of each leaf cell, 2^N consecutive entries per leaf
+    //! (vertex number has bit j set for the upper vertex in variable j)
+    std::vector<UInt_t> m_vertices;
+
+    //! Values in the nodes. Each node is stored once and shared by all leaf cells it is a vertex of.
+    std::vector<Double_t> m_values;
+
+    //! Maximum subdivision level of the leaf cells
+    UInt_t m_depth;
+
+};
+
+#endif
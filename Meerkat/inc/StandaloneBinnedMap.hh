@@ -0,0 +1,298 @@
+#ifndef STANDALONE_BINNED_MAP
+#define STANDALONE_BINNED_MAP
+
+// Header-only evaluator of the binned maps stored by Meerkat in text format
+// (BinnedDensity::writeToTextFile() or BinnedKernelDensity::writeToTextFile()).
+// It depends neither on ROOT nor on libMeerkat, so that a fitting program can
+// interpolate an efficiency map without linking them. The dimensionality is
+// a compile-time parameter, the evaluation is inlinable and does not allocate memory.
+// The interpolation is the same multilinear interpolation as in BinnedDensity.
+
+#if !defined(__CINT__) && !defined(__MAKECINT__)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vector>
+
+/// Rectangular phase space for the standalone map evaluator,
+/// equivalent to a CombinedPhaseSpace of N OneDimPhaseSpace components.
+
+template<unsigned int N>
+class StandaloneRectangularPhaseSpace {
+
+  public:
+
+    //! Dimensionality of the phase space
+    static const unsigned int dim = N;
+
+    //! Constructor
+    /*!
+        \param [in] lower array of N lower limits
+        \param [in] upper array of N upper limits
+    */
+    StandaloneRectangularPhaseSpace(const double* lower, const double* upper) {
+      for (unsigned int j=0; j<N; j++) {
+        m_lower[j] = lower[j];
+        m_upper[j] = upper[j];
+      }
+    }
+
+    //! Return the lower limit of a variable
+    double lowerLimit(unsigned int var) const { return m_lower[var]; }
+
+    //! Return the upper limit of a variable
+    double upperLimit(unsigned int var) const { return m_upper[var]; }
+
+    //! Check if the point is inside the phase space
+    /*!
+        \param [in] x array of N coordinates
+        \return true if the point is inside the phase space
+    */
+    bool withinLimits(const double* x) const {
+      for (unsigned int j=0; j<N; j++) {
+        if (x[j] > m_upper[j] || x[j] < m_lower[j]) return false;
+      }
+      return true;
+    }
+
+  private:
+
+    //! Lower limits
+    double m_lower[N];
+
+    //! Upper limits
+    double m_upper[N];
+
+};
+
+/// Dalitz plot phase space for the standalone map evaluator, equivalent to DalitzPhaseSpace.
+/// The variables are the squared invariant masses m^2(AB) and m^2(BC).
+
+class StandaloneDalitzPhaseSpace {
+
+  public:
+
+    //! Dimensionality of the phase space
+    static const unsigned int dim = 2;
+
+    //! Constructor
+    /*!
+        \param [in] md mass of the decaying particle
+        \param [in] ma mass of the 1st daughter
+        \param [in] mb mass of the 2nd daughter
+        \param [in] mc mass of the 3rd daughter
+    */
+    StandaloneDalitzPhaseSpace(double md, double ma, double mb, double mc) {
+      m_a2 = ma*ma;
+      m_b2 = mb*mb;
+      m_c2 = mc*mc;
+      m_d2 = md*md;
+      m_minAB = (ma + mb)*(ma + mb);
+      m_maxAB = (md - mc)*(md - mc);
+      m_minBC = (mb + mc)*(mb + mc);
+      m_maxBC = (md - ma)*(md - ma);
+    }
+
+    //! Return the lower limit of a variable
+    double lowerLimit(unsigned int var) const { return (var == 0) ? m_minAB : m_minBC; }
+
+    //! Return the upper limit of a variable
+    double upperLimit(unsigned int var) const { return (var == 0) ? m_maxAB : m_maxBC; }
+
+    //! Check if the point is inside the Dalitz plot
+    /*!
+        \param [in] x array of (m^2(AB), m^2(BC))
+        \return true if the point is inside the phase space
+    */
+    bool withinLimits(const double* x) const {
+      double m2ab = x[0];
+      double m2bc = x[1];
+      if (m2ab < m_minAB || m2ab > m_maxAB || m2bc < m_minBC || m2bc > m_maxBC) return false;
+
+      double eb = (m2ab - m_a2 + m_b2)/2./sqrt(m2ab);
+      double ec = (m_d2 - m2ab - m_c2)/2./sqrt(m2ab);
+      double p2b = eb*eb - m_b2;
+      double p2c = ec*ec - m_c2;
+      if (p2c < 0 || p2b < 0) return false;
+
+      double e2 = (eb+ec)*(eb+ec);
+      double pmin = sqrt(p2b) - sqrt(p2c);
+      double pmax = sqrt(p2b) + sqrt(p2c);
+      if (m2bc < e2 - pmax*pmax || m2bc > e2 - pmin*pmin) return false;
+
+      return true;
+    }
+
+  private:
+
+    //! Squared masses of the daughters and of the decaying particle
+    double m_a2, m_b2, m_c2, m_d2;
+
+    //! Kinematic limits of the squared invariant masses
+    double m_minAB, m_maxAB, m_minBC, m_maxBC;
+
+};
+
+/// Standalone evaluator of a binned map stored in Meerkat text format.
+/// The phase space class provides the grid limits and the in-phase-space test
+/// (StandaloneRectangularPhaseSpace or StandaloneDalitzPhaseSpace). The map values
+/// can be stored as float to halve the memory footprint.
+
+template<class PhaseSpace, class T = double>
+class StandaloneBinnedMap {
+
+  public:
+
+    //! Dimensionality of the map
+    static const unsigned int N = PhaseSpace::dim;
+
+    //! Constructor that reads the map from a text file. The dimensionality of the map stored
+    //! in the file should match the dimensionality of the phase space.
+    /*!
+        \param [in] phaseSpace phase space (copied)
+        \param [in] fileName name of the text file
+    */
+    StandaloneBinnedMap(const PhaseSpace &phaseSpace, const char* fileName) : m_phaseSpace(phaseSpace) {
+      readFromTextFile(fileName);
+    }
+
+    //! Return the interpolated map value. Points outside of the grid limits give zero.
+    //! Like BinnedDensity::density(), the value is not set to zero outside of the phase space.
+    /*!
+        \param [in] x array of N coordinates
+        \return interpolated value
+    */
+    double density(const double* x) const {
+      double frac[N];
+      unsigned int index = 0;
+      for (unsigned int j=0; j<N; j++) {
+        double xj = x[j];
+        if (xj < m_lower[j] || xj > m_upper[j]) return 0.;
+        double t = (xj - m_lower[j])*m_invStep[j];
+        int ij = (int)t;
+        if (ij >= (int)m_binning[j]-1) ij = m_binning[j]-2;
+        frac[j] = t - (double)ij;
+        index += ij*m_stride[j];
+      }
+
+      double weight[1u << N];
+      weight[0] = 1.;
+      for (unsigned int j=0; j<N; j++) {
+        const unsigned int half = 1u << j;
+        for (unsigned int v=0; v<half; v++) {
+          weight[v+half] = weight[v]*frac[j];
+          weight[v] *= (1.-frac[j]);
+        }
+      }
+
+      const T* c = &(m_map[index]);
+      double e = 0.;
+      for (unsigned int v=0; v < (1u << N); v++) e += weight[v]*c[m_vertexOffset[v]];
+      return e;
+    }
+
+    //! Return the interpolated map value inside the phase space and zero outside
+    /*!
+        \param [in] x array of N coordinates
+        \return interpolated value
+    */
+    double densityInPhaseSpace(const double* x) const {
+      return m_phaseSpace.withinLimits(x) ? density(x) : 0.;
+    }
+
+    //! Check if the point is inside the phase space
+    bool withinLimits(const double* x) const { return m_phaseSpace.withinLimits(x); }
+
+    //! Return the phase space
+    const PhaseSpace &phaseSpace() const { return m_phaseSpace; }
+
+    //! Return the number of grid nodes in a variable
+    unsigned int bins(unsigned int var) const { return m_binning[var]; }
+
+    //! Return the map values (the 1st variable runs fastest)
+    const std::vector<T> &map() const { return m_map; }
+
+  private:
+
+    //! Read the map from a text file in the format written by BinnedDensity::writeToTextFile()
+    void readFromTextFile(const char* fileName) {
+      FILE* file = fopen(fileName, "r");
+      if (!file) {
+        printf("%20.20s ERROR: Cannot open file \"%s\"\n", "StandaloneBinnedMap", fileName);
+        abort();
+      }
+
+      unsigned int fileDim;
+      if (fscanf(file, "%u", &fileDim) != 1 || fileDim != N) {
+        printf("%20.20s ERROR: Dimensionality of the map in file \"%s\" does not match the phase space (%u)\n",
+               "StandaloneBinnedMap", fileName, N);
+        abort();
+      }
+
+      unsigned int size = 1;
+      for (unsigned int j=0; j<N; j++) {
+        if (fscanf(file, "%u", &(m_binning[j])) != 1 || m_binning[j] < 2) {
+          printf("%20.20s ERROR: Error reading number of bins in variable %u from file \"%s\"\n",
+                 "StandaloneBinnedMap", j, fileName);
+          abort();
+        }
+        m_lower[j] = m_phaseSpace.lowerLimit(j);
+        m_upper[j] = m_phaseSpace.upperLimit(j);
+        m_invStep[j] = ((double)m_binning[j]-1.)/(m_upper[j] - m_lower[j]);
+        m_stride[j] = size;
+        size *= m_binning[j];
+      }
+
+      for (unsigned int v=0; v < (1u << N); v++) {
+        m_vertexOffset[v] = 0;
+        for (unsigned int j=0; j<N; j++) {
+          if (v & (1u << j)) m_vertexOffset[v] += m_stride[j];
+        }
+      }
+
+      // Nodes are stored in the file with the 1st variable running fastest, as in the map
+      m_map.resize(size);
+      for (unsigned int i=0; i<size; i++) {
+        double e;
+        int inPhsp;
+        if (fscanf(file, "%lf %d", &e, &inPhsp) != 2) {
+          printf("%20.20s ERROR: Error reading map from file \"%s\", index %u\n", "StandaloneBinnedMap", fileName, i);
+          abort();
+        }
+        m_map[i] = (T)e;
+      }
+
+      fclose(file);
+    }
+
+    //! Phase space
+    PhaseSpace m_phaseSpace;
+
+    //! Lower grid limits
+    double m_lower[N];
+
+    //! Upper grid limits
+    double m_upper[N];
+
+    //! Inverse node spacings
+    double m_invStep[N];
+
+    //! Numbers of nodes in each variable
+    unsigned int m_binning[N];
+
+    //! Map strides of the variables
+    unsigned int m_stride[N];
+
+    //! Map offsets of the cell vertices relative to the lowest vertex
+    unsigned int m_vertexOffset[1u << N];
+
+    //! Map values in the nodes
+    std::vector<T> m_map;
+
+};
+
+#endif
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef STENCIL_CACHE
+#define STENCIL_CACHE
+
+#include "TMath.h"
+
+#include <vector>
+
+class GridEngine;
+struct BinnedOptions;
+
+/// Class that deposits the kernels into a binned map using precomputed weight stencils.
+/// The position of each event is snapped to a lattice with a given number of sub-nodes per grid cell
+/// in each variable (and the kernel width scale of the adaptive densities to a logarithmic lattice),
+/// so that all events with the same sub-node phase and width scale share the same footprint relative
+/// to the grid, and each deposition is a copy-add of the stencil of kernel values into the map.
+/// The stencils of the fixed-width kernels are all calculated by init(). For the adaptive kernels,
+/// init() chooses the width scale levels whose stencils fit into the memory limit (smallest scales first),
+/// and each stencil of these levels is calculated the first time it is needed.
+/// The events whose stencil is not cached are deposited directly, so the choice does not depend
+/// on the order of the events. The snapping shifts the kernel by at most half a sub-node, the resulting
+/// bound on the error of the kernel values is reported by init().
+
+class StencilCache {
+
+  public:
+
+    //! Constructor of a disabled cache
+    StencilCache();
+
+    //! Destructor
+    ~StencilCache();
+
+    //! Initialise the cache for a grid and kernel widths and print the error bound.
+    //! The cache stays disabled if the number of sub-nodes in the options is 0.
+    /*!
+        \param [in] grid grid of the map (has to stay valid while the cache is used)
+        \param [in] width array of kernel widths in each variable
+        \param [in] minScale minimum kernel width scale (1 for the fixed-width kernels)
+        \param [in] maxScale maximum kernel width scale (1 for the fixed-width kernels).
+                    Unless both limits are 1, the width scale is snapped to the logarithmic lattice.
+        \param [in] options options of the density (stencilSubdivisions, stencilScaleSteps, stencilMaxMemory)
+        \param [in] name name of the density used in the messages
+    */
+    void init(const GridEngine* grid, const Double_t* width, Double_t minScale, Double_t maxScale,
+              const BinnedOptions &options, const char* name);
+
+    //! Return true if the cache is used for the deposition
+    Bool_t enabled() const { return m_subdivisions > 0; }
+
+    //! Return the number of sub-nodes per grid cell
+    UInt_t subdivisions() const { return m_subdivisions; }
+
+    //! Return the bound on the error of the deposited kernel values relative to the kernel maximum
+    //! (for the width scale 1, the bound scales inversely with the width scale)
+    Double_t errorBound() const { return m_errorBound; }
+
+    //! Deposit the kernel of an event into the map. Can be called from several threads at once.
+    /*!
+        \param [in,out] map map on the grid
+        \param [in] point event coordinates
+        \param [in] widthScale kernel width scale
+        \param [in] weight kernel weight
+        \return false if there are no grid nodes within the kernel
+    */
+    Bool_t deposit(std::vector<Double_t> &map, const Double_t* point, Double_t widthScale, Double_t weight);
+
+    //! Print the statistics of the cache usage and release the stencils. The cache is disabled afterwards.
+    void release();
+
+  private:
+
+    //! Stencil of kernel values over the footprint of a kernel relative to the grid cell of the event
+    struct Stencil {
+      std::vector<Int_t> first;       //!< first node of the footprint relative to the cell in each variable
+      std::vector<UInt_t> length;     //!< number of nodes of the footprint in each variable
+      std::vector<Double_t> values;   //!< kernel values (1st variable runs fastest)
+    };
+
+    // The cache owns the stencils and is not copyable
+    StencilCache(const StencilCache &);
+    StencilCache &operator=(const StencilCache &);
+
+    //! Calculate the stencil of a table entry
+    /*!
+        \param [in] key index of the stencil in the table (width scale level and sub-node phases)
+        \return new stencil
+    */
+    Stencil* buildStencil(UInt_t key) const;
+
+    //! Return the upper bound on the memory used by the stencils of a width scale level and their table entries
+    /*!
+        \param [in] level width scale level
+        \return memory in bytes
+    */
+    Double_t levelMemory(UInt_t level) const;
+
+    //! Return the snapped width scale of a level
+    /*!
+        \param [in] level width scale level
+        \return width scale
+    */
+    Double_t levelScale(UInt_t level) const;
+
+    //! Add the stencil to the map at a grid cell
+    /*!
+        \param [in,out] map map on the grid
+        \param [in] cell cell of the event in each variable
+        \param [in] stencil stencil
+        \param [in] weight kernel weight
+        \return false if the stencil does not overlap the grid
+    */
+    Bool_t addStencil(std::vector<Double_t> &map, const Long64_t* cell, const Stencil &stencil, Double_t weight) const;
+
+    /// Grid of the map
+    const GridEngine* m_grid;
+
+    /// Kernel widths in each variable
+    std::vector<Double_t> m_width;
+
+    /// Kernel widths in units of the grid step in each variable
+    std::vector<Double_t> m_radius;
+
+    /// Number of sub-nodes per cell (0 if the cache is disabled)
+    UInt_t m_subdivisions;
+
+    /// Number of steps of the width scale lattice per doubling of the scale (0 for fixed-width kernels)
+    UInt_t m_scaleSteps;
+
+    /// Number of sub-node phases, i.e. stencils per width scale level
+    UInt_t m_phases;
+
+    /// Width scale lattice index of the first cached level
+    Int_t m_minIndex;
+
+    /// Number of cached width scale levels (1 for fixed-width kernels)
+    UInt_t m_levels;
+
+    /// Memory used by the stencils in bytes (updated atomically)
+    ULong64_t m_memory;
+
+    /// Number of the events deposited directly because their stencil is not cached (updated atomically)
+    ULong64_t m_misses;
+
+    /// Error bound of the kernel values for the width scale 1
+    Double_t m_errorBound;
+
+    /// Stencils indexed by the width scale level and the sub-node phases (level runs slowest).
+    /// The stencils of the adaptive kernels are published atomically when they are calculated.
+    std::vector<Stencil*> m_stencils;
+
+    /// Name of the density used in the messages
+    const char* m_name;
+
+};
+
+#endif
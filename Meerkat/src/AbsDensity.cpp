@@ -25,6 +25,42 @@ AbsDensity::~AbsDensity() {
 
 }
 
+Double_t AbsDensity::density(const Double_t* x, UInt_t dim) const {
+  std::vector<Double_t> point(x, x+dim);
+  return const_cast<AbsDensity*>(this)->density(point);
+}
+
+void AbsDensity::densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result) {
+
+  UInt_t dim = phaseSpace()->dimensionality();
+  std::vector<Double_t> point(dim);
+
+  UInt_t i, var;
+  for (i=0; i<numPoints; i++) {
+    for (var=0; var<dim; var++) point[var] = x[var][i];
+    result[i] = density(&(point[0]), dim);
+  }
+}
+
+Double_t AbsDensity::densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const {
+
+  AbsPhaseSpace* phsp = const_cast<AbsDensity*>(this)->phaseSpace(); 
+  std::vector<Double_t> point(x, x+dim);
+
+  UInt_t var;
+  for (var=0; var<dim; var++) {
+    Double_t h = 1e-5*(phsp->upperLimit(var) - phsp->lowerLimit(var)); 
+    point[var] = x[var] + h; 
+    Double_t up = density(&(point[0]), dim); 
+    point[var] = x[var] - h; 
+    Double_t down = density(&(point[0]), dim); 
+    point[var] = x[var]; 
+    grad[var] = (up - down)/(2.*h); 
+  }
+
+  return density(x, dim);
+}
+
 void AbsDensity::slice(std::vector<Double_t> &x, UInt_t num, TH1F* hist, Bool_t printout) {
 
   std::vector<Double_t> point = x; 
@@ -152,6 +188,57 @@ Double_t AbsDensity::generate(std::vector<Double_t> &x) {
   return d; 
 }
 
+void AbsDensity::setRandomStreams(UInt_t numStreams, UInt_t seed) {
+
+  if (seed == 0) seed = 1 + (UInt_t)(m_rnd.Rndm()*2147483647.); 
+
+  m_rndStreams.resize(numStreams); 
+  UInt_t i; 
+  for (i=0; i<numStreams; i++) {
+    m_rndStreams[i].SetSeed(seed + 7919*i); 
+  }
+}
+
+Double_t AbsDensity::generate(std::vector<Double_t> &x, UInt_t stream) {
+
+  if (stream >= m_rndStreams.size()) {
+    printf("%20.20s ERROR: Random stream %d requested, but only %d streams are created\n", 
+           m_name, stream, (UInt_t)m_rndStreams.size());
+    abort(); 
+  }
+
+  if (m_majorant <= 0) {
+    printf("%20.20s ERROR: Majorant has to be set before generating with random streams\n", m_name);
+    abort(); 
+  }
+
+  TRandom3 &rnd = m_rndStreams[stream]; 
+  UInt_t dimensionality = phaseSpace()->dimensionality(); 
+  UInt_t t; 
+
+  for (t = 0; t < m_maxTries; t++) {
+
+    // Generate random point
+    UInt_t var;
+    for (var = 0; var < dimensionality; var++) {
+      Double_t lowerLimit = phaseSpace()->lowerLimit(var);
+      Double_t upperLimit = phaseSpace()->upperLimit(var);
+      x[var] = lowerLimit + rnd.Rndm()*(upperLimit-lowerLimit);
+    }
+
+    if (phaseSpace()->withinLimits(&(x[0]), dimensionality)) {
+      Double_t y = m_majorant*rnd.Rndm();
+      Double_t d = density(&(x[0]), dimensionality); 
+      if (d > m_majorant) 
+        printf("%20.20s WARNING: PDF value %f exceeds majorant %f\n", m_name, d, m_majorant);
+      if (d > y) return d; 
+    }
+  }
+
+  printf("%20.20s WARNING: failed to generate a point within phase space after %d tries\n", m_name, m_maxTries); 
+  return 0;
+}
+
 void AbsDensity::generate(TNtuple* tree, UInt_t numEvents) {
 
   Float_t array[11]; 
@@ -11,3 +11,14 @@ AbsPhaseSpace::AbsPhaseSpace(const char* phaseSpaceName) {
 AbsPhaseSpace::~AbsPhaseSpace() {
 
 }
+
+
+Bool_t AbsPhaseSpace::withinLimits(const Double_t* x, UInt_t dim) const {
+  std::vector<Double_t> point(x, x+dim); 
+  return const_cast<AbsPhaseSpace*>(this)->withinLimits(point); 
+}
+
+Bool_t AbsPhaseSpace::limits(UInt_t var, const Double_t* x, UInt_t dim, Double_t* lower, Double_t* upper) const {
+  std::vector<Double_t> point(x, x+dim); 
+  return const_cast<AbsPhaseSpace*>(this)->limits(var, point, lower, upper); 
+}
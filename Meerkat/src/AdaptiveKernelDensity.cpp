@@ -10,6 +10,8 @@
 
 #include "AbsPhaseSpace.hh"
 #include "AbsDensity.hh"
+#include "GridEngine.hh"
+#include "StencilCache.hh"
 #include "AdaptiveKernelDensity.hh"
 
 #include "Timer.hh"
@@ -26,8 +28,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
   init(thePhaseSpace, tree, vars, binning, width, widthScale, approx, toyEvents, maxEvents, skipEvents); 
 }
 
@@ -41,8 +45,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents,
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
 
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -66,8 +72,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents,
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
 
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -91,8 +99,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -119,8 +129,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -147,8 +159,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
 
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -178,8 +192,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
 
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -209,8 +225,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -243,8 +261,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -277,8 +297,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -314,8 +336,10 @@ AdaptiveKernelDensity::AdaptiveKernelDensity(const char* pdfName,
                              AbsDensity* approx, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -373,6 +397,8 @@ void AdaptiveKernelDensity::init(AbsPhaseSpace* thePhaseSpace,
   m_minScale = 1./TMath::Power(m_minValue, 1./(Double_t)m_dim);
   
   m_fractionalMode = false; 
+  m_baked = false; 
+  m_interpolation = GridEngine::kLinear; 
 
   printf("%20.20s INFO: Creating binned adaptive kernel density over %dD phase space\n", m_name, m_dim ); 
   
@@ -395,122 +421,59 @@ void AdaptiveKernelDensity::init(AbsPhaseSpace* thePhaseSpace,
   }
 
   printf("%20.20s INFO: Map size=%d\n", m_name, size);
-  if (size > MAX_VECTOR_SIZE) {
+  if (size > MAX_VECTOR_SIZE && !m_options.sparse) {
     printf("%20.20s ERROR: Map size (%d) too large!\n", m_name, size);
     abort();
   }
 
-  m_map.resize(size);
-  m_approxMap.resize(size); 
+  if (!m_grid.init(m_phaseSpace, m_binning, m_options.tileSize, m_options.sparse)) {
+    printf("%20.20s ERROR: At least two bins are needed in each variable\n", m_name);
+    abort();
+  }
+
+  if (m_grid.sparse()) {
+    printf("%20.20s INFO: Sparse map layout with %d stored tiles, map size=%d (dense size=%d)\n", m_name, m_grid.storedTiles(), m_grid.size(), m_grid.nodes());
+    if (m_grid.size() > MAX_VECTOR_SIZE) {
+      printf("%20.20s ERROR: Map size (%d) too large!\n", m_name, m_grid.size());
+      abort();
+    }
+  }
+
+  m_map.resize(m_grid.size());
+  m_approxMap.resize(m_grid.size()); 
+  m_packedMap.setPrecision(m_options.precision); 
+  m_packedApproxMap.setPrecision(m_options.precision); 
+
+  m_stencils.init(&m_grid, &(m_width[0]), m_minScale, m_maxScale, m_options, m_name); 
 
   fillMapFromTree(tree, vars, maxEvents, skipEvents);
   fillMapFromDensity(m_approxDensity, toyEvents);
 
+  m_stencils.release(); 
+
   normalise(); 
 
+  packMaps(); 
+
 }
 
 /// Calculate map index for a given iterator vector
 UInt_t AdaptiveKernelDensity::iterToIndex( std::vector<UInt_t> &iter ) {
-  UInt_t index = 0;
-  Int_t n;
-  for (n=m_dim-1; n>=0; n--) {
-    if ((UInt_t)n == m_dim-1) {
-      index = iter[n]; 
-    } else {
-      index = index*m_binning[n] + iter[n];
-    }
-  }
-  return index;
+  return m_grid.iterToIndex( &(iter[0]) );
 }
 
 void AdaptiveKernelDensity::addToMap(std::vector<Double_t> &map, std::vector<Double_t> &point, Double_t widthScale, Double_t weight) {
 
-  // Fill the map
-  std::vector<UInt_t> initBin(m_dim); 
-  std::vector<UInt_t> finalBin(m_dim); 
-  std::vector<Double_t> lowLimit(m_dim);
-  std::vector<Double_t> coeff(m_dim); 
-
-  UInt_t size = map.size(); 
-
-  // Calculate the initial and final N-dim bins
-  UInt_t n;
-  
   // Corrected weight to keep the same normalisation for all kernels
   Double_t corrWeight = weight/widthScale; 
-  
-  for (n=0; n<m_dim; n++) {
-    Double_t width = m_width[n]*widthScale; 
-
-    Double_t x1 = point[n] - width; 
-    Double_t x2 = point[n] + width;
-
-    Double_t low = m_phaseSpace->lowerLimit(n);
-    Double_t up  = m_phaseSpace->upperLimit(n);
-    Int_t i1 = (int)TMath::Ceil( (x1-low)/(up-low)*(m_binning[n]-1) );
-    if (i1 < 0) i1 = 0; 
-    if (i1 >= (Int_t)m_binning[n]) i1 = m_binning[n] - 1;
-    Int_t i2 = (int)TMath::Floor( (x2-low)/(up-low)*(m_binning[n]-1) );
-    if (i2 < 0) i2 = 0; 
-    if (i2 >= (Int_t)m_binning[n]) i2 = m_binning[n] - 1;
-
-    if (i1 > i2) {
-      printf("%20.20s ERROR: i1(%d)>i2(%d) for n=%d, bin size is larger than kernel width!\n", m_name, i1, i2, n); 
-      abort(); 
-    }
 
-    initBin[n] = i1;
-    finalBin[n] = i2;
-
-    lowLimit[n] = phaseSpace()->lowerLimit(n); 
-    coeff[n] = ( phaseSpace()->upperLimit(n) - lowLimit[n] ) / ((Double_t)m_binning[n]-1); 
-    lowLimit[n] -= point[n]; 
-
-    coeff[n] /= width; 
-    lowLimit[n] /= width; 
+  Bool_t deposited = m_stencils.enabled() ? m_stencils.deposit(map, &(point[0]), widthScale, corrWeight) 
+                                            : m_grid.deposit(map, &(point[0]), &(m_width[0]), widthScale, corrWeight); 
+  if (!deposited) {
+    printf("%20.20s ERROR: no grid nodes within the kernel, bin size is larger than kernel width!\n", m_name); 
+    abort(); 
   }
 
-  // Loop through the map and fill bins
-  std::vector<UInt_t> iter(m_dim); 
-  for (n=0; n<m_dim; n++) iter[n] = initBin[n];
-
-  do {
-
-    UInt_t index = iterToIndex( iter ); 
-
-    if (index >= size) {
-      printf("%20.20s ERROR: index (%d) is larger than array size (%d)\n", m_name, index, size); 
-      abort(); 
-    } else {
-      Double_t sqsum = 0; 
-      for (n=0; n<m_dim; n++) {
-//        Double_t low = m_phaseSpace->lowerLimit(n);
-//        Double_t up  = m_phaseSpace->upperLimit(n);
-//        Double_t binx = low + (Double_t)iter[n]/((Double_t)m_binning[n]-1)*(up-low);
-//        Double_t dx = binx/m_width[n]; 
-        Double_t dx = lowLimit[n] + (Double_t)iter[n]*coeff[n];
-        if (fabs(dx) < 1.) sqsum += dx*dx; 
-      }
-      if (sqsum < 1.) map[index] += corrWeight*(1.-sqsum); 
-
-    }
-
-    // Increase iterator
-    Bool_t run = 0; 
-    for (n=0; n<m_dim; n++) {
-      if (iter[n] < finalBin[n]) {
-        iter[n]++; 
-        run = 1; 
-        break;
-      } else {
-        iter[n] = initBin[n];
-      }
-    }
-    if (!run) break;
-
-  } while(1); 
-
 }
 
 void AdaptiveKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &vars, 
@@ -554,6 +517,7 @@ void AdaptiveKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &
   std::vector<Double_t> point(m_dim); 
 
   Long64_t nout = 0;
+  Long64_t nunstored = 0; 
   
   set_timer(); 
   
@@ -566,7 +530,9 @@ void AdaptiveKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &
     if (m_dim + 1 == nvars) 
       weight = varArray[m_dim]; 
 
-    if (!m_phaseSpace->withinLimits( point )) {
+    Bool_t inside = m_phaseSpace->withinLimits( point ); 
+    if (inside && !m_grid.cellStored(&(point[0]))) nunstored++; 
+    if (!inside) {
       nout ++; 
 //      printf("%20.20s WARNING: Ntuple point (", m_name); 
 //      for (n=0; n<nvars; n++) {
@@ -592,6 +558,10 @@ void AdaptiveKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &
   }
 
   printf("%20.20s INFO: %lld events read in from \"%s\", %lld out\n", m_name, nentries-nout, tree->GetName(), nout ); 
+  if (nunstored > 0) {
+    printf("%20.20s WARNING: %lld events in the grid cells not stored in the sparse layout, their kernels are truncated\n", 
+           m_name, nunstored); 
+  }
 
 }
 
@@ -751,7 +721,7 @@ void AdaptiveKernelDensity::writeToTextFile(const char* filename) {
     iter[j] = 0;
   }
 
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
   
   // Loop through the bins
   do {
@@ -820,7 +790,7 @@ void AdaptiveKernelDensity::writeToRootFile(const char* filename) {
     iter[j] = 0;
   }
 
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
 
   TTree mapTree("MapTree", "MapTree"); 
   
@@ -888,7 +858,7 @@ void AdaptiveKernelDensity::normalise(void) {
   // Zero iterator vector
   std::vector<Double_t> x(m_dim);
   std::vector<UInt_t> iter(m_dim); 
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
 
   Int_t j;
 
@@ -943,123 +913,304 @@ void AdaptiveKernelDensity::normalise(void) {
   printf("%20.20s INFO: Average PDF value before normalisation is %f\n", m_name, sum); 
 
   // Loop through the map and scale its entries
-  for (j=0; j<(Int_t)size; j++) m_map[j] /= sum; 
+  unpackMaps(); 
+  for (j=0; j<(Int_t)m_map.size(); j++) m_map[j] /= sum; 
+
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMaps(); 
 
   setMajorant( majorant/sum ); 
 
 }
 
 
-Double_t AdaptiveKernelDensity::mapDensity(std::vector<Double_t> &map, std::vector<Double_t> &x) {
+void AdaptiveKernelDensity::setTileSize(UInt_t tileSize) {
+  changeLayout(tileSize, m_grid.sparse()); 
+}
 
-  Int_t j;
-  std::vector<UInt_t> ivect(m_dim); 
+void AdaptiveKernelDensity::setSparse(Bool_t sparse) {
+  changeLayout(m_grid.tileSize(), sparse); 
+}
 
-  for (j=0; j<(Int_t)m_dim; j++) {
-    Double_t low = m_phaseSpace->lowerLimit(j);
-    Double_t up  = m_phaseSpace->upperLimit(j);
-    Double_t xj = x[j]; 
-    if (xj < low || xj > up) {
-      return 0.;
-    }
-    Int_t ij = (int)floor((xj-low)/(up-low)*(m_binning[j]-1));
+void AdaptiveKernelDensity::changeLayout(UInt_t tileSize, Bool_t sparse) {
 
-    if (ij == (Int_t)m_binning[j]-1) ij--;
+  unpackMaps(); 
+  GridEngine previous = m_grid; 
+  m_grid.init(m_phaseSpace, m_binning, tileSize, sparse); 
+  m_options.tileSize = tileSize; 
+  m_options.sparse = sparse; 
 
-    ivect[j] = ij;
+  if (m_grid.size() > MAX_VECTOR_SIZE) {
+    printf("%20.20s ERROR: Map size (%d) with tile size %d too large!\n", m_name, m_grid.size(), m_grid.tileSize()); 
+    abort(); 
   }
 
-  Double_t e = 0.;
-  Double_t wsum = 0.;
+  printf("%20.20s INFO: Map layout with tile size %d%s, map size=%d\n", m_name, m_grid.tileSize(), 
+         sparse ? " (sparse)" : "", m_grid.size()); 
 
-  std::vector<UInt_t> iter(m_dim); 
+  std::vector<Double_t> map; 
+  m_grid.convert(previous, m_map, map); 
+  m_map.swap(map); 
+  if (!m_baked) {
+    m_grid.convert(previous, m_approxMap, map); 
+    m_approxMap.swap(map); 
+  }
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMaps(); 
+}
 
-  for (j=0; j<(Int_t)m_dim; j++) {
-    iter[j] = 0;
+void AdaptiveKernelDensity::setPrecision(GridMap::Precision precision) {
+  unpackMaps(); 
+  m_packedMap.setPrecision(precision); 
+  m_packedApproxMap.setPrecision(precision); 
+  m_options.precision = precision; 
+  packMaps(); 
+}
+
+/// Pack the maps into the storage with reduced precision and release the double precision maps
+void AdaptiveKernelDensity::packMaps(void) {
+  if (m_packedMap.precision() == GridMap::kDouble || m_packedMap.size() > 0) return; 
+  m_packedMap.pack(m_map); 
+  std::vector<Double_t>().swap(m_map); 
+  if (!m_baked) {
+    m_packedApproxMap.pack(m_approxMap); 
+    std::vector<Double_t>().swap(m_approxMap); 
   }
+  printf("%20.20s INFO: Maps packed with precision %d, %llu bytes\n", m_name, (Int_t)m_packedMap.precision(), 
+         m_packedMap.bytes() + m_packedApproxMap.bytes()); 
+}
 
-  // Loop through the vertices of the N-dim cube
-  do {
+/// Restore the double precision maps from the packed storage
+void AdaptiveKernelDensity::unpackMaps(void) {
+  if (m_packedMap.size() == 0) return; 
+  m_packedMap.unpack(m_map); 
+  m_packedMap.clear(); 
+  if (!m_baked) {
+    m_packedApproxMap.unpack(m_approxMap); 
+    m_packedApproxMap.clear(); 
+  }
+}
 
-    // Calculate weight
-    Double_t weight = 1; 
-    for (j=0; j<(Int_t)m_dim; j++) {
-      Double_t low = m_phaseSpace->lowerLimit(j);
-      Double_t up  = m_phaseSpace->upperLimit(j);
+/// Replace the estimated map by the final PDF values in the grid nodes and release the approximation map
+void AdaptiveKernelDensity::bake(void) {
 
-      Double_t xj1 = low + ((Double_t)ivect[j]   )/((Double_t)m_binning[j]-1.)*(up-low);
-      Double_t xj2 = low + ((Double_t)ivect[j]+1.)/((Double_t)m_binning[j]-1.)*(up-low);
+  if (m_baked) return; 
 
-//      if (x[j] < xj1 || x[j] > xj2) {
-//        printf("%20.20s WARNING: dim %d: x=%f, x1=%f, x2=%f\n", m_name, j, x[j], xj1, xj2); 
-//      }
+  printf("%20.20s INFO: Baking PDF values into a single map\n", m_name); 
 
-      Double_t fweight;
-      if (iter[j] == 0) {
-        fweight = 1. - (x[j]-xj1)/(xj2-xj1); 
-      } else {
-        fweight = (x[j]-xj1)/(xj2-xj1); 
-      }
-      if (fweight < 0.) {
-        printf("%20.20s WARNING: dim %d: x=%f, weight=%f\n", m_name, j, x[j], fweight); 
-        fweight = 0.;
-      }
-      if (fweight > 1.) {
-        printf("%20.20s WARNING: dim %d: x=%f, weight=%f\n", m_name, j, x[j], fweight); 
-        fweight = 1.;
-      }
+  unpackMaps(); 
 
-      weight *= fweight; 
+  UInt_t size = m_grid.nodes(); 
+  Bool_t useApprox = (m_approxDensity && !m_fractionalMode); 
 
-//      printf("DEBUG:   Weight fraction: dim%d, i=%d, x=%f, x1=%f, x2=%f, fweight=%f\n", j, iter[j], x[j], xj1, xj2, fweight);
+  // Nodes are processed in chunks to evaluate the approximation PDF in batches
+  const UInt_t chunkSize = 4096; 
+  std::vector< std::vector<Double_t> > nodes(m_dim, std::vector<Double_t>(chunkSize)); 
+  std::vector<const Double_t*> nodePtr(m_dim); 
+  std::vector<Double_t> approx(chunkSize); 
+  std::vector<UInt_t> index(chunkSize); 
+  std::vector<UInt_t> iter(m_dim, 0); 
 
-    }
+  UInt_t j; 
+  for (j=0; j<m_dim; j++) nodePtr[j] = &(nodes[j][0]); 
 
-    UInt_t index = 0;
-    for (j=m_dim-1; j>=0; j--) {
-      Int_t ij = ivect[j] + iter[j]; 
-      if (j==(Int_t)m_dim-1) {
-        index = ij; 
-      } else {
-        index = index*m_binning[j] + ij;
+  UInt_t visited = 0; 
+  while (visited < size) {
+    UInt_t num = 0; 
+    UInt_t i; 
+
+    // Nodes are visited in the logical order (1st variable runs fastest), 
+    // the nodes which are not stored in the sparse layout are skipped
+    for (; num<chunkSize && visited<size; visited++) {
+      index[num] = m_grid.iterToIndex(&(iter[0])); 
+      if (m_grid.isStored(index[num])) {
+        for (j=0; j<m_dim; j++) nodes[j][num] = m_grid.nodeCoordinate(j, iter[j]); 
+        num++; 
+      }
+      for (j=0; j<m_dim; j++) {
+        if (iter[j] < m_binning[j]-1) {
+          iter[j]++; 
+          break; 
+        } else {
+          iter[j] = 0; 
+        }
       }
     }
 
-    e += weight*map[index]; 
-    wsum += weight; 
-
-//    printf("DEBUG: Weight=%f, index=%d, density=%f\n", weight, index, m_map[index]); 
+    if (useApprox) m_approxDensity->densityBatch(num, &(nodePtr[0]), &(approx[0])); 
 
-    // Increment iterator
-    Bool_t run = 0; 
-    for (j=0; j<(Int_t)m_dim; j++) {
-      if (iter[j] == 0) {
-        iter[j]++; 
-        run = 1; 
-        break;
+    for (i=0; i<num; i++) {
+      Double_t e = m_map[index[i]]; 
+      Double_t a = m_approxMap[index[i]]; 
+      if (a > 0.) {
+        m_map[index[i]] = useApprox ? e/a*approx[i] : e/a; 
       } else {
-        iter[j] = 0;
+        m_map[index[i]] = 0.; 
       }
     }
-    if (!run) break;
+  }
 
-  } while(1); 
+  // Release the memory of the approximation map
+  std::vector<Double_t>().swap(m_approxMap); 
+  m_packedApproxMap.clear(); 
+  m_baked = true; 
+  packMaps(); 
 
-//  printf("density=%f, wsum=%f\n", e, wsum); 
+}
+
+
+Double_t AdaptiveKernelDensity::mapDensity(std::vector<Double_t> &map, std::vector<Double_t> &x) {
+  if (m_interpolation == GridEngine::kCubic) return m_grid.interpolateCubic(map, &(x[0])); 
+  return m_grid.interpolate(map, &(x[0])); 
+}
 
-  return e; 
+Bool_t AdaptiveKernelDensity::interpolateMaps(const Double_t* x, Double_t* e, Double_t* a) const {
+  Bool_t packed = (m_packedMap.size() > 0); 
+  if (m_interpolation == GridEngine::kCubic) {
+    if (m_baked) {
+      *a = 1.; 
+      *e = packed ? m_grid.interpolateCubic(m_packedMap, x) : m_grid.interpolateCubic(m_map, x); 
+      if (*e < 0.) *e = 0.; 
+      return 1; 
+    }
+    Bool_t inside = packed ? m_grid.interpolateCubic(m_packedMap, m_packedApproxMap, x, e, a) : 
+                             m_grid.interpolateCubic(m_map, m_approxMap, x, e, a); 
+    // Outside the grid the values are not set
+    if (inside && *e < 0.) *e = 0.; 
+    return inside; 
+  }
+  if (m_baked) {
+    *a = 1.; 
+    *e = packed ? m_grid.interpolate(m_packedMap, x) : m_grid.interpolate(m_map, x); 
+    return 1; 
+  }
+  return packed ? m_grid.interpolate(m_packedMap, m_packedApproxMap, x, e, a) : 
+                  m_grid.interpolate(m_map, m_approxMap, x, e, a); 
+}
 
+Double_t AdaptiveKernelDensity::interpolateMapGradient(const std::vector<Double_t> &map, const GridMap &packedMap, 
+                                                       const Double_t* x, Double_t* grad) const {
+  Bool_t packed = (packedMap.size() > 0); 
+  if (m_interpolation == GridEngine::kCubic) 
+    return packed ? m_grid.interpolateCubicGradient(packedMap, x, grad) : m_grid.interpolateCubicGradient(map, x, grad); 
+  return packed ? m_grid.interpolateGradient(packedMap, x, grad) : m_grid.interpolateGradient(map, x, grad); 
 }
 
-Double_t AdaptiveKernelDensity::density(std::vector<Double_t> &x) {
-  Double_t a = mapDensity(m_approxMap, x); 
+Double_t AdaptiveKernelDensity::density(const Double_t* x, UInt_t dim) const {
+  Double_t e, a; 
+  Bool_t inside = interpolateMaps(x, &e, &a); 
+  if (m_baked) return e; 
+  if (!inside) return 0.; 
   if (a>0.) {
     if (m_approxDensity && !m_fractionalMode) { 
-      return mapDensity(m_map, x)/a*m_approxDensity->density(x); 
+      return e/a*m_approxDensity->density(x, dim); 
     } else { 
-      return mapDensity(m_map, x)/a; 
+      return e/a; 
     }
   } else {
     return 0.; 
   }
 }
+
+void AdaptiveKernelDensity::densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result) {
+
+  if (numPoints == 0) return; 
+
+  std::vector<Double_t> point(m_dim); 
+  UInt_t i, j;
+
+  // Baked map already contains the final PDF values
+  if (m_baked) {
+    for (i=0; i<numPoints; i++) {
+      for (j=0; j<m_dim; j++) point[j] = x[j][i]; 
+      Double_t a; 
+      interpolateMaps(&(point[0]), &(result[i]), &a); 
+    }
+    return; 
+  }
+
+  // Approximation PDF is evaluated for the whole batch at once
+  Bool_t useApprox = (m_approxDensity && !m_fractionalMode); 
+  std::vector<Double_t> approx; 
+  if (useApprox) {
+    approx.resize(numPoints); 
+    m_approxDensity->densityBatch(numPoints, x, &(approx[0])); 
+  }
+
+  for (i=0; i<numPoints; i++) {
+    for (j=0; j<m_dim; j++) point[j] = x[j][i]; 
+
+    // Both maps share the same interpolation weights
+    Double_t e, a; 
+    Bool_t inside = interpolateMaps(&(point[0]), &e, &a); 
+    if (inside && a > 0.) {
+      result[i] = useApprox ? e/a*approx[i] : e/a; 
+    } else {
+      result[i] = 0.; 
+    }
+  }
+}
+
+Double_t AdaptiveKernelDensity::densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const {
+
+  UInt_t j; 
+  if (m_baked) {
+    Double_t e = interpolateMapGradient(m_map, m_packedMap, x, grad); 
+    if (m_interpolation == GridEngine::kCubic && e <= 0.) {
+      for (j=0; j<m_dim; j++) grad[j] = 0.; 
+      return 0.; 
+    }
+    return e; 
+  }
+
+  std::vector<Double_t> gradE(m_dim); 
+  std::vector<Double_t> gradA(m_dim); 
+  Double_t e = interpolateMapGradient(m_map, m_packedMap, x, &(gradE[0])); 
+  Double_t a = interpolateMapGradient(m_approxMap, m_packedApproxMap, x, &(gradA[0])); 
+
+  // Cubic interpolation of the map is truncated at zero
+  if (a <= 0. || (m_interpolation == GridEngine::kCubic && e <= 0.)) {
+    for (j=0; j<m_dim; j++) grad[j] = 0.; 
+    return 0.; 
+  }
+
+  // Gradient of the ratio e/a
+  Double_t ratio = e/a; 
+  for (j=0; j<m_dim; j++) grad[j] = (gradE[j] - ratio*gradA[j])/a; 
+
+  if (m_approxDensity && !m_fractionalMode) {
+    std::vector<Double_t> gradApprox(m_dim); 
+    Double_t approx = m_approxDensity->densityGradient(x, dim, &(gradApprox[0])); 
+    for (j=0; j<m_dim; j++) grad[j] = grad[j]*approx + ratio*gradApprox[j]; 
+    return ratio*approx; 
+  }
+
+  return ratio; 
+}
+
+void AdaptiveKernelDensity::buildIntegralTable(void) {
+  if (!m_baked) {
+    printf("%20.20s ERROR: Integral table needs the baked mode, call bake() first\n", m_name); 
+    abort(); 
+  }
+  if (m_grid.sparse()) {
+    printf("%20.20s ERROR: Integral table is not available in the sparse layout, call setSparse(false) first\n", m_name); 
+    abort(); 
+  }
+  printf("%20.20s INFO: Building summed-volume table\n", m_name); 
+  if (m_packedMap.size() > 0) {
+    std::vector<Double_t> map; 
+    m_packedMap.unpack(map); 
+    m_grid.cumulate(map, m_integralTable); 
+  } else {
+    m_grid.cumulate(m_map, m_integralTable); 
+  }
+}
+
+Double_t AdaptiveKernelDensity::integral(const Double_t* lower, const Double_t* upper) const {
+  if (m_integralTable.size() == 0) {
+    printf("%20.20s ERROR: buildIntegralTable() has to be called before integral()\n", m_name); 
+    abort(); 
+  }
+  return m_grid.integrate(m_integralTable, lower, upper); 
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <vector>
 #include <stdlib.h>
+#include <thread>
 
 #include "TMath.h"
 #include "TFile.h"
@@ -10,12 +11,18 @@
 
 #include "AbsPhaseSpace.hh"
 #include "AbsDensity.hh"
+#include "GridEngine.hh"
 #include "BinnedDensity.hh"
+#include "BinnedKernelDensity.hh"
 
 #include "Timer.hh"
 
 #define MAX_VECTOR_SIZE 20000000
 
+/// Maximum dimensionality of the lazily filled maps
+#define MAX_LAZY_DIM 16
+
+
 /// Constructor that fills bins from AbsDensity
 BinnedDensity::BinnedDensity(const char* pdfName, 
                              AbsPhaseSpace* thePhaseSpace, 
@@ -24,7 +31,10 @@ BinnedDensity::BinnedDensity(const char* pdfName,
                              UInt_t bins2, 
                              UInt_t bins3, 
                              UInt_t bins4, 
-                             UInt_t bins5) : AbsDensity(pdfName) {
+                             UInt_t bins5, 
+                             const BinnedOptions &options) : AbsDensity(pdfName) {
+  m_options = options; 
+
   std::vector<UInt_t> bins; 
   bins.push_back( bins1 ); 
   if (bins2 > 0) bins.push_back( bins2 ); 
@@ -39,22 +49,79 @@ BinnedDensity::BinnedDensity(const char* pdfName,
 BinnedDensity::BinnedDensity(const char* pdfName, 
                              AbsPhaseSpace* thePhaseSpace, 
                              std::vector<UInt_t> &binning, 
-                             AbsDensity* d) : AbsDensity(pdfName) {
+                             AbsDensity* d, 
+                             const BinnedOptions &options) : AbsDensity(pdfName) {
+  m_options = options; 
   init(thePhaseSpace, binning, d); 
 }
 
+/// Constructor that combines several densities
+BinnedDensity::BinnedDensity(const char* pdfName, 
+                             AbsPhaseSpace* thePhaseSpace, 
+                             std::vector<UInt_t> &binning, 
+                             std::vector<AbsDensity*> &densities, 
+                             Operation op, 
+                             const BinnedOptions &options) : AbsDensity(pdfName) {
+
+  if (densities.size() == 0) {
+    printf("%20.20s ERROR: No densities to combine\n", m_name); 
+    abort(); 
+  }
+
+  m_options = options; 
+  m_density = 0; 
+  printf("%20.20s INFO: Combining %d densities over %dD phase space\n", m_name, (UInt_t)densities.size(), thePhaseSpace->dimensionality()); 
+  initGrid(thePhaseSpace, binning); 
+
+  nodeValues(densities[0], m_map); 
+  std::vector<Double_t> values; 
+  UInt_t k; 
+  for (k=1; k<densities.size(); k++) {
+    nodeValues(densities[k], values); 
+    combineMap(values, op); 
+  }
+
+  packMap(); 
+}
+
 /// Initialise method used by both constructors
 void BinnedDensity::init(AbsPhaseSpace* thePhaseSpace, 
                     std::vector<UInt_t> &binning, 
                     AbsDensity* d) {
 
-  m_phaseSpace = thePhaseSpace; 
-  m_binning = binning; 
   m_density = d; 
-  UInt_t dim = m_phaseSpace->dimensionality(); 
+  UInt_t dim = thePhaseSpace->dimensionality(); 
 
   printf("%20.20s INFO: Creating binned density over %dD phase space from density \"%s\"\n", m_name, dim, d->name() ); 
+
+  initGrid(thePhaseSpace, binning); 
+
+  if (m_options.lazyBlockSize > 0) {
+    if (dim <= MAX_LAZY_DIM && d->phaseSpace()->dimensionality() == dim) {
+      initLazy(m_options.lazyBlockSize); 
+      printf("%20.20s INFO: Lazy filling in blocks of %d nodes, %d blocks\n", m_name, m_lazyBlockSize, (UInt_t)m_blockFilled.size()); 
+      return; 
+    }
+    printf("%20.20s WARNING: Lazy filling is not available, filling the whole map\n", m_name); 
+  }
+
+  Double_t phspAverage = nodeValues(m_density, m_map); 
   
+  // Normalize map such that its average equals to 1.
+  UInt_t j; 
+  for (j = 0; j<m_map.size(); j++) m_map[j] /= phspAverage; 
+
+  packMap(); 
+}
+
+/// Set up the grid and the empty map
+void BinnedDensity::initGrid(AbsPhaseSpace* thePhaseSpace, 
+                             std::vector<UInt_t> &binning) {
+
+  m_phaseSpace = thePhaseSpace; 
+  m_binning = binning; 
+  m_interpolation = GridEngine::kLinear; 
+
   if (m_binning.size() != m_phaseSpace->dimensionality()) {
     printf("%20.20s ERROR: Dimensionality of phase space (%d) does not match binning vector size (%d)\n", 
            m_name, m_phaseSpace->dimensionality(), (UInt_t)m_binning.size());
@@ -68,80 +135,373 @@ void BinnedDensity::init(AbsPhaseSpace* thePhaseSpace,
   }
   
   printf("%20.20s INFO: Map size=%d\n", m_name, size); 
-  if (size > MAX_VECTOR_SIZE) {
+  if (size > MAX_VECTOR_SIZE && !m_options.sparse) {
     printf("%20.20s ERROR: Map size (%d) too large!\n", m_name, size); 
     abort(); 
   }
   
-  m_map.resize(size); 
-  
-  std::vector<Double_t> x(dim);
-  std::vector<UInt_t> iter(dim); 
-  Int_t j;
-  for (j=0; j<(Int_t)dim; j++) {
-    iter[j] = 0;
+  if (!m_grid.init(m_phaseSpace, m_binning, m_options.tileSize, m_options.sparse)) {
+    printf("%20.20s ERROR: At least two bins are needed in each variable\n", m_name);
+    abort();
   }
-  
+  checkSparseSize(); 
+
+  m_map.assign(m_grid.size(), 0.); 
+  m_packedMap.setPrecision(m_options.precision); 
+  m_integralTable.clear(); 
+  initLazy(0); 
+}
+
+/// Number of grid nodes evaluated in one call of the batch interface
+static const UInt_t nodeChunkSize = 4096; 
+
+/// Evaluate the density in all grid nodes in chunks using the batch interface
+Double_t BinnedDensity::nodeValues(AbsDensity* d, std::vector<Double_t> &values) {
+
+  UInt_t dim = m_phaseSpace->dimensionality(); 
+  UInt_t size = m_grid.nodes(); 
+
+  if (d->phaseSpace()->dimensionality() != dim) {
+    printf("%20.20s ERROR: Dimensionality of density \"%s\" (%d) does not match the phase space (%d)\n", 
+           m_name, d->name(), d->phaseSpace()->dimensionality(), dim);
+    abort(); 
+  }
+
+  // Binned densities on the same nodes are copied without interpolation
+  if (storedNodeValues(d, values)) return phaseSpaceAverage(values); 
+
+  values.assign(m_grid.size(), 0.); 
+  std::vector<Char_t> inPhsp(size, 0); 
+
+  UInt_t nextChunk = 0; 
+  UInt_t doneNodes = 0; 
+  UInt_t numThreads = TMath::Min(m_options.fillThreads, (size + nodeChunkSize - 1)/nodeChunkSize); 
+
+  set_timer(); 
+
+  if (numThreads <= 1) {
+    nodeValuesRange(d, &nextChunk, &doneNodes, values, inPhsp, 1); 
+  } else {
+    printf("%20.20s INFO: Evaluating density \"%s\" in %d threads\n", m_name, d->name(), numThreads); 
+
+    // Chunks are distributed dynamically, the 1st thread prints the progress
+    std::vector<std::thread> threads; 
+    UInt_t t; 
+    for (t=0; t<numThreads; t++) {
+      threads.push_back(std::thread(&BinnedDensity::nodeValuesRange, this, d, &nextChunk, &doneNodes, 
+                                    std::ref(values), std::ref(inPhsp), (Bool_t)(t == 0))); 
+    }
+    for (t=0; t<numThreads; t++) threads[t].join(); 
+  }
+
+  // The average is summed in the logical order of the nodes, so it does not depend on the number of threads
+  std::vector<UInt_t> iter(dim, 0); 
   Double_t phspSum = 0.;
   UInt_t phspNum = 0;
-  
-  set_timer(); 
-  
-  do {
-    UInt_t index = 0;
-    for (j=dim-1; j>=0; j--) {
-      Double_t low = m_phaseSpace->lowerLimit(j);
-      Double_t up = m_phaseSpace->upperLimit(j);
-      x[j] = low + (Double_t)iter[j]/((Double_t)m_binning[j]-1)*(up-low);
-      if (j==(Int_t)dim-1) {
-        index = iter[j]; 
+
+  UInt_t i, j; 
+  for (i=0; i<size; i++) {
+    if (inPhsp[i]) {
+      phspSum += values[m_grid.iterToIndex(&(iter[0]))]; 
+      phspNum++; 
+    }
+    for (j=0; j<dim; j++) {
+      if (iter[j] < m_binning[j]-1) {
+        iter[j]++; 
+        break; 
       } else {
-        index = index*m_binning[j] + iter[j];
+        iter[j] = 0; 
       }
-//      if (iter[0] == 0)
-//        printf("  Dim%d, bin%d, x=%f\n", j, iter[j], x[j]); 
     }
+  }
+
+  return (phspNum > 0) ? phspSum/(Double_t)phspNum : 0.; 
+}
+
+void BinnedDensity::nodeValuesRange(AbsDensity* d, UInt_t* nextChunk, UInt_t* doneNodes, 
+                                    std::vector<Double_t> &values, std::vector<Char_t> &inPhsp, Bool_t progress) {
+
+  UInt_t dim = m_phaseSpace->dimensionality(); 
+  UInt_t size = m_grid.nodes(); 
+
+  std::vector< std::vector<Double_t> > nodes(dim, std::vector<Double_t>(nodeChunkSize)); 
+  std::vector<const Double_t*> nodePtr(dim); 
+  std::vector<UInt_t> index(nodeChunkSize); 
+  std::vector<UInt_t> logical(nodeChunkSize); 
+  std::vector<Double_t> chunk(nodeChunkSize); 
+  std::vector<Double_t> x(dim);
+  std::vector<UInt_t> iter(dim); 
+
+  UInt_t j; 
+  for (j=0; j<dim; j++) nodePtr[j] = &(nodes[j][0]); 
 
-    Double_t e = m_density->density(x); 
-    if (m_phaseSpace->withinLimits(x)) {
-      phspSum += e;
-      phspNum++;
+  do {
+    UInt_t start = __atomic_fetch_add(nextChunk, 1, __ATOMIC_RELAXED)*nodeChunkSize; 
+    if (start >= size) break; 
+    UInt_t num = TMath::Min(nodeChunkSize, size-start); 
+    UInt_t stored = 0; 
+    UInt_t i; 
+
+    // Iterator of the first node of the chunk
+    UInt_t rest = start; 
+    for (j=0; j<dim; j++) {
+      iter[j] = rest % m_binning[j]; 
+      rest /= m_binning[j]; 
     }
-    
-    if ((index % 100) == 0 && timer(2))
-      printf("%20.20s INFO: Index %d, density=%f\n", m_name, index, e); 
 
-    if (index >= size) {
-      printf("%20.20s ERROR: index (%d) is larger than array size (%d)\n", m_name, index, size); 
-      abort(); 
-    } else {
-      m_map[index] = e; 
+    // Nodes are visited in the logical order (1st variable runs fastest) and stored at their map index. 
+    // Nodes outside of the stored tiles of a sparse map are skipped, they are outside the phase space. 
+    for (i=0; i<num; i++) {
+      UInt_t mapIndex = m_grid.iterToIndex(&(iter[0])); 
+      if (m_grid.isStored(mapIndex)) {
+        for (j=0; j<dim; j++) {
+          Double_t low = m_phaseSpace->lowerLimit(j);
+          Double_t up = m_phaseSpace->upperLimit(j);
+          nodes[j][stored] = low + (Double_t)iter[j]/((Double_t)m_binning[j]-1)*(up-low);
+        }
+        index[stored] = mapIndex; 
+        logical[stored] = start + i; 
+        stored++; 
+      }
+      for (j=0; j<dim; j++) {
+        if (iter[j] < m_binning[j]-1) {
+          iter[j]++; 
+          break; 
+        } else {
+          iter[j] = 0; 
+        }
+      }
     }
 
-    Bool_t run = 0; 
-    for (j=0; j<(Int_t)dim; j++) {
+    if (stored > 0) d->densityBatch(stored, &(nodePtr[0]), &(chunk[0])); 
+
+    for (i=0; i<stored; i++) {
+      values[index[i]] = chunk[i]; 
+      for (j=0; j<dim; j++) x[j] = nodes[j][i]; 
+      inPhsp[logical[i]] = m_phaseSpace->withinLimits(&(x[0]), dim); 
+    }
+
+    UInt_t done = __atomic_add_fetch(doneNodes, num, __ATOMIC_RELAXED); 
+    if (progress && timer(2))
+      printf("%20.20s INFO: %d/%d nodes evaluated (%f%%), density=%f\n", m_name, done, size, 100.*(Double_t)done/(Double_t)size, (stored > 0) ? chunk[0] : 0.); 
+
+  } while(1); 
+}
+
+Bool_t BinnedDensity::storedNodeValues(AbsDensity* d, std::vector<Double_t> &values) const {
+
+  BinnedDensity* binned = dynamic_cast<BinnedDensity*>(d); 
+  BinnedKernelDensity* kernel = dynamic_cast<BinnedKernelDensity*>(d); 
+
+  std::vector<Double_t> source; 
+  GridEngine::Interpolation interpolation; 
+  if (binned && binned->m_grid.sameNodes(m_grid)) {
+    binned->fillAllBlocks(); 
+    if (binned->m_packedMap.size() > 0) binned->m_packedMap.unpack(source); 
+    else source = binned->m_map; 
+    m_grid.convert(binned->m_grid, source, values); 
+    interpolation = binned->m_interpolation; 
+  } else if (kernel && kernel->grid().sameNodes(m_grid)) {
+    kernel->nodeDensities(source); 
+    m_grid.convert(kernel->grid(), source, values); 
+    interpolation = kernel->interpolation(); 
+  } else {
+    return 0; 
+  }
+
+  printf("%20.20s INFO: Copying the map of density \"%s\" defined on the same nodes\n", m_name, d->name()); 
+
+  // The cubic interpolation truncates the negative values at zero, also in the nodes
+  if (interpolation == GridEngine::kCubic) {
+    UInt_t i; 
+    for (i=0; i<values.size(); i++) if (values[i] < 0.) values[i] = 0.; 
+  }
+  return 1; 
+}
+
+Double_t BinnedDensity::phaseSpaceAverage(const std::vector<Double_t> &values) const {
+
+  UInt_t dim = m_phaseSpace->dimensionality(); 
+  std::vector<Double_t> x(dim); 
+  std::vector<UInt_t> iter(dim, 0); 
+  Double_t phspSum = 0.; 
+  UInt_t phspNum = 0; 
+
+  UInt_t i, j; 
+  for (i=0; i<m_grid.nodes(); i++) {
+    for (j=0; j<dim; j++) x[j] = m_grid.nodeCoordinate(j, iter[j]); 
+    if (m_phaseSpace->withinLimits(&(x[0]), dim)) {
+      phspSum += values[m_grid.iterToIndex(&(iter[0]))]; 
+      phspNum++; 
+    }
+    for (j=0; j<dim; j++) {
       if (iter[j] < m_binning[j]-1) {
         iter[j]++; 
-        run = 1; 
-        break;
+        break; 
       } else {
-        iter[j] = 0;
+        iter[j] = 0; 
       }
     }
-    if (!run) break;
-    
+  }
 
-  } while(1); 
-  
-  // Normalize map such that its average equals to 1.
-  phspSum /= (Double_t)phspNum; 
-  for (j = 0; j<(Int_t)size; j++) m_map[j] /= phspSum; 
+  return (phspNum > 0) ? phspSum/(Double_t)phspNum : 0.; 
+}
+
+void BinnedDensity::combineMap(const std::vector<Double_t> &values, Operation op, Double_t c) {
+  UInt_t size = m_map.size(); 
+  Double_t* map = &(m_map[0]); 
+  const Double_t* v = &(values[0]); 
+  UInt_t i; 
+  if (op == kSum) {
+    for (i=0; i<size; i++) map[i] += c*v[i]; 
+  } else if (op == kProduct) {
+    for (i=0; i<size; i++) map[i] *= v[i]; 
+  } else {
+    for (i=0; i<size; i++) map[i] = (v[i] != 0.) ? map[i]/v[i] : 0.; 
+  }
+}
+
+void BinnedDensity::add(AbsDensity* d, Double_t c) {
+  std::vector<Double_t> values; 
+  nodeValues(d, values); 
+  fillAllBlocks(); 
+  unpackMap(); 
+  combineMap(values, kSum, c); 
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMap(); 
+}
+
+void BinnedDensity::multiply(AbsDensity* d) {
+  std::vector<Double_t> values; 
+  nodeValues(d, values); 
+  fillAllBlocks(); 
+  unpackMap(); 
+  combineMap(values, kProduct); 
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMap(); 
+}
+
+void BinnedDensity::divide(AbsDensity* d) {
+  std::vector<Double_t> values; 
+  nodeValues(d, values); 
+  fillAllBlocks(); 
+  unpackMap(); 
+  combineMap(values, kRatio); 
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMap(); 
+}
+
+void BinnedDensity::scale(Double_t c) {
+  fillAllBlocks(); 
+  unpackMap(); 
+  UInt_t i; 
+  for (i=0; i<m_map.size(); i++) m_map[i] *= c; 
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMap(); 
+}
+
+void BinnedDensity::normalise(void) {
+
+  fillAllBlocks(); 
+
+  UInt_t dim = m_phaseSpace->dimensionality(); 
+  std::vector<Double_t> x(dim); 
+  std::vector<UInt_t> iter(dim, 0); 
+  Double_t phspSum = 0.; 
+  UInt_t phspNum = 0; 
+
+  UInt_t i, j; 
+  for (i=0; i<m_grid.nodes(); i++) {
+    for (j=0; j<dim; j++) x[j] = m_grid.nodeCoordinate(j, iter[j]); 
+    if (m_phaseSpace->withinLimits(&(x[0]), dim)) {
+      phspSum += mapValue(m_grid.iterToIndex(&(iter[0]))); 
+      phspNum++; 
+    }
+    for (j=0; j<dim; j++) {
+      if (iter[j] < m_binning[j]-1) {
+        iter[j]++; 
+        break; 
+      } else {
+        iter[j] = 0; 
+      }
+    }
+  }
+
+  if (phspNum == 0 || phspSum == 0.) {
+    printf("%20.20s WARNING: Cannot normalise, sum of map over phase space is zero\n", m_name); 
+    return; 
+  }
+  scale((Double_t)phspNum/phspSum); 
+}
+
+void BinnedDensity::checkSparseSize(void) {
+  if (!m_grid.sparse()) return; 
+  printf("%20.20s INFO: Sparse map layout with %d stored tiles, map size=%d (dense size=%d)\n", m_name, m_grid.storedTiles(), m_grid.size(), m_grid.nodes()); 
+  if (m_grid.size() > MAX_VECTOR_SIZE) {
+    printf("%20.20s ERROR: Map size (%d) too large!\n", m_name, m_grid.size()); 
+    abort(); 
+  }
+}
+
+void BinnedDensity::setTileSize(UInt_t tileSize) {
+  changeLayout(tileSize, m_grid.sparse()); 
+}
+
+void BinnedDensity::setSparse(Bool_t sparse) {
+  changeLayout(m_grid.tileSize(), sparse); 
+}
+
+void BinnedDensity::changeLayout(UInt_t tileSize, Bool_t sparse) {
+
+  fillAllBlocks(); 
+  unpackMap(); 
+  m_options.tileSize = tileSize; 
+  m_options.sparse = sparse; 
+  GridEngine previous = m_grid; 
+  m_grid.init(m_phaseSpace, m_binning, tileSize, sparse); 
+
+  if (m_grid.size() > MAX_VECTOR_SIZE) {
+    printf("%20.20s ERROR: Map size (%d) with tile size %d too large!\n", m_name, m_grid.size(), m_grid.tileSize()); 
+    abort(); 
+  }
+
+  printf("%20.20s INFO: Map layout with tile size %d%s, map size=%d\n", m_name, m_grid.tileSize(), 
+         sparse ? " (sparse)" : "", m_grid.size()); 
+
+  std::vector<Double_t> map; 
+  m_grid.convert(previous, m_map, map); 
+  m_map.swap(map); 
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMap(); 
+}
+
+void BinnedDensity::setPrecision(GridMap::Precision precision) {
+  unpackMap(); 
+  m_options.precision = precision; 
+  m_packedMap.setPrecision(precision); 
+  packMap(); 
+}
+
+void BinnedDensity::packMap(void) {
+  if (m_packedMap.precision() == GridMap::kDouble || m_packedMap.size() > 0 || m_lazyBlockSize > 0) return; 
+  m_packedMap.pack(m_map); 
+  std::vector<Double_t>().swap(m_map); 
+  printf("%20.20s INFO: Map packed with precision %d, %llu bytes\n", m_name, (Int_t)m_packedMap.precision(), m_packedMap.bytes()); 
+}
+
+void BinnedDensity::unpackMap(void) {
+  if (m_packedMap.size() == 0) return; 
+  m_packedMap.unpack(m_map); 
+  m_packedMap.clear(); 
 }
 
 /// Constructor that reads from file
-BinnedDensity::BinnedDensity(const char* pdfName, AbsPhaseSpace* thePhaseSpace, const char* filename) : AbsDensity(pdfName) {
+BinnedDensity::BinnedDensity(const char* pdfName, AbsPhaseSpace* thePhaseSpace, const char* filename, 
+                             const BinnedOptions &options) : AbsDensity(pdfName) {
+  m_options = options; 
   m_phaseSpace = thePhaseSpace; 
   m_density = 0;
+  m_interpolation = GridEngine::kLinear; 
 
   readFromFile(filename); 
 }
@@ -195,12 +555,21 @@ void BinnedDensity::readFromTextFile(const char* filename) {
   }
   
   printf("%20.20s INFO: Map size=%d\n", m_name, size); 
-  if (size > MAX_VECTOR_SIZE) {
+  if (size > MAX_VECTOR_SIZE && !m_options.sparse) {
     printf("%20.20s ERROR: Map size too large!\n", m_name); 
     abort(); 
   }
   
-  m_map.resize(size); 
+  if (!m_grid.init(m_phaseSpace, m_binning, m_options.tileSize, m_options.sparse)) {
+    printf("%20.20s ERROR: At least two bins are needed in each variable\n", m_name);
+    abort();
+  }
+  checkSparseSize(); 
+
+  m_map.assign(m_grid.size(), 0.); 
+  m_packedMap.setPrecision(m_options.precision); 
+  m_integralTable.clear(); 
+  initLazy(0); 
   
   // Zero iterator vector
   std::vector<Double_t> x(dim);
@@ -240,7 +609,8 @@ void BinnedDensity::readFromTextFile(const char* filename) {
       printf("%20.20s ERROR: index (%d) is larger than array size (%d)\n", m_name, index, size); 
       abort(); 
     } else {
-      m_map[index] = e; 
+      UInt_t mapIndex = m_grid.iterToIndex(&(iter[0])); 
+      if (m_grid.isStored(mapIndex)) m_map[mapIndex] = e; 
     }
 
     Bool_t run = 0; 
@@ -258,6 +628,7 @@ void BinnedDensity::readFromTextFile(const char* filename) {
   } while(1); 
   
   fclose(file); 
+  packMap(); 
 }
 
 /// Read from ROOT file
@@ -310,12 +681,21 @@ void BinnedDensity::readFromRootFile(const char* filename) {
   }
   
   printf("%20.20s INFO: Map size=%d\n", m_name, size); 
-  if (size > MAX_VECTOR_SIZE) {
+  if (size > MAX_VECTOR_SIZE && !m_options.sparse) {
     printf("%20.20s ERROR: Map size too large!\n", m_name); 
     abort(); 
   }
   
-  m_map.resize(size); 
+  if (!m_grid.init(m_phaseSpace, m_binning, m_options.tileSize, m_options.sparse)) {
+    printf("%20.20s ERROR: At least two bins are needed in each variable\n", m_name);
+    abort();
+  }
+  checkSparseSize(); 
+
+  m_map.assign(m_grid.size(), 0.); 
+  m_packedMap.setPrecision(m_options.precision); 
+  m_integralTable.clear(); 
+  initLazy(0); 
   
   // Zero iterator vector
   std::vector<Double_t> x(dim);
@@ -363,7 +743,8 @@ void BinnedDensity::readFromRootFile(const char* filename) {
       abort(); 
     } else {
       mapTree->GetEvent(index);
-      m_map[index] = e; 
+      UInt_t mapIndex = m_grid.iterToIndex(&(iter[0])); 
+      if (m_grid.isStored(mapIndex)) m_map[mapIndex] = e; 
     }
 
     Bool_t run = 0; 
@@ -381,6 +762,7 @@ void BinnedDensity::readFromRootFile(const char* filename) {
   } while(1); 
   
   file.Close(); 
+  packMap(); 
 }
 
 
@@ -399,6 +781,8 @@ void BinnedDensity::writeToFile(const char* filename) {
 /// Write density map to file
 void BinnedDensity::writeToTextFile(const char* filename) {
 
+  fillAllBlocks(); 
+
   printf("%20.20s INFO: Writing binned density to text file \"%s\"\n", m_name, filename ); 
 
   FILE* file = fopen(filename, "w+"); 
@@ -418,7 +802,7 @@ void BinnedDensity::writeToTextFile(const char* filename) {
     iter[j] = 0;
   }
   
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
   
   // Loop through the bins
   do {
@@ -441,7 +825,7 @@ void BinnedDensity::writeToTextFile(const char* filename) {
       printf("%20.20s ERROR: index (%d) is larger than array size (%d)\n", m_name, index, size); 
       abort(); 
     } else {
-      fprintf(file, "%f %d\n", m_map[index], m_phaseSpace->withinLimits(x) );
+      fprintf(file, "%f %d\n", mapValue(m_grid.iterToIndex(&(iter[0]))), m_phaseSpace->withinLimits(x) );
     }
 
     Bool_t run = 0; 
@@ -463,6 +847,8 @@ void BinnedDensity::writeToTextFile(const char* filename) {
 /// Write density map to a ROOT file
 void BinnedDensity::writeToRootFile(const char* filename) {
 
+  fillAllBlocks(); 
+
   printf("%20.20s INFO: Writing binned density to ROOT file \"%s\"\n", m_name, filename ); 
 
   TFile file(filename, "RECREATE"); 
@@ -486,7 +872,7 @@ void BinnedDensity::writeToRootFile(const char* filename) {
     iter[j] = 0;
   }
 
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
 
   TTree mapTree("MapTree", "MapTree"); 
   
@@ -517,7 +903,7 @@ void BinnedDensity::writeToRootFile(const char* filename) {
       abort(); 
     } else {
       dens = density(x); 
-      inphsp = m_map[index];
+      inphsp = mapValue(m_grid.iterToIndex(&(iter[0])));
       mapTree.Fill(); 
     }
 
@@ -539,96 +925,326 @@ void BinnedDensity::writeToRootFile(const char* filename) {
   file.Close(); 
 }
 
-Double_t BinnedDensity::density(std::vector<Double_t> &x) {
-  
-  UInt_t dim = m_phaseSpace->dimensionality(); 
+Double_t BinnedDensity::density(const Double_t* x, __attribute__((unused)) UInt_t dim) const {
+  if (m_lazyBlockSize > 0) ensureFilled(x); 
+  if (m_interpolation == GridEngine::kCubic) {
+    Double_t e = (m_packedMap.size() > 0) ? m_grid.interpolateCubic(m_packedMap, x) : m_grid.interpolateCubic(m_map, x); 
+    return (e > 0.) ? e : 0.; 
+  }
+  if (m_packedMap.size() > 0) return m_grid.interpolate(m_packedMap, x); 
+  return m_grid.interpolate(m_map, x); 
+}
 
-  Int_t j;
-  std::vector<UInt_t> ivect(dim); 
-  
-  for (j=0; j<(Int_t)dim; j++) {
-    Double_t low = m_phaseSpace->lowerLimit(j);
-    Double_t up = m_phaseSpace->upperLimit(j);
-    Double_t xj = x[j]; 
-    if (xj < low || xj > up) {
-      return 0.;
+void BinnedDensity::densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result) {
+
+  UInt_t dim = m_grid.dimensionality(); 
+  std::vector<Double_t> point(dim); 
+
+  UInt_t i, j;
+  if (m_lazyBlockSize > 0) {
+    for (i=0; i<numPoints; i++) {
+      for (j=0; j<dim; j++) point[j] = x[j][i]; 
+      ensureFilled(&(point[0])); 
     }
-    Int_t ij = (int)floor((xj-low)/(up-low)*(m_binning[j]-1));
+  }
+  if (m_interpolation == GridEngine::kCubic) {
+    for (i=0; i<numPoints; i++) {
+      for (j=0; j<dim; j++) point[j] = x[j][i]; 
+      result[i] = density(&(point[0]), dim); 
+    }
+    return; 
+  }
+  if (m_packedMap.size() > 0) {
+    for (i=0; i<numPoints; i++) {
+      for (j=0; j<dim; j++) point[j] = x[j][i]; 
+      result[i] = m_grid.interpolate(m_packedMap, &(point[0])); 
+    }
+    return; 
+  }
+  for (i=0; i<numPoints; i++) {
+    for (j=0; j<dim; j++) point[j] = x[j][i]; 
+    result[i] = m_grid.interpolate(m_map, &(point[0])); 
+  }
+}
 
-    if (ij == (Int_t)m_binning[j]-1) ij--;
+Double_t BinnedDensity::densityGradient(const Double_t* x, __attribute__((unused)) UInt_t dim, Double_t* grad) const {
+  if (m_lazyBlockSize > 0) ensureFilled(x); 
+  if (m_interpolation == GridEngine::kCubic) {
+    Double_t e = (m_packedMap.size() > 0) ? m_grid.interpolateCubicGradient(m_packedMap, x, grad) : 
+                                            m_grid.interpolateCubicGradient(m_map, x, grad); 
+    if (e > 0.) return e; 
+    UInt_t j; 
+    for (j=0; j<m_grid.dimensionality(); j++) grad[j] = 0.; 
+    return 0.; 
+  }
+  if (m_packedMap.size() > 0) return m_grid.interpolateGradient(m_packedMap, x, grad); 
+  return m_grid.interpolateGradient(m_map, x, grad); 
+}
 
-    ivect[j] = ij;
+void BinnedDensity::buildIntegralTable(void) {
+  if (m_grid.sparse()) {
+    printf("%20.20s ERROR: Integral table is not available in the sparse layout, call setSparse(false) first\n", m_name); 
+    abort(); 
   }
-  
-  Double_t e = 0.;
-  Double_t wsum = 0.;
-  
-  std::vector<UInt_t> iter(dim); 
-  
-  for (j=0; j<(Int_t)dim; j++) {
-    iter[j] = 0;
+  fillAllBlocks(); 
+  printf("%20.20s INFO: Building summed-volume table\n", m_name); 
+  if (m_packedMap.size() > 0) {
+    std::vector<Double_t> map; 
+    m_packedMap.unpack(map); 
+    m_grid.cumulate(map, m_integralTable); 
+  } else {
+    m_grid.cumulate(m_map, m_integralTable); 
   }
+}
 
-  // Loop through the vertices of the N-dim cube
-  do {
+Double_t BinnedDensity::integral(const Double_t* lower, const Double_t* upper) const {
+  if (m_integralTable.size() == 0) {
+    printf("%20.20s ERROR: buildIntegralTable() has to be called before integral()\n", m_name); 
+    abort(); 
+  }
+  return m_grid.integrate(m_integralTable, lower, upper); 
+}
 
-    // Calculate weight
-    Double_t weight = 1; 
-    for (j=0; j<(Int_t)dim; j++) {
-      Double_t low = m_phaseSpace->lowerLimit(j);
-      Double_t up = m_phaseSpace->upperLimit(j);
-      
-      Double_t xj1 = low + ((Double_t)ivect[j])/((Double_t)m_binning[j]-1.)*(up-low);
-      Double_t xj2 = low + ((Double_t)ivect[j]+1.)/((Double_t)m_binning[j]-1.)*(up-low);
+void BinnedDensity::initLazy(UInt_t blockSize) {
+
+  m_lazyBlockSize = blockSize; 
+  m_blockCount.clear(); 
+  m_blockStride.clear(); 
+  m_blockFilled.clear(); 
+  m_blockLocks.clear(); 
+  if (blockSize == 0) return; 
+
+  UInt_t dim = m_grid.dimensionality(); 
+  UInt_t blocks = 1; 
+  UInt_t j; 
+  for (j=0; j<dim; j++) {
+    m_blockStride.push_back(blocks); 
+    m_blockCount.push_back( (m_binning[j] + blockSize - 1)/blockSize ); 
+    blocks *= m_blockCount[j]; 
+  }
+  m_blockFilled.assign(blocks, 0); 
+  m_blockLocks.assign(blocks, 0); 
+}
 
-      if (x[j] < xj1 || x[j] > xj2) {
-        printf("%20.20s WARNING: dim %d: x=%f, x1=%f, x2=%f\n", m_name, j, x[j], xj1, xj2); 
-      }
+void BinnedDensity::ensureFilled(const Double_t* x) const {
+
+  UInt_t dim = m_grid.dimensionality(); 
+  UInt_t cell[MAX_LAZY_DIM]; 
+  Double_t frac[MAX_LAZY_DIM]; 
+  if (!m_grid.locate(x, cell, frac)) return; 
+
+  // Range of blocks of the nodes used by the interpolation in each variable: 
+  // the cell vertices, and for the cubic interpolation also their outer neighbours
+  UInt_t first[MAX_LAZY_DIM]; 
+  UInt_t last[MAX_LAZY_DIM]; 
+  UInt_t iter[MAX_LAZY_DIM]; 
+  Bool_t cubic = (m_interpolation == GridEngine::kCubic); 
+  UInt_t j; 
+  for (j=0; j<dim; j++) {
+    UInt_t lo = (cubic && cell[j] > 0) ? cell[j]-1 : cell[j]; 
+    UInt_t hi = (cubic && cell[j]+2 < m_binning[j]) ? cell[j]+2 : cell[j]+1; 
+    first[j] = lo/m_lazyBlockSize; 
+    last[j] = hi/m_lazyBlockSize; 
+    iter[j] = first[j]; 
+  }
 
-      Double_t fweight;
-      if (iter[j] == 0) {
-        fweight = 1. - (x[j]-xj1)/(xj2-xj1); 
-      } else {
-        fweight = (x[j]-xj1)/(xj2-xj1); 
+  do {
+    UInt_t block = 0; 
+    for (j=0; j<dim; j++) block += iter[j]*m_blockStride[j]; 
+    if (!__atomic_load_n(&(m_blockFilled[block]), __ATOMIC_ACQUIRE)) fillBlock(block); 
+    for (j=0; j<dim; j++) {
+      if (iter[j] < last[j]) {
+        iter[j]++; 
+        break; 
       }
-      weight *= fweight; 
-      
-//      printf("DEBUG:   Weight fraction: dim%d, i=%d, x=%f, x1=%f, x2=%f, fweight=%f\n", j, iter[j], x[j], xj1, xj2, fweight);
-      
+      iter[j] = first[j]; 
     }
+  } while (j < dim); 
+}
 
-    UInt_t index = 0;
-    for (j=dim-1; j>=0; j--) {
-      UInt_t ij = ivect[j] + iter[j]; 
-      if (j==(Int_t)dim-1) {
-        index = ij; 
+void BinnedDensity::blockNodes(UInt_t block, std::vector< std::vector<Double_t> > &nodes, std::vector<UInt_t> &index) const {
+
+  UInt_t dim = m_grid.dimensionality(); 
+  std::vector<UInt_t> first(dim); 
+  std::vector<UInt_t> last(dim); 
+  UInt_t num = 1; 
+  UInt_t j; 
+  for (j=0; j<dim; j++) {
+    first[j] = ((block / m_blockStride[j]) % m_blockCount[j])*m_lazyBlockSize; 
+    last[j] = TMath::Min(first[j] + m_lazyBlockSize, m_binning[j]) - 1; 
+    num *= last[j] - first[j] + 1; 
+  }
+
+  nodes.assign(dim, std::vector<Double_t>(num)); 
+  index.resize(num); 
+
+  // Nodes are visited in the logical order (1st variable runs fastest) as in nodeValues()
+  std::vector<UInt_t> iter(first); 
+  UInt_t i; 
+  for (i=0; i<num; i++) {
+    for (j=0; j<dim; j++) {
+      Double_t low = m_phaseSpace->lowerLimit(j);
+      Double_t up = m_phaseSpace->upperLimit(j);
+      nodes[j][i] = low + (Double_t)iter[j]/((Double_t)m_binning[j]-1)*(up-low);
+    }
+    index[i] = m_grid.iterToIndex(&(iter[0])); 
+    for (j=0; j<dim; j++) {
+      if (iter[j] < last[j]) {
+        iter[j]++; 
+        break; 
       } else {
-        index = index*m_binning[j] + ij;
+        iter[j] = first[j]; 
       }
     }
+  }
+}
 
-    e += weight*m_map[index]; 
-    wsum += weight; 
-    
-//    printf("DEBUG: Weight=%f, index=%d, density=%f\n", weight, index, m_map[index]); 
+void BinnedDensity::fillBlock(UInt_t block) const {
 
-    // Increment iterator
-    Bool_t run = 0; 
-    for (j=0; j<(Int_t)dim; j++) {
-      if (iter[j] == 0) {
-        iter[j]++; 
-        run = 1; 
-        break;
-      } else {
-        iter[j] = 0;
+  std::vector< std::vector<Double_t> > nodes; 
+  std::vector<UInt_t> index; 
+  blockNodes(block, nodes, index); 
+
+  UInt_t dim = nodes.size(); 
+  UInt_t num = 0; 
+  std::vector<const Double_t*> nodePtr(dim); 
+  UInt_t i, j; 
+
+  // Only the nodes stored in the map are evaluated (all of them unless the map is sparse)
+  for (i=0; i<index.size(); i++) {
+    if (!m_grid.isStored(index[i])) continue; 
+    for (j=0; j<dim; j++) nodes[j][num] = nodes[j][i]; 
+    index[num] = index[i]; 
+    num++; 
+  }
+  for (j=0; j<dim; j++) nodePtr[j] = &(nodes[j][0]); 
+
+  // The input density is evaluated outside of the lock. If several threads fill the same block 
+  // at once, the values of the first one are stored. 
+  std::vector<Double_t> values(num); 
+  if (num > 0) m_density->densityBatch(num, &(nodePtr[0]), &(values[0])); 
+
+  Char_t* lock = &(m_blockLocks[block]); 
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {}
+  if (!m_blockFilled[block]) {
+    for (i=0; i<num; i++) m_map[index[i]] = values[i]; 
+    __atomic_store_n(&(m_blockFilled[block]), 1, __ATOMIC_RELEASE); 
+  }
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE); 
+}
+
+UInt_t BinnedDensity::filledBlocks(void) const {
+  UInt_t filled = 0; 
+  UInt_t i; 
+  for (i=0; i<m_blockFilled.size(); i++) if (__atomic_load_n(&(m_blockFilled[i]), __ATOMIC_ACQUIRE)) filled++; 
+  return filled; 
+}
+
+void BinnedDensity::fillAllBlocks(void) {
+  if (m_lazyBlockSize == 0) return; 
+
+  printf("%20.20s INFO: Filling %d of %d lazy blocks\n", m_name, 
+         (UInt_t)m_blockFilled.size() - filledBlocks(), (UInt_t)m_blockFilled.size()); 
+
+  UInt_t i; 
+  for (i=0; i<m_blockFilled.size(); i++) {
+    if (!m_blockFilled[i]) fillBlock(i); 
+  }
+  initLazy(0); 
+  packMap(); 
+}
+
+void BinnedDensity::writeFilledBlocks(const char* filename) {
+
+  if (m_lazyBlockSize == 0) {
+    printf("%20.20s ERROR: The map is not filled lazily\n", m_name); 
+    abort(); 
+  }
+
+  printf("%20.20s INFO: Writing %d filled blocks to text file \"%s\"\n", m_name, filledBlocks(), filename ); 
+
+  FILE* file = fopen(filename, "w+"); 
+  if (!file) {
+    printf("%20.20s ERROR: Cannot open file \"%s\"\n", m_name, filename ); 
+    abort(); 
+  }
+
+  UInt_t dim = m_grid.dimensionality(); 
+  fprintf(file, "%d\n", dim);
+  UInt_t j; 
+  for (j=0; j<dim; j++) fprintf(file, "%d\n", m_binning[j]);
+  fprintf(file, "%d\n%d\n", m_lazyBlockSize, filledBlocks()); 
+
+  std::vector< std::vector<Double_t> > nodes; 
+  std::vector<UInt_t> index; 
+  UInt_t block; 
+  for (block=0; block<m_blockFilled.size(); block++) {
+    if (!__atomic_load_n(&(m_blockFilled[block]), __ATOMIC_ACQUIRE)) continue; 
+    blockNodes(block, nodes, index); 
+    fprintf(file, "%d\n", block); 
+    UInt_t i; 
+    for (i=0; i<index.size(); i++) fprintf(file, "%.17g\n", m_map[index[i]]); 
+  }
+
+  fclose(file); 
+}
+
+void BinnedDensity::readFilledBlocks(const char* filename) {
+
+  if (m_lazyBlockSize == 0) {
+    printf("%20.20s ERROR: The map is not filled lazily\n", m_name); 
+    abort(); 
+  }
+
+  FILE* file = fopen(filename, "r"); 
+  if (!file) {
+    printf("%20.20s ERROR: filled blocks file \"%s\" not found\n", m_name, filename ); 
+    abort(); 
+  }
+
+  UInt_t dim = m_grid.dimensionality(); 
+  UInt_t fileDim, blockSize, numBlocks; 
+  if (fscanf(file, "%u", &fileDim) != 1 || fileDim != dim) {
+    printf("%20.20s ERROR: Dimensionality of the map in file \"%s\" does not match the phase space (%d)\n", m_name, filename, dim); 
+    abort(); 
+  }
+  UInt_t j; 
+  for (j=0; j<dim; j++) {
+    UInt_t bins; 
+    if (fscanf(file, "%u", &bins) != 1 || bins != m_binning[j]) {
+      printf("%20.20s ERROR: Number of bins in variable %d in file \"%s\" does not match the map (%d)\n", m_name, j, filename, m_binning[j]); 
+      abort(); 
+    }
+  }
+  if (fscanf(file, "%u %u", &blockSize, &numBlocks) != 2 || blockSize != m_lazyBlockSize) {
+    printf("%20.20s ERROR: Block size in file \"%s\" does not match the map (%d)\n", m_name, filename, m_lazyBlockSize); 
+    abort(); 
+  }
+
+  printf("%20.20s INFO: Reading %d filled blocks from text file \"%s\"\n", m_name, numBlocks, filename ); 
+
+  std::vector< std::vector<Double_t> > nodes; 
+  std::vector<UInt_t> index; 
+  UInt_t n; 
+  for (n=0; n<numBlocks; n++) {
+    UInt_t block; 
+    if (fscanf(file, "%u", &block) != 1 || block >= m_blockFilled.size()) {
+      printf("%20.20s ERROR: Error reading block index from file \"%s\"\n", m_name, filename); 
+      abort(); 
+    }
+    blockNodes(block, nodes, index); 
+    std::vector<Double_t> values(index.size()); 
+    UInt_t i; 
+    for (i=0; i<index.size(); i++) {
+      if (fscanf(file, "%lf", &(values[i])) != 1) {
+        printf("%20.20s ERROR: Error reading block %d from file \"%s\"\n", m_name, block, filename); 
+        abort(); 
       }
     }
-    if (!run) break;
-    
-  } while(1); 
-  
-//  printf("density=%f, wsum=%f\n", e, wsum); 
-  
-  return e; 
-  
+    if (m_blockFilled[block]) continue; 
+    for (i=0; i<index.size(); i++) if (m_grid.isStored(index[i])) m_map[index[i]] = values[i]; 
+    m_blockFilled[block] = 1; 
+  }
+
+  fclose(file); 
 }
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <vector>
 #include <stdlib.h>
+#include <thread>
 
 #include "TMath.h"
 #include "TFile.h"
@@ -9,10 +10,21 @@
 
 #include "AbsPhaseSpace.hh"
 #include "AbsDensity.hh"
+#include "GridEngine.hh"
+#include "StencilCache.hh"
+#include "GridConvolution.hh"
 #include "BinnedKernelDensity.hh"
 
 #include "Timer.hh"
 
+#define MAX_VECTOR_SIZE 20000000
+
+/// Number of NTuple events read at once and then deposited in parallel while the next block is read
+static const UInt_t depositBlockSize = 65536; 
+
+/// Number of events taken by a thread at once if the events are distributed dynamically
+static const UInt_t depositChunkSize = 1024; 
+
 BinnedKernelDensity::BinnedKernelDensity(const char* pdfName, 
                              AbsPhaseSpace* thePhaseSpace, 
                              TTree* tree, 
@@ -22,8 +34,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfName,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
   init(thePhaseSpace, tree, vars, binning, width, d, toyEvents, maxEvents, skipEvents); 
 }
 
@@ -36,8 +50,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfName,
                              AbsDensity* d, 
                              UInt_t toyEvents,
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -60,8 +76,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfName,
                              AbsDensity* d, 
                              UInt_t toyEvents,
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfName) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -84,8 +102,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -111,8 +131,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -138,8 +160,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -168,8 +192,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -198,8 +224,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -231,8 +259,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -264,8 +294,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -300,8 +332,10 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
                              AbsDensity* d, 
                              UInt_t toyEvents, 
                              UInt_t maxEvents, 
-                             UInt_t skipEvents
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
                            ) : AbsDensity(pdfname) {
+  m_options = options; 
                            
   std::vector<TString> vars;
   std::vector<UInt_t> binning; 
@@ -327,6 +361,33 @@ BinnedKernelDensity::BinnedKernelDensity(const char* pdfname,
   init(thephaseSpace, tree, vars, binning, width, d, toyEvents, maxEvents, skipEvents); 
 }
 
+BinnedKernelDensity::BinnedKernelDensity(const char* pdfname, 
+                             AbsPhaseSpace* thephaseSpace, 
+                             TTree* tree, 
+                             std::vector<TString> &vars, 
+                             std::vector<Double_t> &width, 
+                             Double_t tolerance, 
+                             AbsDensity* d, 
+                             UInt_t toyEvents, 
+                             UInt_t maxEvents, 
+                             UInt_t skipEvents, 
+                             const BinnedOptions &options
+                           ) : AbsDensity(pdfname) {
+  m_options = options; 
+
+  Double_t error; 
+  std::vector<UInt_t> binning = chooseBinning(thephaseSpace, tree, vars, width, tolerance, d, 
+                                              toyEvents, maxEvents, skipEvents, &error); 
+
+  init(thephaseSpace, tree, vars, binning, width, d, toyEvents, maxEvents, skipEvents); 
+
+  m_binningError = error; 
+}
+
+BinnedKernelDensity::BinnedKernelDensity(const char* pdfName, const BinnedOptions &options) : AbsDensity(pdfName) {
+  m_options = options; 
+}
+
 BinnedKernelDensity::~BinnedKernelDensity() {
 
 }
@@ -340,7 +401,8 @@ void BinnedKernelDensity::init(AbsPhaseSpace* thephaseSpace,
                     AbsDensity* d, 
                     UInt_t toyEvents, 
                     UInt_t maxEvents, 
-                    UInt_t skipEvents
+                    UInt_t skipEvents, 
+                    UInt_t stride
                   ) {
 
   m_phaseSpace = thephaseSpace; 
@@ -350,6 +412,9 @@ void BinnedKernelDensity::init(AbsPhaseSpace* thephaseSpace,
   m_dim = m_phaseSpace->dimensionality(); 
   
   m_fractionalMode = false; 
+  m_baked = false; 
+  m_interpolation = GridEngine::kLinear; 
+  m_binningError = 0.; 
 
   printf("%20.20s INFO: Creating binned kernel density over %dD phase space\n", m_name, m_dim ); 
   
@@ -372,119 +437,216 @@ void BinnedKernelDensity::init(AbsPhaseSpace* thephaseSpace,
   }
 
   printf("%20.20s INFO: Map size=%d\n", m_name, size);
-  if (size > 20000000) {
+  if (size > MAX_VECTOR_SIZE && !m_options.sparse) {
     printf("%20.20s ERROR: Map size (%d) too large!\n", m_name, size);
     abort();
   }
 
-  m_map.resize(size);
-  m_approxMap.resize(size); 
+  if (!m_grid.init(m_phaseSpace, m_binning, m_options.tileSize, m_options.sparse)) {
+    printf("%20.20s ERROR: At least two bins are needed in each variable\n", m_name);
+    abort();
+  }
 
-  fillMapFromTree(tree, vars, maxEvents, skipEvents);
+  if (m_grid.sparse()) {
+    printf("%20.20s INFO: Sparse map layout with %d stored tiles, map size=%d (dense size=%d)\n", m_name, m_grid.storedTiles(), m_grid.size(), m_grid.nodes());
+    if (m_grid.size() > MAX_VECTOR_SIZE) {
+      printf("%20.20s ERROR: Map size (%d) too large!\n", m_name, m_grid.size());
+      abort();
+    }
+  }
+
+  m_map.resize(m_grid.size());
+  m_approxMap.resize(m_grid.size()); 
+  m_packedMap.setPrecision(m_options.precision); 
+  m_packedApproxMap.setPrecision(m_options.precision); 
+
+  m_stencils.init(&m_grid, &(m_width[0]), 1., 1., m_options, m_name); 
+
+  fillMapFromTree(tree, vars, maxEvents, skipEvents, stride);
   fillMapFromDensity(m_approxDensity, toyEvents);
 
+  m_stencils.release(); 
+
   normalise();
 
+  packMaps(); 
+
 }
 
-/// Calculate map index for a given iterator vector
-UInt_t BinnedKernelDensity::iterToIndex( std::vector<UInt_t> &iter ) {
-  UInt_t index = 0;
-  Int_t n;
-  for (n=m_dim-1; n>=0; n--) {
-    if (n==(Int_t)m_dim-1) {
-      index = iter[n]; 
-    } else {
-      index = index*m_binning[n] + iter[n];
+std::vector<UInt_t> BinnedKernelDensity::chooseBinning(AbsPhaseSpace* thephaseSpace, 
+                    TTree* tree, 
+                    std::vector<TString> &vars, 
+                    std::vector<Double_t> &width, 
+                    Double_t tolerance, 
+                    AbsDensity* d, 
+                    UInt_t toyEvents, 
+                    UInt_t maxEvents, 
+                    UInt_t skipEvents, 
+                    Double_t* error
+                  ) {
+
+  const UInt_t samplePoints = 1000; 
+  const UInt_t maxIterations = 5; 
+  const UInt_t maxTrialEvents = 100000; 
+  const UInt_t sampleSeed = 1; 
+
+  UInt_t dim = thephaseSpace->dimensionality(); 
+
+  if (width.size() != dim) {
+    printf("%20.20s ERROR: Dimensionality of phase space (%d) does not match kernel width vector size (%d)\n", 
+           m_name, dim, (UInt_t)width.size());
+    abort(); 
+  }
+
+  if (tolerance <= 0.) {
+    printf("%20.20s ERROR: Binning tolerance should be positive\n", m_name);
+    abort(); 
+  }
+
+  std::vector<Double_t> lower(dim); 
+  std::vector<Double_t> range(dim); 
+  std::vector<UInt_t> binning(dim); 
+  UInt_t j, k; 
+  for (j=0; j<dim; j++) {
+    lower[j] = thephaseSpace->lowerLimit(j); 
+    range[j] = thephaseSpace->upperLimit(j) - lower[j]; 
+
+    // Start from the node spacing equal to the kernel width
+    binning[j] = (UInt_t)TMath::Ceil(range[j]/width[j]) + 1; 
+    if (binning[j] < 2) binning[j] = 2; 
+  }
+
+  // The trial PDFs are built from a subsample of the NTuple and of the toy events. The statistical noise of 
+  // the subsample can only add to the estimated error, so the chosen binning is conservative. 
+  // The NTuple subsample takes every stride-th entry of the whole range, so that it is not biased 
+  // if the NTuple is sorted or ordered by run. 
+  Long64_t nentries = tree->GetEntries() - skipEvents; 
+  if (maxEvents > 0 && maxEvents < nentries) nentries = maxEvents; 
+  UInt_t stride = (nentries > maxTrialEvents) ? (UInt_t)((nentries + maxTrialEvents - 1)/maxTrialEvents) : 1; 
+  UInt_t trialToys = (toyEvents < maxTrialEvents) ? toyEvents : maxTrialEvents; 
+
+  // Random points in the phase space where the trial PDFs are compared. They are generated with a separate 
+  // generator, so that the state of the generator of this density is not changed before init(). 
+  TRandom3 rnd(sampleSeed); 
+  std::vector<std::vector<Double_t> > points(dim); 
+  std::vector<Double_t> x(dim); 
+  UInt_t n; 
+  for (n=0; n<samplePoints; n++) {
+    UInt_t t; 
+    for (t = 0; t < m_maxTries; t++) {
+      for (j=0; j<dim; j++) x[j] = lower[j] + rnd.Rndm()*range[j]; 
+      if (thephaseSpace->withinLimits(x)) break; 
     }
+    if (t == m_maxTries) continue; 
+    for (j=0; j<dim; j++) points[j].push_back(x[j]); 
   }
-  return index;
-}
+  UInt_t numPoints = points[0].size(); 
+  if (numPoints == 0) {
+    printf("%20.20s ERROR: failed to generate points within phase space for binning selection\n", m_name); 
+    abort(); 
+  }
+  std::vector<const Double_t*> coords(dim); 
+  for (j=0; j<dim; j++) coords[j] = &(points[j][0]); 
+
+  std::vector<Double_t> base(numPoints); 
+  std::vector<Double_t> fine(numPoints); 
+  std::vector<Double_t> varError(dim); 
+  Double_t totalError = 0.; 
+
+  UInt_t iter; 
+  for (iter=0; iter<maxIterations; iter++) {
+
+    for (j=0; j<dim; j++) {
+      ULong64_t size = 2*binning[j]-1; 
+      for (k=0; k<dim; k++) if (k != j) size *= binning[k]; 
+      if (size > MAX_VECTOR_SIZE) {
+        printf("%20.20s ERROR: Map size (%lld) needed for binning selection too large, increase tolerance or kernel width\n", 
+               m_name, (Long64_t)size);
+        abort(); 
+      }
+    }
 
-void BinnedKernelDensity::addToMap(std::vector<Double_t> &map, std::vector<Double_t> &point, Double_t weight) {
+    printf("%20.20s INFO: Binning selection, iteration %d, trial binning (", m_name, iter); 
+    for (j=0; j<dim; j++) printf(j ? ", %d" : "%d", binning[j]); 
+    printf(")\n"); 
+
+    BinnedKernelDensity trial(m_name, m_options); 
+    trial.init(thephaseSpace, tree, vars, binning, width, d, trialToys, maxEvents, skipEvents, stride); 
+    trial.densityBatch(numPoints, &(coords[0]), &(base[0])); 
 
-  // Fill the map
-  std::vector<UInt_t> initBin(m_dim); 
-  std::vector<UInt_t> finalBin(m_dim); 
-  std::vector<Double_t> lowLimit(m_dim);
-  std::vector<Double_t> coeff(m_dim); 
-
-  UInt_t size = map.size(); 
-
-  // Calculate the initial and final N-dim bins
-  Int_t n;
-  for (n=0; n<(Int_t)m_dim; n++) {
-    Double_t x1 = point[n] - m_width[n]; 
-    Double_t x2 = point[n] + m_width[n];
-
-    Double_t low = m_phaseSpace->lowerLimit(n);
-    Double_t up  = m_phaseSpace->upperLimit(n);
-    Int_t i1 = (int)TMath::Ceil( (x1-low)/(up-low)*(m_binning[n]-1) );
-    if (i1 < 0) i1 = 0; 
-    if (i1 >= (Int_t)m_binning[n]) i1 = m_binning[n] - 1;
-    Int_t i2 = (int)TMath::Floor( (x2-low)/(up-low)*(m_binning[n]-1) );
-    if (i2 < 0) i2 = 0; 
-    if (i2 >= (Int_t)m_binning[n]) i2 = m_binning[n] - 1;
-
-    if (i1 > i2) {
-      printf("%20.20s ERROR: i1(%d)>i2(%d) for n=%d, bin size is larger than kernel width!\n", m_name, i1, i2, n); 
+    Double_t average = 0.; 
+    for (n=0; n<numPoints; n++) average += base[n]; 
+    average /= (Double_t)numPoints; 
+    if (average <= 0.) {
+      printf("%20.20s ERROR: PDF is zero at all sample points, cannot choose binning\n", m_name); 
       abort(); 
     }
 
-    initBin[n] = i1;
-    finalBin[n] = i2;
-    
-    lowLimit[n] = phaseSpace()->lowerLimit(n); 
-    coeff[n] = ( phaseSpace()->upperLimit(n) - lowLimit[n] ) / ((Double_t)m_binning[n]-1); 
-    lowLimit[n] -= point[n]; 
-    
-    coeff[n] /= m_width[n]; 
-    lowLimit[n] /= m_width[n]; 
+    // Error contribution of each variable from the PDF with the node spacing halved in this variable. 
+    // The quadratic interpolation error with the spacing halved is 1/4 of the original one. 
+    totalError = 0.; 
+    for (j=0; j<dim; j++) {
+      std::vector<UInt_t> fineBinning(binning); 
+      fineBinning[j] = 2*binning[j]-1; 
+      BinnedKernelDensity fineTrial(m_name, m_options); 
+      fineTrial.init(thephaseSpace, tree, vars, fineBinning, width, d, trialToys, maxEvents, skipEvents, stride); 
+      fineTrial.densityBatch(numPoints, &(coords[0]), &(fine[0])); 
+      Double_t sum = 0.; 
+      for (n=0; n<numPoints; n++) sum += (base[n]-fine[n])*(base[n]-fine[n]); 
+      varError[j] = 4./3.*TMath::Sqrt(sum/(Double_t)numPoints)/average; 
+      totalError += varError[j]; 
+    }
+
+    printf("%20.20s INFO: Estimated interpolation error %f (", m_name, totalError); 
+    for (j=0; j<dim; j++) printf(j ? ", %f" : "%f", varError[j]); 
+    printf(")\n"); 
+
+    if (totalError <= tolerance || iter+1 == maxIterations) break; 
+
+    // Share the tolerance equally between the variables, the error scales as the spacing squared. 
+    // Aim 10% below the tolerance to converge in fewer iterations. 
+    for (j=0; j<dim; j++) {
+      Double_t scale = TMath::Sqrt(varError[j]*dim/(0.9*tolerance)); 
+      if (scale > 1.) binning[j] = (UInt_t)TMath::Ceil((binning[j]-1)*scale) + 1; 
+    }
   }
 
-  // Loop through the map and fill bins
-  std::vector<UInt_t> iter(m_dim); 
-  for (n=0; n<(Int_t)m_dim; n++) iter[n] = initBin[n];
+  if (totalError > tolerance) {
+    printf("%20.20s WARNING: Binning selection did not converge in %d iterations, estimated error %f\n", 
+           m_name, maxIterations, totalError); 
+  }
 
-  do {
+  ULong64_t size = 1; 
+  for (j=0; j<dim; j++) size *= binning[j]; 
+  printf("%20.20s INFO: Chosen binning (", m_name); 
+  for (j=0; j<dim; j++) printf(j ? ", %d" : "%d", binning[j]); 
+  printf("), estimated error %f, memory %lld bytes\n", totalError, (Long64_t)(2*size*sizeof(Double_t))); 
 
-    UInt_t index = iterToIndex( iter ); 
+  *error = totalError; 
+  return binning; 
+}
 
-    if (index >= size) {
-      printf("%20.20s ERROR: index (%d) is larger than array size (%d)\n", m_name, index, size); 
-      abort(); 
-    } else {
-      Double_t sqsum = 0; 
-      for (n=0; n<(Int_t)m_dim; n++) {
-//        Double_t low = m_phaseSpace->lowerLimit(n);
-//        Double_t up  = m_phaseSpace->upperLimit(n);
-//        Double_t binx = low + (Double_t)iter[n]/((Double_t)m_binning[n]-1)*(up-low);
-//        Double_t dx = binx/m_width[n]; 
-        Double_t dx = lowLimit[n] + (Double_t)iter[n]*coeff[n];
-        if (fabs(dx) < 1.) sqsum += dx*dx; 
-      }
-      if (sqsum < 1.) map[index] += weight*(1.-sqsum); 
+/// Calculate map index for a given iterator vector
+UInt_t BinnedKernelDensity::iterToIndex( std::vector<UInt_t> &iter ) {
+  return m_grid.iterToIndex( &(iter[0]) );
+}
 
-    }
+void BinnedKernelDensity::addToMap(std::vector<Double_t> &map, std::vector<Double_t> &point, Double_t weight) {
+  addToMap(map, &(point[0]), weight); 
+}
 
-    // Increase iterator
-    Bool_t run = 0; 
-    for (n=0; n<(Int_t)m_dim; n++) {
-      if (iter[n] < finalBin[n]) {
-        iter[n]++; 
-        run = 1; 
-        break;
-      } else {
-        iter[n] = initBin[n];
-      }
-    }
-    if (!run) break;
+void BinnedKernelDensity::addToMap(std::vector<Double_t> &map, const Double_t* point, Double_t weight) {
 
-  } while(1); 
+  Bool_t deposited = m_stencils.enabled() ? m_stencils.deposit(map, point, 1., weight) 
+                                            : m_grid.deposit(map, point, &(m_width[0]), 1., weight); 
+  if (!deposited) {
+    printf("%20.20s ERROR: no grid nodes within the kernel, bin size is larger than kernel width!\n", m_name); 
+    abort(); 
+  }
 
 }
 
-void BinnedKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &vars, UInt_t maxEvents, UInt_t skipEvents) {
+void BinnedKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &vars, UInt_t maxEvents, UInt_t skipEvents, UInt_t stride) {
 
   if (vars.size() != m_dim && vars.size() != m_dim + 1) {
     printf("%20.20s ERROR: Number of TTree variables (%d) in tree \"%s\" does not correspond to phase space dimensionality (%d)\n", 
@@ -506,6 +668,7 @@ void BinnedKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &va
 
   printf("%20.20s INFO: Will read %lld events (skipping first %d)\n", 
            m_name, nentries-skipEvents, skipEvents ); 
+  if (stride > 1) printf("%20.20s INFO: Only one event in %d is used\n", m_name, stride); 
 
   Long64_t i;
 
@@ -521,13 +684,66 @@ void BinnedKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &va
     }
   }
 
+  // In the linear binning mode the events are first distributed between the vertices of their grid cells. 
+  // The FFT convolution needs the node values, so it always uses the linear binning, and no kernels 
+  // are deposited by the threads. 
+  GridConvolution convolution; 
+  Bool_t fft = (m_options.dataConvolution == BinnedOptions::kFFT) && initConvolution(convolution); 
+  Bool_t linearBinning = m_options.linearBinning || fft; 
+
+  UInt_t numThreads = fft ? 1 : m_options.fillThreads; 
+  if (numThreads > 1) {
+    printf("%20.20s INFO: Depositing kernels in %d threads (%s), %d extra map copies of %lld bytes\n", m_name, numThreads, 
+           m_options.reproducibleFill ? "reproducible" : "dynamic", numThreads-1, (Long64_t)(m_map.size()*sizeof(Double_t))); 
+  }
+
+  // Thread 0 deposits directly into the map, the other threads into their own copies of it. 
+  // Events are read in blocks into one of two buffers, and the block read previously is deposited 
+  // in the meantime by the worker threads. 
+  std::vector< std::vector<Double_t> > shards(numThreads); 
+  UInt_t t; 
+  for (t=1; t<numThreads; t++) shards[t].assign(m_map.size(), 0.); 
+
   std::vector<Double_t> point(m_dim); 
+  std::vector<Double_t> points[2]; 
+  std::vector<Double_t> weights[2]; 
+  UInt_t cur = 0; 
+  UInt_t nextChunk = 0; 
+  std::vector<std::thread> threads; 
+
+  // Start the deposition of the current block of events after the previous one is finished
+  auto flushBlock = [&]() {
+    for (t=0; t<threads.size(); t++) threads[t].join(); 
+    threads.clear(); 
+    points[1-cur].clear(); 
+    weights[1-cur].clear(); 
+    nextChunk = 0; 
+    if (numThreads <= 1) {
+      depositEvents(&m_map, &(points[cur]), &(weights[cur]), 0, 1, 0); 
+    } else {
+      for (t=0; t<numThreads; t++) {
+        std::vector<Double_t>* shard = (t == 0) ? &m_map : &(shards[t]); 
+        threads.push_back(std::thread(&BinnedKernelDensity::depositEvents, this, shard, &(points[cur]), &(weights[cur]), 
+                                      t, numThreads, m_options.reproducibleFill ? (UInt_t*)0 : &nextChunk)); 
+      }
+    }
+    cur = 1-cur; 
+  }; 
+
+  std::vector<Double_t> binned; 
+  if (linearBinning) {
+    printf("%20.20s INFO: Linear binning of the events before the kernel deposition\n", m_name); 
+    binned.assign(m_map.size(), 0.); 
+  }
 
+  Long64_t nread = 0; 
   Long64_t nout = 0;
+  Long64_t nunstored = 0; 
   
   set_timer(); 
   
-  for(i=skipEvents; i<nentries; i++) {
+  for(i=skipEvents; i<nentries; i += stride) {
+    nread++; 
     tree->GetEntry(i);
     for (n=0; n<(Int_t)m_dim; n++) {
       point[n] = varArray[n]; 
@@ -536,25 +752,122 @@ void BinnedKernelDensity::fillMapFromTree( TTree* tree, std::vector<TString> &va
     if (m_dim + 1 == nvars) 
       weight = varArray[m_dim]; 
 
-    if (!m_phaseSpace->withinLimits( point )) {
+    Bool_t inside = m_phaseSpace->withinLimits( point ); 
+    if (inside && !m_grid.cellStored(&(point[0]))) nunstored++; 
+    if (!inside) {
       nout ++; 
 //      printf("%20.20s WARNING: Ntuple point (", m_name); 
 //      for (n=0; n<(Int_t)nvars; n++) {
 //        printf("%f ", point[n]);
 //      }
 //      printf(") outside phase space\n");
+    } else if (linearBinning) {
+      m_grid.scatter(binned, &(point[0]), weight); 
     } else {
-      addToMap(m_map, point, weight); 
+      points[cur].insert(points[cur].end(), point.begin(), point.end()); 
+      weights[cur].push_back(weight); 
+      if (weights[cur].size() == depositBlockSize) flushBlock(); 
     }
     
-    if (i % 100 == 0 && timer(2)) {
+    if (nread % 100 == 0 && timer(2)) {
       printf("%20.20s INFO: Read %lld/%lld events (%f%%), %lld out\n", m_name, i-skipEvents, nentries-skipEvents, 
              100.*float(i-skipEvents)/float(nentries-skipEvents), nout);
     }
   }
 
-  printf("%20.20s INFO: %lld events read in from \"%s\", %lld out\n", m_name, nentries-nout, tree->GetName(), nout ); 
+  // The kernels of the linearly binned events are deposited once per non-empty node
+  if (fft) {
+    convolution.convolve(binned, m_map); 
+  } else if (linearBinning) {
+    std::vector<UInt_t> iter(m_dim, 0); 
+    UInt_t nonEmpty = 0; 
+    UInt_t node; 
+    for (node=0; node<m_grid.nodes(); node++) {
+      UInt_t index = m_grid.iterToIndex(&(iter[0])); 
+      if (m_grid.isStored(index) && binned[index] != 0.) {
+        for (n=0; n<(Int_t)m_dim; n++) points[cur].push_back(m_grid.nodeCoordinate(n, iter[n])); 
+        weights[cur].push_back(binned[index]); 
+        nonEmpty++; 
+        if (weights[cur].size() == depositBlockSize) flushBlock(); 
+      }
+      for (n=0; n<(Int_t)m_dim; n++) {
+        if (iter[n] < m_binning[n]-1) {
+          iter[n]++; 
+          break; 
+        } else {
+          iter[n] = 0; 
+        }
+      }
+    }
+    printf("%20.20s INFO: %d non-empty nodes after the linear binning\n", m_name, nonEmpty); 
+  }
+
+  if (weights[cur].size() > 0) flushBlock(); 
+  for (t=0; t<threads.size(); t++) threads[t].join(); 
+  threads.clear(); 
+
+  // The copies are summed in a fixed order of threads, each thread adds a contiguous range of nodes
+  if (numThreads > 1) {
+    for (t=0; t<numThreads; t++) {
+      threads.push_back(std::thread(&BinnedKernelDensity::reduceShards, this, &shards, t, numThreads)); 
+    }
+    for (t=0; t<numThreads; t++) threads[t].join(); 
+  }
+
+  printf("%20.20s INFO: %lld events read in from \"%s\", %lld out\n", m_name, nread-nout, tree->GetName(), nout ); 
+  if (nunstored > 0) {
+    printf("%20.20s WARNING: %lld events in the grid cells not stored in the sparse layout, their kernels are truncated\n", 
+           m_name, nunstored); 
+  }
+
+}
+
+Bool_t BinnedKernelDensity::initConvolution(GridConvolution &convolution) {
+
+  if (!convolution.init(&m_grid, &(m_width[0]))) {
+    printf("%20.20s WARNING: Padded grid is too large for the FFT convolution, depositing the kernels directly\n", m_name); 
+    return 0; 
+  }
 
+  printf("%20.20s INFO: FFT convolution on the padded grid (", m_name); 
+  UInt_t j; 
+  for (j=0; j<m_dim; j++) printf(j ? ", %d" : "%d", convolution.paddedBins(j)); 
+  printf("), %lld bytes\n", 4*(Long64_t)convolution.paddedSize()*(Long64_t)sizeof(Double_t)); 
+  return 1; 
+}
+
+void BinnedKernelDensity::depositEvents(std::vector<Double_t>* map, const std::vector<Double_t>* points, 
+                                        const std::vector<Double_t>* weights, UInt_t part, UInt_t numParts, UInt_t* nextChunk) {
+
+  UInt_t num = weights->size(); 
+  UInt_t i; 
+
+  if (nextChunk == 0) {
+    // Static partition: contiguous ranges of events, the map does not depend on the scheduling
+    UInt_t first = (UInt_t)((ULong64_t)num*part/numParts); 
+    UInt_t last = (UInt_t)((ULong64_t)num*(part+1)/numParts); 
+    for (i=first; i<last; i++) addToMap(*map, &((*points)[i*m_dim]), (*weights)[i]); 
+    return; 
+  }
+
+  do {
+    UInt_t first = __atomic_fetch_add(nextChunk, 1, __ATOMIC_RELAXED)*depositChunkSize; 
+    if (first >= num) break; 
+    UInt_t last = TMath::Min(first + depositChunkSize, num); 
+    for (i=first; i<last; i++) addToMap(*map, &((*points)[i*m_dim]), (*weights)[i]); 
+  } while(1); 
+}
+
+void BinnedKernelDensity::reduceShards(std::vector< std::vector<Double_t> >* shards, UInt_t part, UInt_t numParts) {
+
+  UInt_t size = m_map.size(); 
+  UInt_t first = (UInt_t)((ULong64_t)size*part/numParts); 
+  UInt_t last = (UInt_t)((ULong64_t)size*(part+1)/numParts); 
+  UInt_t t, k; 
+  for (t=1; t<shards->size(); t++) {
+    const std::vector<Double_t> &shard = (*shards)[t]; 
+    for (k=first; k<last; k++) m_map[k] += shard[k]; 
+  }
 }
 
 void BinnedKernelDensity::fillMapFromDensity(AbsDensity* theDensity, UInt_t toyEvents) {
@@ -572,6 +885,12 @@ void BinnedKernelDensity::fillMapFromDensity(AbsDensity* theDensity, UInt_t toyE
     // Fill map in nodes of the binning
     printf("%20.20s INFO: Convolution of approx. density using rectangular grid\n", m_name); 
 
+    // With the FFT convolution the density values are collected in the nodes and convolved at the end
+    GridConvolution convolution; 
+    Bool_t fft = (m_options.approxConvolution == BinnedOptions::kFFT) && initConvolution(convolution); 
+    std::vector<Double_t> values; 
+    if (fft) values.assign(m_approxMap.size(), 0.); 
+
     // Create iterator vector
     std::vector<UInt_t> iter(m_dim); 
     Int_t j;
@@ -597,7 +916,12 @@ void BinnedKernelDensity::fillMapFromDensity(AbsDensity* theDensity, UInt_t toyE
       if ((index % 100) == 0 && timer(2))
         printf("%20.20s INFO: Index %d, density=%f\n", m_name, index, e); 
 
-      if (m_phaseSpace->withinLimits(x)) addToMap(m_approxMap, x, e);
+      if (m_phaseSpace->withinLimits(x)) {
+        if (fft) 
+          values[m_grid.iterToIndex(&(iter[0]))] = e; 
+        else 
+          addToMap(m_approxMap, x, e);
+      }
 
       // Increase iterator
       Bool_t run = 0; 
@@ -614,6 +938,8 @@ void BinnedKernelDensity::fillMapFromDensity(AbsDensity* theDensity, UInt_t toyE
 
     } while(1); 
 
+    if (fft) convolution.convolve(values, m_approxMap); 
+
   } else {
   
     // Fill map from random points
@@ -692,7 +1018,7 @@ void BinnedKernelDensity::writeToTextFile(const char* filename) {
     iter[j] = 0;
   }
 
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
   
   // Loop through the bins
   do {
@@ -761,7 +1087,7 @@ void BinnedKernelDensity::writeToRootFile(const char* filename) {
     iter[j] = 0;
   }
 
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
 
   TTree mapTree("MapTree", "MapTree"); 
 
@@ -827,7 +1153,7 @@ void BinnedKernelDensity::normalise(void) {
   // Zero iterator vector
   std::vector<Double_t> x(m_dim);
   std::vector<UInt_t> iter(m_dim); 
-  UInt_t size = m_map.size(); 
+  UInt_t size = m_grid.nodes(); 
 
   Int_t j;
 
@@ -880,121 +1206,316 @@ void BinnedKernelDensity::normalise(void) {
   printf("%20.20s INFO: Average PDF value before normalisation is %f\n", m_name, sum); 
 
   // Loop through the map and scale its entries
-  for (j=0; j<(Int_t)size; j++) m_map[j] /= sum; 
+  unpackMaps(); 
+  for (j=0; j<(Int_t)m_map.size(); j++) m_map[j] /= sum; 
+
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMaps(); 
 
 }
 
 
-Double_t BinnedKernelDensity::mapDensity(std::vector<Double_t> &map, std::vector<Double_t> &x) {
+void BinnedKernelDensity::setTileSize(UInt_t tileSize) {
+  changeLayout(tileSize, m_grid.sparse()); 
+}
 
-  Int_t j;
-  std::vector<UInt_t> ivect(m_dim); 
+void BinnedKernelDensity::setSparse(Bool_t sparse) {
+  changeLayout(m_grid.tileSize(), sparse); 
+}
 
-  for (j=0; j<(Int_t)m_dim; j++) {
-    Double_t low = m_phaseSpace->lowerLimit(j);
-    Double_t up  = m_phaseSpace->upperLimit(j);
-    Double_t xj = x[j]; 
-    if (xj < low || xj > up) {
-      return 0.;
-    }
-    Int_t ij = (Int_t)floor((xj-low)/(up-low)*(m_binning[j]-1));
+void BinnedKernelDensity::changeLayout(UInt_t tileSize, Bool_t sparse) {
 
-    if (ij == (Int_t)m_binning[j]-1) ij--;
+  unpackMaps(); 
+  GridEngine previous = m_grid; 
+  m_grid.init(m_phaseSpace, m_binning, tileSize, sparse); 
+  m_options.tileSize = tileSize; 
+  m_options.sparse = sparse; 
 
-    ivect[j] = ij;
+  if (m_grid.size() > MAX_VECTOR_SIZE) {
+    printf("%20.20s ERROR: Map size (%d) with tile size %d too large!\n", m_name, m_grid.size(), m_grid.tileSize()); 
+    abort(); 
   }
 
-  Double_t e = 0.;
-  Double_t wsum = 0.;
+  printf("%20.20s INFO: Map layout with tile size %d%s, map size=%d\n", m_name, m_grid.tileSize(), 
+         sparse ? " (sparse)" : "", m_grid.size()); 
 
-  std::vector<UInt_t> iter(m_dim); 
+  std::vector<Double_t> map; 
+  m_grid.convert(previous, m_map, map); 
+  m_map.swap(map); 
+  if (!m_baked) {
+    m_grid.convert(previous, m_approxMap, map); 
+    m_approxMap.swap(map); 
+  }
+  if (m_integralTable.size() > 0) m_grid.cumulate(m_map, m_integralTable); 
+  packMaps(); 
+}
 
-  for (j=0; j<(Int_t)m_dim; j++) {
-    iter[j] = 0;
+void BinnedKernelDensity::setPrecision(GridMap::Precision precision) {
+  unpackMaps(); 
+  m_packedMap.setPrecision(precision); 
+  m_packedApproxMap.setPrecision(precision); 
+  m_options.precision = precision; 
+  packMaps(); 
+}
+
+/// Pack the maps into the storage with reduced precision and release the double precision maps
+void BinnedKernelDensity::packMaps(void) {
+  if (m_packedMap.precision() == GridMap::kDouble || m_packedMap.size() > 0) return; 
+  m_packedMap.pack(m_map); 
+  std::vector<Double_t>().swap(m_map); 
+  if (!m_baked) {
+    m_packedApproxMap.pack(m_approxMap); 
+    std::vector<Double_t>().swap(m_approxMap); 
   }
+  printf("%20.20s INFO: Maps packed with precision %d, %llu bytes\n", m_name, (Int_t)m_packedMap.precision(), 
+         m_packedMap.bytes() + m_packedApproxMap.bytes()); 
+}
 
-  // Loop through the vertices of the N-dim cube
-  do {
+/// Restore the double precision maps from the packed storage
+void BinnedKernelDensity::unpackMaps(void) {
+  if (m_packedMap.size() == 0) return; 
+  m_packedMap.unpack(m_map); 
+  m_packedMap.clear(); 
+  if (!m_baked) {
+    m_packedApproxMap.unpack(m_approxMap); 
+    m_packedApproxMap.clear(); 
+  }
+}
 
-    // Calculate weight
-    Double_t weight = 1; 
-    for (j=0; j<(Int_t)m_dim; j++) {
-      Double_t low = m_phaseSpace->lowerLimit(j);
-      Double_t up  = m_phaseSpace->upperLimit(j);
+/// Replace the estimated map by the final PDF values in the grid nodes and release the approximation map
+void BinnedKernelDensity::bake(void) {
 
-      Double_t xj1 = low + ((Double_t)ivect[j]   )/((Double_t)m_binning[j]-1.)*(up-low);
-      Double_t xj2 = low + ((Double_t)ivect[j]+1.)/((Double_t)m_binning[j]-1.)*(up-low);
+  if (m_baked) return; 
 
-//      if (x[j] < xj1 || x[j] > xj2) {
-//        printf("%20.20s WARNING: dim %d: x=%f, x1=%f, x2=%f\n", m_name, j, x[j], xj1, xj2); 
-//      }
+  printf("%20.20s INFO: Baking PDF values into a single map\n", m_name); 
 
-      Double_t fweight;
-      if (iter[j] == 0) {
-        fweight = 1. - (x[j]-xj1)/(xj2-xj1); 
-      } else {
-        fweight = (x[j]-xj1)/(xj2-xj1); 
-      }
-      if (fweight < 0.) {
-        printf("%20.20s WARNING: dim %d: x=%f, weight=%f\n", m_name, j, x[j], fweight); 
-        fweight = 0.;
-      }
-      if (fweight > 1.) {
-        printf("%20.20s WARNING: dim %d: x=%f, weight=%f\n", m_name, j, x[j], fweight); 
-        fweight = 1.;
-      }
-      
-      weight *= fweight; 
+  std::vector<Double_t> values; 
+  nodeDensities(values); 
 
-//      printf("DEBUG:   Weight fraction: dim%d, i=%d, x=%f, x1=%f, x2=%f, fweight=%f\n", j, iter[j], x[j], xj1, xj2, fweight);
+  unpackMaps(); 
+  m_map.swap(values); 
 
-    }
+  // Release the memory of the approximation map
+  std::vector<Double_t>().swap(m_approxMap); 
+  m_packedApproxMap.clear(); 
+  m_baked = true; 
+  packMaps(); 
 
-    UInt_t index = 0;
-    for (j=m_dim-1; j>=0; j--) {
-      Int_t ij = ivect[j] + iter[j]; 
-      if (j==(Int_t)m_dim-1) {
-        index = ij; 
-      } else {
-        index = index*m_binning[j] + ij;
+}
+
+void BinnedKernelDensity::nodeDensities(std::vector<Double_t> &values) const {
+
+  Bool_t packed = (m_packedMap.size() > 0); 
+  values.assign(m_grid.size(), 0.); 
+
+  UInt_t size = m_grid.nodes(); 
+  Bool_t useApprox = (!m_baked && m_approxDensity && !m_fractionalMode); 
+
+  // Nodes are processed in chunks to evaluate the approximation PDF in batches
+  const UInt_t chunkSize = 4096; 
+  std::vector< std::vector<Double_t> > nodes(m_dim, std::vector<Double_t>(chunkSize)); 
+  std::vector<const Double_t*> nodePtr(m_dim); 
+  std::vector<Double_t> approx(chunkSize); 
+  std::vector<UInt_t> index(chunkSize); 
+  std::vector<UInt_t> iter(m_dim, 0); 
+
+  UInt_t j; 
+  for (j=0; j<m_dim; j++) nodePtr[j] = &(nodes[j][0]); 
+
+  UInt_t visited = 0; 
+  while (visited < size) {
+    UInt_t num = 0; 
+    UInt_t i; 
+
+    // Nodes are visited in the logical order (1st variable runs fastest), 
+    // the nodes which are not stored in the sparse layout are skipped
+    for (; num<chunkSize && visited<size; visited++) {
+      index[num] = m_grid.iterToIndex(&(iter[0])); 
+      if (m_grid.isStored(index[num])) {
+        for (j=0; j<m_dim; j++) nodes[j][num] = m_grid.nodeCoordinate(j, iter[j]); 
+        num++; 
+      }
+      for (j=0; j<m_dim; j++) {
+        if (iter[j] < m_binning[j]-1) {
+          iter[j]++; 
+          break; 
+        } else {
+          iter[j] = 0; 
+        }
       }
     }
 
-    e += weight*map[index]; 
-    wsum += weight; 
+    if (useApprox) m_approxDensity->densityBatch(num, &(nodePtr[0]), &(approx[0])); 
 
-//    printf("DEBUG: Weight=%f, index=%d, density=%f\n", weight, index, m_map[index]); 
-
-    // Increment iterator
-    Bool_t run = 0; 
-    for (j=0; j<(Int_t)m_dim; j++) {
-      if (iter[j] == 0) {
-        iter[j]++; 
-        run = 1; 
-        break;
+    for (i=0; i<num; i++) {
+      Double_t e = packed ? m_packedMap.value(index[i]) : m_map[index[i]]; 
+      if (m_baked) {
+        values[index[i]] = e; 
+        continue; 
+      }
+      Double_t a = packed ? m_packedApproxMap.value(index[i]) : m_approxMap[index[i]]; 
+      if (a > 0.) {
+        values[index[i]] = useApprox ? e/a*approx[i] : e/a; 
       } else {
-        iter[j] = 0;
+        values[index[i]] = 0.; 
       }
     }
-    if (!run) break;
+  }
+}
 
-  } while(1); 
 
-//  printf("density=%f, wsum=%f\n", e, wsum); 
+Double_t BinnedKernelDensity::mapDensity(std::vector<Double_t> &map, std::vector<Double_t> &x) {
+  if (m_interpolation == GridEngine::kCubic) return m_grid.interpolateCubic(map, &(x[0])); 
+  return m_grid.interpolate(map, &(x[0])); 
+}
 
-  return e; 
+Bool_t BinnedKernelDensity::interpolateMaps(const Double_t* x, Double_t* e, Double_t* a) const {
+  Bool_t packed = (m_packedMap.size() > 0); 
+  if (m_interpolation == GridEngine::kCubic) {
+    if (m_baked) {
+      *a = 1.; 
+      *e = packed ? m_grid.interpolateCubic(m_packedMap, x) : m_grid.interpolateCubic(m_map, x); 
+      if (*e < 0.) *e = 0.; 
+      return 1; 
+    }
+    Bool_t inside = packed ? m_grid.interpolateCubic(m_packedMap, m_packedApproxMap, x, e, a) : 
+                             m_grid.interpolateCubic(m_map, m_approxMap, x, e, a); 
+    // Outside the grid the values are not set
+    if (inside && *e < 0.) *e = 0.; 
+    return inside; 
+  }
+  if (m_baked) {
+    *a = 1.; 
+    *e = packed ? m_grid.interpolate(m_packedMap, x) : m_grid.interpolate(m_map, x); 
+    return 1; 
+  }
+  return packed ? m_grid.interpolate(m_packedMap, m_packedApproxMap, x, e, a) : 
+                  m_grid.interpolate(m_map, m_approxMap, x, e, a); 
+}
 
+Double_t BinnedKernelDensity::interpolateMapGradient(const std::vector<Double_t> &map, const GridMap &packedMap, 
+                                                     const Double_t* x, Double_t* grad) const {
+  Bool_t packed = (packedMap.size() > 0); 
+  if (m_interpolation == GridEngine::kCubic) 
+    return packed ? m_grid.interpolateCubicGradient(packedMap, x, grad) : m_grid.interpolateCubicGradient(map, x, grad); 
+  return packed ? m_grid.interpolateGradient(packedMap, x, grad) : m_grid.interpolateGradient(map, x, grad); 
 }
 
-Double_t BinnedKernelDensity::density(std::vector<Double_t> &x) {
-  Double_t a = mapDensity(m_approxMap, x); 
+Double_t BinnedKernelDensity::density(const Double_t* x, UInt_t dim) const {
+  Double_t e, a; 
+  Bool_t inside = interpolateMaps(x, &e, &a); 
+  if (m_baked) return e; 
+  if (!inside) return 0.; 
   if (a>0.) {
     if (m_approxDensity && !m_fractionalMode) { 
-      return mapDensity(m_map, x)/a*m_approxDensity->density(x); 
+      return e/a*m_approxDensity->density(x, dim); 
     } else { 
-      return mapDensity(m_map, x)/a; 
+      return e/a; 
     }
   } else {
     return 0.; 
   }
 }
+
+void BinnedKernelDensity::densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result) {
+
+  if (numPoints == 0) return; 
+
+  std::vector<Double_t> point(m_dim); 
+  UInt_t i, j;
+
+  // Baked map already contains the final PDF values
+  if (m_baked) {
+    for (i=0; i<numPoints; i++) {
+      for (j=0; j<m_dim; j++) point[j] = x[j][i]; 
+      Double_t a; 
+      interpolateMaps(&(point[0]), &(result[i]), &a); 
+    }
+    return; 
+  }
+
+  // Approximation PDF is evaluated for the whole batch at once
+  Bool_t useApprox = (m_approxDensity && !m_fractionalMode); 
+  std::vector<Double_t> approx; 
+  if (useApprox) {
+    approx.resize(numPoints); 
+    m_approxDensity->densityBatch(numPoints, x, &(approx[0])); 
+  }
+
+  for (i=0; i<numPoints; i++) {
+    for (j=0; j<m_dim; j++) point[j] = x[j][i]; 
+
+    // Both maps share the same interpolation weights
+    Double_t e, a; 
+    Bool_t inside = interpolateMaps(&(point[0]), &e, &a); 
+    if (inside && a > 0.) {
+      result[i] = useApprox ? e/a*approx[i] : e/a; 
+    } else {
+      result[i] = 0.; 
+    }
+  }
+}
+
+Double_t BinnedKernelDensity::densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const {
+
+  UInt_t j; 
+  if (m_baked) {
+    Double_t e = interpolateMapGradient(m_map, m_packedMap, x, grad); 
+    if (m_interpolation == GridEngine::kCubic && e <= 0.) {
+      for (j=0; j<m_dim; j++) grad[j] = 0.; 
+      return 0.; 
+    }
+    return e; 
+  }
+
+  std::vector<Double_t> gradE(m_dim); 
+  std::vector<Double_t> gradA(m_dim); 
+  Double_t e = interpolateMapGradient(m_map, m_packedMap, x, &(gradE[0])); 
+  Double_t a = interpolateMapGradient(m_approxMap, m_packedApproxMap, x, &(gradA[0])); 
+
+  // Cubic interpolation of the map is truncated at zero
+  if (a <= 0. || (m_interpolation == GridEngine::kCubic && e <= 0.)) {
+    for (j=0; j<m_dim; j++) grad[j] = 0.; 
+    return 0.; 
+  }
+
+  // Gradient of the ratio e/a
+  Double_t ratio = e/a; 
+  for (j=0; j<m_dim; j++) grad[j] = (gradE[j] - ratio*gradA[j])/a; 
+
+  if (m_approxDensity && !m_fractionalMode) {
+    std::vector<Double_t> gradApprox(m_dim); 
+    Double_t approx = m_approxDensity->densityGradient(x, dim, &(gradApprox[0])); 
+    for (j=0; j<m_dim; j++) grad[j] = grad[j]*approx + ratio*gradApprox[j]; 
+    return ratio*approx; 
+  }
+
+  return ratio; 
+}
+
+void BinnedKernelDensity::buildIntegralTable(void) {
+  if (!m_baked) {
+    printf("%20.20s ERROR: Integral table needs the baked mode, call bake() first\n", m_name); 
+    abort(); 
+  }
+  if (m_grid.sparse()) {
+    printf("%20.20s ERROR: Integral table is not available in the sparse layout, call setSparse(false) first\n", m_name); 
+    abort(); 
+  }
+  printf("%20.20s INFO: Building summed-volume table\n", m_name); 
+  if (m_packedMap.size() > 0) {
+    std::vector<Double_t> map; 
+    m_packedMap.unpack(map); 
+    m_grid.cumulate(map, m_integralTable); 
+  } else {
+    m_grid.cumulate(m_map, m_integralTable); 
+  }
+}
+
+Double_t BinnedKernelDensity::integral(const Double_t* lower, const Double_t* upper) const {
+  if (m_integralTable.size() == 0) {
+    printf("%20.20s ERROR: buildIntegralTable() has to be called before integral()\n", m_name); 
+    abort(); 
+  }
+  return m_grid.integrate(m_integralTable, lower, upper); 
+}
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "TMath.h"
+
+#include "AbsPhaseSpace.hh"
+#include "AbsDensity.hh"
+#include "CachedDensity.hh"
+
+/// Maximum dimensionality of the cached densities (size of the coordinate arrays on the stack)
+#define MAX_CACHED_DIM 16
+
+/// Acquire the spin lock of a hash table slot. The locked sections only copy the key and the value.
+static inline void lockSlot(Char_t* flag) {
+  while (__atomic_exchange_n(flag, 1, __ATOMIC_ACQUIRE)) {}
+}
+
+/// Release the spin lock of a hash table slot
+static inline void unlockSlot(Char_t* flag) {
+  __atomic_store_n(flag, 0, __ATOMIC_RELEASE); 
+}
+
+CachedDensity::CachedDensity(const char* pdfName, 
+                             AbsDensity* d, 
+                             Double_t tolerance, 
+                             UInt_t cacheSize) : AbsDensity(pdfName) {
+
+  m_density = d; 
+  m_phaseSpace = d->phaseSpace(); 
+  m_dim = m_phaseSpace->dimensionality(); 
+  m_tolerance = tolerance; 
+
+  if (m_tolerance < 0.) {
+    printf("%20.20s ERROR: Negative cache tolerance %f\n", m_name, m_tolerance); 
+    abort(); 
+  }
+
+  if (m_dim > MAX_CACHED_DIM) {
+    printf("%20.20s ERROR: Caching is limited to %d dimensions\n", m_name, MAX_CACHED_DIM); 
+    abort(); 
+  }
+
+  m_lower.resize(m_dim); 
+  m_invCell.resize(m_dim); 
+  UInt_t j; 
+  for (j=0; j<m_dim; j++) {
+    m_lower[j] = m_phaseSpace->lowerLimit(j); 
+    Double_t range = m_phaseSpace->upperLimit(j) - m_phaseSpace->lowerLimit(j); 
+    m_invCell[j] = (m_tolerance > 0.) ? 1./(m_tolerance*range) : 0.; 
+  }
+
+  UInt_t slots = 1; 
+  while (slots < cacheSize && slots < 0x80000000u) slots <<= 1; 
+  m_mask = slots - 1; 
+
+  printf("%20.20s INFO: Caching density \"%s\" with tolerance %g in %d slots\n", m_name, d->name(), m_tolerance, slots); 
+
+  m_keys.assign((ULong64_t)slots*m_dim, 0); 
+  m_values.assign(slots, 0.); 
+  m_filled.assign(slots, 0); 
+  m_locks.assign(slots, 0); 
+  m_hits = 0; 
+  m_misses = 0; 
+}
+
+CachedDensity::~CachedDensity() {
+
+}
+
+UInt_t CachedDensity::cellKey(const Double_t* const* x, UInt_t i, Long64_t* key) const {
+
+  ULong64_t hash = 0xcbf29ce484222325ULL; 
+  UInt_t j; 
+  for (j=0; j<m_dim; j++) {
+    Double_t xj = x[j][i]; 
+    if (m_tolerance > 0.) {
+      Double_t t = TMath::Floor((xj - m_lower[j])*m_invCell[j]); 
+      if (t > 1e18) t = 1e18; 
+      if (t < -1e18) t = -1e18; 
+      key[j] = (Long64_t)t; 
+    } else {
+      memcpy(&(key[j]), &xj, sizeof(Long64_t)); 
+    }
+    hash ^= (ULong64_t)key[j]; 
+    hash *= 0x9e3779b97f4a7c15ULL; 
+    hash ^= hash >> 29; 
+  }
+  return (UInt_t)(hash & m_mask); 
+}
+
+Bool_t CachedDensity::cellCentre(const Double_t* const* x, UInt_t i, const Long64_t* key, Double_t* centre) const {
+
+  UInt_t j; 
+  if (m_tolerance == 0.) {
+    for (j=0; j<m_dim; j++) centre[j] = x[j][i]; 
+    return 1; 
+  }
+  for (j=0; j<m_dim; j++) centre[j] = m_lower[j] + ((Double_t)key[j] + 0.5)/m_invCell[j]; 
+  return m_phaseSpace->withinLimits(centre, m_dim); 
+}
+
+Bool_t CachedDensity::lookup(UInt_t slot, const Long64_t* key, Double_t* value) const {
+
+  Bool_t found = 0; 
+  lockSlot(&(m_locks[slot])); 
+  const Long64_t* stored = &(m_keys[(ULong64_t)slot*m_dim]); 
+  if (m_filled[slot]) {
+    UInt_t j; 
+    for (j=0; j<m_dim; j++) if (stored[j] != key[j]) break; 
+    if (j == m_dim) {
+      *value = m_values[slot]; 
+      found = 1; 
+    }
+  }
+  unlockSlot(&(m_locks[slot])); 
+
+  __atomic_add_fetch(found ? &m_hits : &m_misses, 1, __ATOMIC_RELAXED); 
+  return found; 
+}
+
+void CachedDensity::store(UInt_t slot, const Long64_t* key, Double_t value) const {
+
+  lockSlot(&(m_locks[slot])); 
+  Long64_t* stored = &(m_keys[(ULong64_t)slot*m_dim]); 
+  UInt_t j; 
+  for (j=0; j<m_dim; j++) stored[j] = key[j]; 
+  m_values[slot] = value; 
+  m_filled[slot] = 1; 
+  unlockSlot(&(m_locks[slot])); 
+}
+
+Double_t CachedDensity::density(const Double_t* x, UInt_t dim) const {
+
+  const Double_t* coord[MAX_CACHED_DIM]; 
+  Long64_t key[MAX_CACHED_DIM]; 
+  Double_t centre[MAX_CACHED_DIM]; 
+  UInt_t j; 
+  for (j=0; j<m_dim; j++) coord[j] = x + j; 
+
+  UInt_t slot = cellKey(coord, 0, key); 
+  Double_t value; 
+  if (lookup(slot, key, &value)) return value; 
+
+  // The wrapped density is evaluated outside of the lock
+  if (!cellCentre(coord, 0, key, centre)) return m_density->density(x, dim); 
+  value = m_density->density(centre, dim); 
+  store(slot, key, value); 
+  return value; 
+}
+
+void CachedDensity::densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result) {
+
+  if (numPoints == 0) return; 
+
+  Long64_t key[MAX_CACHED_DIM]; 
+  Double_t centre[MAX_CACHED_DIM]; 
+  std::vector<UInt_t> missIndex; 
+  std::vector<UInt_t> missSlot; 
+  std::vector<Long64_t> missKey; 
+  std::vector< std::vector<Double_t> > missCoord(m_dim); 
+
+  UInt_t i, j; 
+  for (i=0; i<numPoints; i++) {
+    UInt_t slot = cellKey(x, i, key); 
+    if (lookup(slot, key, &(result[i]))) continue; 
+
+    // Cells with the centre outside the phase space are evaluated at the point and not stored
+    Bool_t cached = cellCentre(x, i, key, centre); 
+    missIndex.push_back(i); 
+    missSlot.push_back(cached ? slot : m_mask + 1); 
+    for (j=0; j<m_dim; j++) {
+      missKey.push_back(key[j]); 
+      missCoord[j].push_back(cached ? centre[j] : x[j][i]); 
+    }
+  }
+
+  UInt_t misses = missIndex.size(); 
+  if (misses == 0) return; 
+
+  // Points missing in the cache are evaluated in a single batch
+  std::vector<const Double_t*> missPtr(m_dim); 
+  for (j=0; j<m_dim; j++) missPtr[j] = &(missCoord[j][0]); 
+  std::vector<Double_t> values(misses); 
+  m_density->densityBatch(misses, &(missPtr[0]), &(values[0])); 
+
+  for (i=0; i<misses; i++) {
+    result[missIndex[i]] = values[i]; 
+    if (missSlot[i] <= m_mask) store(missSlot[i], &(missKey[(ULong64_t)i*m_dim]), values[i]); 
+  }
+}
+
+Double_t CachedDensity::densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const {
+  return m_density->densityGradient(x, dim, grad); 
+}
+
+void CachedDensity::clear(void) {
+  UInt_t slot; 
+  for (slot=0; slot<=m_mask; slot++) {
+    lockSlot(&(m_locks[slot])); 
+    m_filled[slot] = 0; 
+    unlockSlot(&(m_locks[slot])); 
+  }
+}
+
+ULong64_t CachedDensity::hits(void) const {
+  return __atomic_load_n(&m_hits, __ATOMIC_RELAXED); 
+}
+
+ULong64_t CachedDensity::misses(void) const {
+  return __atomic_load_n(&m_misses, __ATOMIC_RELAXED); 
+}
@@ -37,6 +37,7 @@ CombinedPhaseSpace::~CombinedPhaseSpace() {
 void CombinedPhaseSpace::init(std::vector<AbsPhaseSpace*> &phspList) {
 
   m_phspList = phspList; 
+  m_phspDim.clear(); 
   m_dim = 0;
   
   std::vector<AbsPhaseSpace*>::iterator i;
@@ -47,6 +48,7 @@ void CombinedPhaseSpace::init(std::vector<AbsPhaseSpace*> &phspList) {
   for (i=m_phspList.begin(); i != m_phspList.end(); i++) {
     UInt_t dim = (*i)->dimensionality(); 
     printf("%20.20s INFO: Adding component phase space \"%s\", dim=%d\n", m_name, (*i)->name(), dim); 
+    m_phspDim.push_back(dim); 
     m_dim += dim;
   }
   printf("%20.20s INFO: Resulting dimensionality is %d\n", m_name, m_dim); 
@@ -72,24 +74,18 @@ UInt_t CombinedPhaseSpace::dimensionality() {
   return m_dim;
 }
 
-Bool_t CombinedPhaseSpace::withinLimits(std::vector<Double_t> &x) {
-  if (x.size() != m_dim) {
+Bool_t CombinedPhaseSpace::withinLimits(const Double_t* x, UInt_t dim) const {
+  if (dim != m_dim) {
     printf("%20.20s WARNING: Dimensionality of vector (%d) does not correspond to phase space definition (%d)\n", 
-       m_name, (UInt_t)x.size(), m_dim);
+       m_name, dim, m_dim);
     return 0;
   }
   
   UInt_t n=0;
-  std::vector<AbsPhaseSpace*>::iterator i; 
-  for (i=m_phspList.begin(); i != m_phspList.end(); i++) {
-    UInt_t dim = (*i)->dimensionality(); 
-    UInt_t j; 
-    std::vector<Double_t> subset(dim); 
-    for (j=0; j<dim; j++) {
-      subset[j] = x[n];
-      n++;
-    }
-    if ( !(*i)->withinLimits(subset) ) return 0; 
+  UInt_t i; 
+  for (i=0; i<m_phspList.size(); i++) {
+    if ( !m_phspList[i]->withinLimits(x + n, m_phspDim[i]) ) return 0; 
+    n += m_phspDim[i]; 
   }
   
   return 1;
@@ -117,28 +113,20 @@ Double_t CombinedPhaseSpace::upperLimit(UInt_t var) {
   return 0;
 }
 
-Bool_t CombinedPhaseSpace::limits(UInt_t var, std::vector<Double_t> &x, 
-                                  Double_t* lower, Double_t* upper) {
+Bool_t CombinedPhaseSpace::limits(UInt_t var, const Double_t* x, __attribute__((unused)) UInt_t dim, 
+                                  Double_t* lower, Double_t* upper) const {
 
   UInt_t n = 0;
-  UInt_t m = 0;
-  std::vector<AbsPhaseSpace*>::iterator i; 
+  UInt_t i; 
 
-  for (i=m_phspList.begin(); i != m_phspList.end(); i++) {
-    UInt_t dim = (*i)->dimensionality(); 
-    std::vector<Double_t> subset(dim); 
+  for (i=0; i<m_phspList.size(); i++) {
+    UInt_t first = n; 
     UInt_t j;
-
-    for (j=0; j<dim; j++) {
-      subset[j] = x[m];
-      m++;
-    }
-
-    for (j=0; j<dim; j++) {
+    for (j=0; j<m_phspDim[i]; j++) {
       if (x[n] < m_lowerLimit[n] || x[n] > m_upperLimit[n]) 
         return 0;
       if (n == var) {
-        Bool_t res = (*i)->limits(j, subset, lower, upper);
+        Bool_t res = m_phspList[i]->limits(j, x + first, m_phspDim[i], lower, upper);
         if (!res) return 0;
       }
       n++;
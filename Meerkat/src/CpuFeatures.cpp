@@ -0,0 +1,44 @@
+#include <stdio.h>
+
+#include "CpuFeatures.hh"
+
+Int_t CpuFeatures::m_level = -1; 
+
+CpuFeatures::Level CpuFeatures::detect(void) {
+  Level cpu = kBaseline; 
+#ifdef MEERKAT_CPU_DISPATCH
+  __builtin_cpu_init(); 
+  if (__builtin_cpu_supports("avx512f")) cpu = kAVX512; 
+  else if (__builtin_cpu_supports("avx2")) cpu = kAVX2; 
+#endif
+  printf("%20.20s INFO: Using %s kernels\n", "CpuFeatures", name(cpu)); 
+  return cpu; 
+}
+
+CpuFeatures::Level CpuFeatures::detected(void) {
+  // Initialisation of the local static is thread-safe (C++11), concurrent first calls wait for it
+  static const Level cpu = detect(); 
+  return cpu; 
+}
+
+CpuFeatures::Level CpuFeatures::level(void) {
+  Level cpu = detected(); 
+  Int_t level = __atomic_load_n(&m_level, __ATOMIC_RELAXED); 
+  if (level < 0 || level > (Int_t)cpu) return cpu; 
+  return (Level)level; 
+}
+
+void CpuFeatures::setLevel(Level level) {
+  __atomic_store_n(&m_level, (Int_t)level, __ATOMIC_RELAXED); 
+}
+
+const char* CpuFeatures::name(Level level) {
+  switch (level) {
+    case kAVX512: 
+      return "AVX-512"; 
+    case kAVX2: 
+      return "AVX2"; 
+    default: 
+      return "baseline"; 
+  }
+}
@@ -36,7 +36,7 @@ DalitzPhaseSpace::~DalitzPhaseSpace() {
 
 }
 
-Bool_t DalitzPhaseSpace::withinLimits(std::vector<Double_t> &x) {
+Bool_t DalitzPhaseSpace::withinLimits(const Double_t* x, __attribute__((unused)) UInt_t dim) const {
 
   Double_t m2ab = x[0];
   Double_t m2bc = x[1];
@@ -87,8 +87,8 @@ Double_t DalitzPhaseSpace::upperLimit(UInt_t var) {
   }
 }
 
-Bool_t DalitzPhaseSpace::limits(UInt_t var, std::vector<Double_t> &x, 
-                                Double_t* lower, Double_t* upper) {
+Bool_t DalitzPhaseSpace::limits(UInt_t var, const Double_t* x, __attribute__((unused)) UInt_t dim, 
+                                Double_t* lower, Double_t* upper) const {
 
   if (var == 0) { // AB 
     Double_t m2bc = x[1];
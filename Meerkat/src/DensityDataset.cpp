@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <functional>
+
+#include "TMath.h"
+#include "TTree.h"
+#include "TString.h"
+
+#include "AbsPhaseSpace.hh"
+#include "AbsDensity.hh"
+#include "GridEngine.hh"
+#include "DensityDataset.hh"
+
+#include "Timer.hh"
+
+/// Evaluate the density for a range of points
+static void evaluateDensityRange(AbsDensity* density, const std::vector<const Double_t*> &coord,
+                                 Double_t* values, UInt_t first, UInt_t last) {
+  if (last <= first) return;
+  UInt_t dim = coord.size();
+  std::vector<const Double_t*> x(dim);
+  UInt_t j;
+  for (j=0; j<dim; j++) x[j] = coord[j] + first;
+  density->densityBatch(last - first, &(x[0]), values + first);
+}
+
+DensityDataset::DensityDataset(const char* dataName,
+                               AbsPhaseSpace* thePhaseSpace) {
+  strncpy(m_name, dataName, 255);
+  m_name[255] = 0;
+  m_phaseSpace = thePhaseSpace;
+  m_dim = m_phaseSpace->dimensionality();
+  m_size = 0;
+  m_numThreads = 1;
+  m_gridBound = false;
+  m_coord.resize(m_dim);
+}
+
+DensityDataset::~DensityDataset() {
+
+}
+
+void DensityDataset::readTuple(TTree* tree, std::vector<TString> &vars, UInt_t maxEvents, UInt_t skipEvents) {
+
+  if (vars.size() != m_dim) {
+    printf("%20.20s ERROR: Number of TTree variables (%d) in tree \"%s\" does not correspond to phase space dimensionality (%d)\n",
+           m_name, (UInt_t)vars.size(), tree->GetName(), m_dim );
+    abort();
+  }
+
+  tree->ResetBranchAddresses();
+
+  Long64_t nentries = tree->GetEntries();
+  if (maxEvents > 0 && skipEvents + maxEvents < nentries) nentries = skipEvents + maxEvents;
+  if (nentries < skipEvents) nentries = skipEvents;
+
+  std::vector<Float_t> varArray(m_dim);
+
+  UInt_t n;
+  for (n=0; n < m_dim; n++) {
+    printf("%20.20s INFO: Will read branch \"%s\" from tree \"%s\"\n", m_name, vars[n].Data(), tree->GetName());
+    Int_t status = tree->SetBranchAddress(vars[n], &( varArray[n] ));
+    if (status < 0) {
+      printf("%20.20s WARNING: Error setting branch, status=%d\n", m_name, status);
+      abort();
+    }
+  }
+
+  m_size = nentries - skipEvents;
+  for (n=0; n < m_dim; n++) m_coord[n].resize(m_size);
+  m_values.clear();
+  m_gridBound = false;
+
+  set_timer();
+
+  Long64_t i;
+  for (i=skipEvents; i<nentries; i++) {
+    tree->GetEntry(i);
+    for (n=0; n<m_dim; n++) m_coord[n][i-skipEvents] = varArray[n];
+
+    if (i % 100 == 0 && timer(2)) {
+      printf("%20.20s INFO: Read %lld/%lld events (%f%%)\n", m_name, i-skipEvents, nentries-skipEvents,
+             100.*float(i-skipEvents)/float(nentries-skipEvents));
+    }
+  }
+
+  printf("%20.20s INFO: %d events read in from \"%s\"\n", m_name, m_size, tree->GetName() );
+}
+
+void DensityDataset::setPoints(UInt_t numPoints, const Double_t* const* x) {
+  m_size = numPoints;
+  UInt_t n;
+  for (n=0; n < m_dim; n++) m_coord[n].assign(x[n], x[n] + numPoints);
+  m_values.clear();
+  m_gridBound = false;
+}
+
+const std::vector<Double_t> &DensityDataset::evaluate(AbsDensity* density) {
+
+  if (density->phaseSpace()->dimensionality() != m_dim) {
+    printf("%20.20s ERROR: Dimensionality of density \"%s\" (%d) does not match the dataset (%d)\n",
+           m_name, density->name(), density->phaseSpace()->dimensionality(), m_dim);
+    abort();
+  }
+
+  m_values.resize(m_size);
+  if (m_size == 0) return m_values;
+
+  std::vector<const Double_t*> coord(m_dim);
+  UInt_t j;
+  for (j=0; j<m_dim; j++) coord[j] = &(m_coord[j][0]);
+
+  UInt_t numThreads = TMath::Min(m_numThreads, m_size);
+  if (numThreads <= 1) {
+    evaluateDensityRange(density, coord, &(m_values[0]), 0, m_size);
+    return m_values;
+  }
+
+  // Split the points into contiguous ranges, one per thread
+  std::vector<std::thread> threads;
+  UInt_t t;
+  for (t=0; t<numThreads; t++) {
+    UInt_t first = (UInt_t)((ULong64_t)m_size*t/numThreads);
+    UInt_t last  = (UInt_t)((ULong64_t)m_size*(t+1)/numThreads);
+    threads.push_back(std::thread(evaluateDensityRange, density, std::cref(coord), &(m_values[0]), first, last));
+  }
+  for (t=0; t<numThreads; t++) threads[t].join();
+
+  return m_values;
+}
+
+void DensityDataset::bindGrid(const GridEngine &grid) {
+
+  if (grid.dimensionality() != m_dim) {
+    printf("%20.20s ERROR: Dimensionality of the grid (%d) does not match the dataset (%d)\n",
+           m_name, grid.dimensionality(), m_dim);
+    abort();
+  }
+
+  m_grid = grid;
+  m_cellInside.resize(m_size);
+  m_cellIndex.resize(m_size*m_dim);
+  m_cellFrac.resize(m_size*m_dim);
+
+  std::vector<Double_t> x(m_dim);
+  UInt_t i, j;
+  UInt_t nout = 0;
+  for (i=0; i<m_size; i++) {
+    for (j=0; j<m_dim; j++) x[j] = m_coord[j][i];
+    m_cellInside[i] = m_grid.locate(&(x[0]), &(m_cellIndex[i*m_dim]), &(m_cellFrac[i*m_dim]));
+    if (!m_cellInside[i]) nout++;
+  }
+
+  m_gridBound = true;
+
+  printf("%20.20s INFO: Cached grid cells for %d points, %d outside the grid\n", m_name, m_size, nout);
+}
+
+void DensityDataset::evaluateMapRange(const std::vector<Double_t> &map, GridEngine::Interpolation interpolation,
+                                      UInt_t first, UInt_t last) {
+  UInt_t i, j;
+  if (interpolation == GridEngine::kCubic) {
+    std::vector<Double_t> x(m_dim);
+    for (i=first; i<last; i++) {
+      if (!m_cellInside[i]) {
+        m_values[i] = 0.;
+        continue;
+      }
+      for (j=0; j<m_dim; j++) x[j] = m_coord[j][i];
+      Double_t e = m_grid.interpolateCubic(map, &(x[0]));
+      m_values[i] = (e > 0.) ? e : 0.;
+    }
+    return;
+  }
+  for (i=first; i<last; i++) {
+    m_values[i] = m_cellInside[i] ? m_grid.interpolateCell(map, &(m_cellIndex[i*m_dim]), &(m_cellFrac[i*m_dim])) : 0.;
+  }
+}
+
+const std::vector<Double_t> &DensityDataset::evaluateMap(const std::vector<Double_t> &map, GridEngine::Interpolation interpolation) {
+
+  if (!m_gridBound) {
+    printf("%20.20s ERROR: bindGrid() has to be called before evaluateMap()\n", m_name);
+    abort();
+  }
+
+  if (map.size() != m_grid.size()) {
+    printf("%20.20s ERROR: Map size (%d) does not match the grid size (%d)\n",
+           m_name, (UInt_t)map.size(), m_grid.size());
+    abort();
+  }
+
+  m_values.resize(m_size);
+
+  UInt_t numThreads = TMath::Min(m_numThreads, m_size);
+  if (numThreads <= 1) {
+    evaluateMapRange(map, interpolation, 0, m_size);
+    return m_values;
+  }
+
+  std::vector<std::thread> threads;
+  UInt_t t;
+  for (t=0; t<numThreads; t++) {
+    UInt_t first = (UInt_t)((ULong64_t)m_size*t/numThreads);
+    UInt_t last  = (UInt_t)((ULong64_t)m_size*(t+1)/numThreads);
+    threads.push_back(std::thread(&DensityDataset::evaluateMapRange, this, std::cref(map), interpolation, first, last));
+  }
+  for (t=0; t<numThreads; t++) threads[t].join();
+
+  return m_values;
+}
@@ -45,9 +45,12 @@ void FactorisedDensity::init(AbsPhaseSpace* thePhaseSpace,
   printf("%20.20s INFO: Creating factorised density of %d components\n", m_name, (UInt_t)densityComponents.size() ); 
 
   UInt_t sumDim = 0; 
+  m_componentDim.clear(); 
   std::vector<AbsDensity*>::iterator i; 
   for (i=densityComponents.begin(); i != densityComponents.end(); i++) {
-    sumDim += (*i)->phaseSpace()->dimensionality(); 
+    UInt_t dim = (*i)->phaseSpace()->dimensionality(); 
+    m_componentDim.push_back(dim); 
+    sumDim += dim; 
   }
 
   m_dim = m_phaseSpace->dimensionality(); 
@@ -58,31 +61,71 @@ void FactorisedDensity::init(AbsPhaseSpace* thePhaseSpace,
 
 }
 
-Double_t FactorisedDensity::density(std::vector<Double_t> &x) {  
+Double_t FactorisedDensity::density(const Double_t* x, UInt_t dim) const {  
 
-  if (x.size() != m_dim) {
+  if (dim != m_dim) {
     printf("%20.20s ERROR: Dimensionality of vector (%d) does not correspond to phase space definition (%d)\n", 
-       m_name, (UInt_t)x.size(), m_dim);
+       m_name, dim, m_dim);
     abort(); 
   }
   
   Double_t prod = 1.;
   UInt_t n=0;
-  std::vector<AbsDensity*>::iterator i; 
-  for (i=m_densityComponents.begin(); i != m_densityComponents.end(); i++) {
-    UInt_t dim = (*i)->phaseSpace()->dimensionality(); 
-    std::vector<Double_t> subset(dim); 
-    UInt_t j; 
-    for (j=0; j<dim; j++) {
-      subset[j] = x[n];
-      n++;
-    }
-    Double_t d = (*i)->density(subset); 
+  UInt_t i; 
+  for (i=0; i<m_densityComponents.size(); i++) {
+    Double_t d = m_densityComponents[i]->density(x + n, m_componentDim[i]); 
+    n += m_componentDim[i]; 
     
     prod *= d;
-    
-//    printf("Component %d, density=%f, prod=%f\n", n, d, prod);
   }
   return prod; 
 
 }
+
+void FactorisedDensity::densityBatch(UInt_t numPoints, const Double_t* const* x, Double_t* result) {
+
+  std::vector<Double_t> component(numPoints); 
+
+  UInt_t j; 
+  for (j=0; j<numPoints; j++) result[j] = 1.; 
+
+  UInt_t n=0;
+  UInt_t i; 
+  for (i=0; i<m_densityComponents.size(); i++) {
+    m_densityComponents[i]->densityBatch(numPoints, x + n, &(component[0])); 
+    n += m_componentDim[i]; 
+    for (j=0; j<numPoints; j++) result[j] *= component[j]; 
+  }
+}
+
+Double_t FactorisedDensity::densityGradient(const Double_t* x, UInt_t dim, Double_t* grad) const {
+
+  if (dim != m_dim) {
+    printf("%20.20s ERROR: Dimensionality of vector (%d) does not correspond to phase space definition (%d)\n", 
+       m_name, dim, m_dim);
+    abort(); 
+  }
+
+  // Each component fills its own sub-range of the gradient array
+  std::vector<Double_t> value(m_densityComponents.size()); 
+  UInt_t n=0;
+  UInt_t i, j; 
+  for (i=0; i<m_densityComponents.size(); i++) {
+    value[i] = m_densityComponents[i]->densityGradient(x + n, m_componentDim[i], grad + n); 
+    n += m_componentDim[i]; 
+  }
+
+  // Product rule: multiply the derivatives of each component by the values of all other components
+  Double_t prod = 1.; 
+  n=0;
+  for (i=0; i<m_densityComponents.size(); i++) {
+    Double_t others = 1.; 
+    UInt_t k; 
+    for (k=0; k<m_densityComponents.size(); k++) if (k != i) others *= value[k]; 
+    for (j=0; j<m_componentDim[i]; j++) grad[n+j] *= others; 
+    n += m_componentDim[i]; 
+    prod *= value[i]; 
+  }
+
+  return prod; 
+}
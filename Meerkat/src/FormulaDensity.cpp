@@ -39,7 +39,7 @@ FormulaDensity::~FormulaDensity() {
 
 }
 
-Double_t FormulaDensity::density(std::vector<Double_t> &x) {  
+Double_t FormulaDensity::density(const Double_t* x, __attribute__((unused)) UInt_t dim) const {  
 
   UInt_t i;
   Double_t arg[4]; 
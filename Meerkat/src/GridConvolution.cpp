@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <vector>
+#include <stdlib.h>
+#include <math.h>
+
+#include "TMath.h"
+
+#include "GridEngine.hh"
+#include "GridConvolution.hh"
+
+/// Maximum number of nodes of the padded grid (four arrays of this size are kept in memory)
+#define MAX_FFT_SIZE 33554432
+
+/// Results below this fraction of the maximum are rounding noise of the transform in the nodes
+/// not reached by any kernel, and are not added to the map
+static const Double_t fftNoiseLevel = 1e-12;
+
+GridConvolution::GridConvolution() {
+  m_grid = 0;
+  m_size = 0;
+}
+
+GridConvolution::~GridConvolution() {
+
+}
+
+Bool_t GridConvolution::init(const GridEngine* grid, const Double_t* width) {
+
+  m_grid = grid;
+  UInt_t dim = grid->dimensionality();
+  const UInt_t* binning = grid->binning();
+  const Double_t* invStep = grid->invSteps();
+
+  // Kernel half-width in nodes in each variable. The padded grid has room for the kernels
+  // of the nodes at one edge not to wrap around to the other edge.
+  std::vector<UInt_t> halfWidth(dim);
+  std::vector< std::vector<Double_t> > sq(dim);
+  m_padded.resize(dim);
+  m_stride.resize(dim);
+  ULong64_t size = 1;
+  UInt_t n;
+  for (n=0; n<dim; n++) {
+    Double_t r = width[n]*invStep[n];
+    UInt_t h = (UInt_t)TMath::Floor(r);
+    if (h > binning[n] - 1) h = binning[n] - 1;
+    halfWidth[n] = h;
+
+    UInt_t p = 1;
+    while (p < binning[n] + h) p *= 2;
+    m_padded[n] = p;
+    m_stride[n] = (UInt_t)size;
+    size *= p;
+
+    // Squared scaled distances along this variable, the same as in GridEngine::deposit() for a kernel centred at a node
+    Int_t k;
+    for (k=-(Int_t)h; k<=(Int_t)h; k++) {
+      Double_t dx = (Double_t)k/r;
+      sq[n].push_back( (fabs(dx) < 1.) ? dx*dx : 0. );
+    }
+  }
+
+  if (size > MAX_FFT_SIZE) {
+    m_size = 0;
+    return 0;
+  }
+  m_size = (UInt_t)size;
+
+  // Twiddle factors
+  m_cos.resize(dim);
+  m_sin.resize(dim);
+  for (n=0; n<dim; n++) {
+    UInt_t p = m_padded[n];
+    m_cos[n].resize(p/2);
+    m_sin[n].resize(p/2);
+    UInt_t k;
+    for (k=0; k<p/2; k++) {
+      m_cos[n][k] = cos(2.*TMath::Pi()*(Double_t)k/(Double_t)p);
+      m_sin[n][k] = sin(2.*TMath::Pi()*(Double_t)k/(Double_t)p);
+    }
+  }
+
+  // Kernel on the padded grid, negative offsets wrap around to the upper end
+  m_kernelRe.assign(m_size, 0.);
+  m_kernelIm.assign(m_size, 0.);
+  std::vector<UInt_t> iter(dim, 0);
+  UInt_t footprint = 1;
+  for (n=0; n<dim; n++) footprint *= 2*halfWidth[n] + 1;
+  UInt_t i;
+  for (i=0; i<footprint; i++) {
+    Double_t s = 0.;
+    UInt_t pos = 0;
+    for (n=0; n<dim; n++) {
+      s += sq[n][iter[n]];
+      Int_t k = (Int_t)iter[n] - (Int_t)halfWidth[n];
+      pos += ((k < 0) ? k + m_padded[n] : k)*m_stride[n];
+    }
+    if (s < 1.) m_kernelRe[pos] = 1. - s;
+    for (n=0; n<dim; n++) {
+      if (iter[n] < 2*halfWidth[n]) {
+        iter[n]++;
+        break;
+      }
+      iter[n] = 0;
+    }
+  }
+
+  transform(m_kernelRe, m_kernelIm, -1);
+
+  return 1;
+}
+
+void GridConvolution::convolve(const std::vector<Double_t> &values, std::vector<Double_t> &map) const {
+
+  UInt_t dim = m_grid->dimensionality();
+  const UInt_t* binning = m_grid->binning();
+  UInt_t nodes = m_grid->nodes();
+
+  std::vector<Double_t> re(m_size, 0.);
+  std::vector<Double_t> im(m_size, 0.);
+
+  // Copy the node values into the padded grid
+  std::vector<UInt_t> iter(dim, 0);
+  UInt_t i, n;
+  for (i=0; i<nodes; i++) {
+    UInt_t index = m_grid->iterToIndex(&(iter[0]));
+    UInt_t pos = 0;
+    for (n=0; n<dim; n++) pos += iter[n]*m_stride[n];
+    if (m_grid->isStored(index)) re[pos] = values[index];
+    for (n=0; n<dim; n++) {
+      if (iter[n] < binning[n]-1) {
+        iter[n]++;
+        break;
+      }
+      iter[n] = 0;
+    }
+  }
+
+  // Multiply the transforms
+  transform(re, im, -1);
+  for (i=0; i<m_size; i++) {
+    Double_t a = re[i]*m_kernelRe[i] - im[i]*m_kernelIm[i];
+    Double_t b = re[i]*m_kernelIm[i] + im[i]*m_kernelRe[i];
+    re[i] = a;
+    im[i] = b;
+  }
+  transform(re, im, 1);
+
+  Double_t maxValue = 0.;
+  for (i=0; i<m_size; i++) if (fabs(re[i]) > maxValue) maxValue = fabs(re[i]);
+  Double_t threshold = fftNoiseLevel*maxValue;
+
+  // Add the result in the nodes of the grid to the map
+  for (n=0; n<dim; n++) iter[n] = 0;
+  for (i=0; i<nodes; i++) {
+    UInt_t index = m_grid->iterToIndex(&(iter[0]));
+    UInt_t pos = 0;
+    for (n=0; n<dim; n++) pos += iter[n]*m_stride[n];
+    if (m_grid->isStored(index) && fabs(re[pos]) > threshold) map[index] += re[pos]/(Double_t)m_size;
+    for (n=0; n<dim; n++) {
+      if (iter[n] < binning[n]-1) {
+        iter[n]++;
+        break;
+      }
+      iter[n] = 0;
+    }
+  }
+}
+
+void GridConvolution::transform(std::vector<Double_t> &re, std::vector<Double_t> &im, Int_t sign) const {
+
+  UInt_t dim = m_padded.size();
+  UInt_t n;
+  for (n=0; n<dim; n++) {
+    UInt_t p = m_padded[n];
+    UInt_t stride = m_stride[n];
+    if (p == 1) continue;
+
+    // Each line along the variable is copied into a contiguous buffer, transformed and copied back
+    std::vector<Double_t> lineRe(p);
+    std::vector<Double_t> lineIm(p);
+    UInt_t block, inner, k;
+    for (block=0; block<m_size; block += p*stride) {
+      for (inner=0; inner<stride; inner++) {
+        Double_t* r = &(re[block + inner]);
+        Double_t* m = &(im[block + inner]);
+        for (k=0; k<p; k++) {
+          lineRe[k] = r[k*stride];
+          lineIm[k] = m[k*stride];
+        }
+        transformLine(&(lineRe[0]), &(lineIm[0]), n, sign);
+        for (k=0; k<p; k++) {
+          r[k*stride] = lineRe[k];
+          m[k*stride] = lineIm[k];
+        }
+      }
+    }
+  }
+}
+
+void GridConvolution::transformLine(Double_t* re, Double_t* im, UInt_t var, Int_t sign) const {
+
+  UInt_t p = m_padded[var];
+  const Double_t* c = &(m_cos[var][0]);
+  const Double_t* s = &(m_sin[var][0]);
+
+  // Bit-reversal permutation
+  UInt_t i, j = 0;
+  for (i=0; i<p-1; i++) {
+    if (i < j) {
+      Double_t t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+    UInt_t bit = p >> 1;
+    while (j & bit) {
+      j ^= bit;
+      bit >>= 1;
+    }
+    j |= bit;
+  }
+
+  // Iterative radix-2 butterflies
+  UInt_t len;
+  for (len=2; len<=p; len *= 2) {
+    UInt_t half = len/2;
+    UInt_t step = p/len;
+    UInt_t start;
+    for (start=0; start<p; start += len) {
+      UInt_t k;
+      for (k=0; k<half; k++) {
+        Double_t wr = c[k*step];
+        Double_t wi = sign*s[k*step];
+        UInt_t a = start + k;
+        UInt_t b = a + half;
+        Double_t tr = re[b]*wr - im[b]*wi;
+        Double_t ti = re[b]*wi + im[b]*wr;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
@@ -0,0 +1,720 @@
+#include <stdio.h>
+#include <vector>
+#include <stdlib.h>
+
+#include "TMath.h"
+
+#include "AbsPhaseSpace.hh"
+#include "GridEngine.hh"
+#include "CpuFeatures.hh"
+
+namespace GridKernelsBaseline {
+#include "GridKernels.icc"
+}
+
+#ifdef MEERKAT_CPU_DISPATCH
+
+// The same grid kernels compiled for AVX2 and AVX-512. Contraction into FMA instructions is disabled
+// so that all variants give bitwise identical results.
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")
+namespace GridKernelsAVX2 {
+#include "GridKernels.icc"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+namespace GridKernelsAVX512 {
+#include "GridKernels.icc"
+}
+#pragma GCC pop_options
+
+#endif
+
+/// Tile size of the sparse layout if not given explicitly
+static const UInt_t defaultSparseTileSize = 4;
+
+/// Select the grid functions compiled for the widest instruction set supported by the CPU
+static GridKernels selectKernels(UInt_t dim, UInt_t layout) {
+  switch (CpuFeatures::level()) {
+#ifdef MEERKAT_CPU_DISPATCH
+    case CpuFeatures::kAVX512:
+      return GridKernelsAVX512::kernelTable(dim, layout);
+    case CpuFeatures::kAVX2:
+      return GridKernelsAVX2::kernelTable(dim, layout);
+#endif
+    default:
+      return GridKernelsBaseline::kernelTable(dim, layout);
+  }
+}
+
+GridEngine::GridEngine() {
+  m_dim = 0;
+  m_nodes = 0;
+  m_size = 0;
+  m_tileSize = 0;
+  m_sparse = false;
+  m_layout = kRowMajor;
+  m_tileVolume = 1;
+  m_sharedSize = 0;
+  m_kernels = GridKernelsBaseline::genericKernels();
+}
+
+GridEngine::~GridEngine() {
+
+}
+
+Bool_t GridEngine::init(AbsPhaseSpace* thePhaseSpace, std::vector<UInt_t> &binning, UInt_t tileSize, Bool_t sparse) {
+
+  m_dim = binning.size();
+  m_binning = binning;
+  m_sparse = sparse;
+  m_tileSize = (sparse && tileSize == 0) ? defaultSparseTileSize : tileSize;
+  m_layout = sparse ? kSparse : (m_tileSize > 0 ? kTiled : kRowMajor);
+  m_sharedSize = 0;
+  m_lower.resize(m_dim);
+  m_upper.resize(m_dim);
+  m_step.resize(m_dim);
+  m_invStep.resize(m_dim);
+  m_axisOffset.resize(m_dim);
+
+  m_nodes = 1;
+  UInt_t j, i;
+  for (j=0; j<m_dim; j++) {
+    if (m_binning[j] < 2) return 0;
+    m_lower[j] = thePhaseSpace->lowerLimit(j);
+    m_upper[j] = thePhaseSpace->upperLimit(j);
+    m_step[j] = (m_upper[j] - m_lower[j])/((Double_t)m_binning[j]-1.);
+    m_invStep[j] = ((Double_t)m_binning[j]-1.)/(m_upper[j] - m_lower[j]);
+    m_nodes *= m_binning[j];
+  }
+
+  m_stride.assign(m_dim, 0);
+  m_tileOffset.clear();
+  m_tileBase.clear();
+  m_tileVolume = 1;
+  if (m_tileSize == 0) {
+    // Row-major layout, the 1st variable runs fastest
+    m_size = 1;
+    for (j=0; j<m_dim; j++) {
+      m_stride[j] = m_size;
+      m_axisOffset[j].resize(m_binning[j]);
+      for (i=0; i<m_binning[j]; i++) m_axisOffset[j][i] = i*m_size;
+      m_size *= m_binning[j];
+    }
+  } else {
+    // Tiled layout: the grid is split into hypercubic tiles of tileSize^N nodes stored contiguously.
+    // Both the tiles and the nodes inside each tile are in row-major order. The grid is padded
+    // to a whole number of tiles in each variable, padding entries are never addressed.
+    for (j=0; j<m_dim; j++) m_tileVolume *= m_tileSize;
+    m_size = m_tileVolume;
+    UInt_t localStride = 1;
+    for (j=0; j<m_dim; j++) {
+      UInt_t tileStride = m_size;
+      m_axisOffset[j].resize(m_binning[j]);
+      for (i=0; i<m_binning[j]; i++)
+        m_axisOffset[j][i] = (i/m_tileSize)*tileStride + (i%m_tileSize)*localStride;
+      m_size *= (m_binning[j] + m_tileSize - 1)/m_tileSize;
+      localStride *= m_tileSize;
+    }
+  }
+
+  if (m_sparse) initSparse(thePhaseSpace);
+
+  // Offsets of the cell vertices relative to the lowest vertex, constant in the row-major layout
+  m_vertexOffset.clear();
+  if (m_layout == kRowMajor) {
+    UInt_t vertices = 1u << m_dim;
+    m_vertexOffset.resize(vertices);
+    UInt_t v;
+    for (v=0; v<vertices; v++) {
+      m_vertexOffset[v] = 0;
+      for (j=0; j<m_dim; j++) {
+        if (v & (1u << j)) m_vertexOffset[v] += m_stride[j];
+      }
+    }
+  }
+
+  // Select the implementation specialised for this dimensionality, layout and instruction set
+  m_kernels = selectKernels(m_dim, m_layout);
+
+  return 1;
+}
+
+void GridEngine::initSparse(AbsPhaseSpace* thePhaseSpace) {
+
+  // Tile numbers and offsets inside the tile of the nodes, both row-major
+  std::vector<UInt_t> tiles(m_dim);
+  UInt_t numTiles = 1;
+  UInt_t localStride = 1;
+  UInt_t j, i;
+  m_tileOffset.resize(m_dim);
+  for (j=0; j<m_dim; j++) {
+    tiles[j] = (m_binning[j] + m_tileSize - 1)/m_tileSize;
+    m_tileOffset[j].resize(m_binning[j]);
+    for (i=0; i<m_binning[j]; i++) {
+      m_tileOffset[j][i] = (i/m_tileSize)*numTiles;
+      m_axisOffset[j][i] = (i%m_tileSize)*localStride;
+    }
+    numTiles *= tiles[j];
+    localStride *= m_tileSize;
+  }
+
+  // Flags of the nodes inside the phase space in the logical order (1st variable runs fastest)
+  std::vector<Char_t> inside(m_nodes, 0);
+  std::vector<UInt_t> iter(m_dim, 0);
+  std::vector<Double_t> x(m_dim);
+  UInt_t n;
+  for (n=0; n<m_nodes; n++) {
+    for (j=0; j<m_dim; j++) x[j] = nodeCoordinate(j, iter[j]);
+    inside[n] = thePhaseSpace->withinLimits(&(x[0]), m_dim);
+    for (j=0; j<m_dim; j++) {
+      if (iter[j] < m_binning[j]-1) {
+        iter[j]++;
+        break;
+      }
+      iter[j] = 0;
+    }
+  }
+
+  // Logical offsets of the cell vertices relative to the lowest vertex
+  UInt_t vertices = 1u << m_dim;
+  std::vector<UInt_t> vertexOffset(vertices, 0);
+  UInt_t v;
+  for (v=0; v<vertices; v++) {
+    UInt_t stride = 1;
+    for (j=0; j<m_dim; j++) {
+      if (v & (1u << j)) vertexOffset[v] += stride;
+      stride *= m_binning[j];
+    }
+  }
+
+  // A cell intersects the phase space if one of its vertices or its centre is inside. The tiles of the nodes 
+  // used by the interpolation of such a cell (from one node below to two nodes above it, as in the cubic 
+  // interpolation) are marked. 
+  std::vector<Char_t> needed(numTiles, 0);
+  std::vector<UInt_t> first(m_dim);
+  std::vector<UInt_t> last(m_dim);
+  std::vector<UInt_t> tile(m_dim);
+  for (j=0; j<m_dim; j++) iter[j] = 0;
+  do {
+    UInt_t lowest = 0;
+    UInt_t stride = 1;
+    for (j=0; j<m_dim; j++) {
+      lowest += iter[j]*stride;
+      stride *= m_binning[j];
+    }
+    Bool_t intersects = 0;
+    for (v=0; v<vertices && !intersects; v++) intersects = inside[lowest + vertexOffset[v]];
+    if (!intersects) {
+      for (j=0; j<m_dim; j++) x[j] = nodeCoordinate(j, iter[j]) + 0.5*m_step[j];
+      intersects = thePhaseSpace->withinLimits(&(x[0]), m_dim);
+    }
+    if (intersects) {
+      for (j=0; j<m_dim; j++) {
+        first[j] = ((iter[j] > 0) ? iter[j]-1 : 0)/m_tileSize;
+        last[j] = TMath::Min(iter[j]+2, m_binning[j]-1)/m_tileSize;
+        tile[j] = first[j];
+      }
+      do {
+        UInt_t index = 0;
+        for (j=m_dim; j>0; j--) index = index*tiles[j-1] + tile[j-1];
+        needed[index] = 1;
+        for (j=0; j<m_dim; j++) {
+          if (tile[j] < last[j]) {
+            tile[j]++;
+            break;
+          }
+          tile[j] = first[j];
+        }
+      } while (j < m_dim);
+    }
+    for (j=0; j<m_dim; j++) {
+      if (iter[j] < m_binning[j]-2) {
+        iter[j]++;
+        break;
+      }
+      iter[j] = 0;
+    }
+  } while (j < m_dim);
+
+  // The stored tiles follow the shared zero tile
+  m_tileBase.assign(numTiles, 0);
+  m_size = m_tileVolume;
+  for (i=0; i<numTiles; i++) {
+    if (!needed[i]) continue;
+    m_tileBase[i] = m_size;
+    m_size += m_tileVolume;
+  }
+  m_sharedSize = m_tileVolume;
+}
+
+Double_t GridEngine::interpolateGradient(const std::vector<Double_t> &map, const Double_t* x, Double_t* grad) const {
+  Double_t value;
+  if (m_kernels.gradient(*this, &(map[0]), x, &value, grad)) return value;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) grad[j] = 0.;
+  return 0.;
+}
+
+Double_t GridEngine::interpolate(const GridMap &map, const Double_t* x) const {
+  switch (map.precision()) {
+    case GridMap::kFloat:
+      return m_kernels.interpolateFloat(*this, map.floatData(), x);
+    case GridMap::kShort: {
+      // Interpolation weights sum up to 1, so the offset and scale can be applied after the interpolation
+      UInt_t j;
+      for (j=0; j<m_dim; j++) if (x[j] < m_lower[j] || x[j] > m_upper[j]) return 0.;
+      return map.offset() + map.scale()*m_kernels.interpolateShort(*this, map.shortData(), x);
+    }
+    default:
+      return m_kernels.interpolate(*this, map.doubleData(), x);
+  }
+}
+
+Bool_t GridEngine::interpolate(const GridMap &map1, const GridMap &map2, const Double_t* x,
+                               Double_t* value1, Double_t* value2) const {
+  switch (map1.precision()) {
+    case GridMap::kFloat:
+      return m_kernels.interpolate2Float(*this, map1.floatData(), map2.floatData(), x, value1, value2);
+    case GridMap::kShort:
+      if (!m_kernels.interpolate2Short(*this, map1.shortData(), map2.shortData(), x, value1, value2)) return 0;
+      *value1 = map1.offset() + map1.scale()*(*value1);
+      *value2 = map2.offset() + map2.scale()*(*value2);
+      return 1;
+    default:
+      return m_kernels.interpolate2(*this, map1.doubleData(), map2.doubleData(), x, value1, value2);
+  }
+}
+
+Double_t GridEngine::interpolateGradient(const GridMap &map, const Double_t* x, Double_t* grad) const {
+  Double_t value;
+  Bool_t inside;
+  UInt_t j;
+  switch (map.precision()) {
+    case GridMap::kFloat:
+      inside = m_kernels.gradientFloat(*this, map.floatData(), x, &value, grad);
+      break;
+    case GridMap::kShort:
+      inside = m_kernels.gradientShort(*this, map.shortData(), x, &value, grad);
+      if (inside) {
+        value = map.offset() + map.scale()*value;
+        for (j=0; j<m_dim; j++) grad[j] *= map.scale();
+      }
+      break;
+    default:
+      inside = m_kernels.gradient(*this, map.doubleData(), x, &value, grad);
+  }
+  if (inside) return value;
+  for (j=0; j<m_dim; j++) grad[j] = 0.;
+  return 0.;
+}
+
+/// Maximum dimensionality for the cubic interpolation
+#define MAX_CUBIC_DIM 16
+
+/// Accessor of the maps stored in double precision for the cubic interpolation
+struct CubicDoubleMap {
+  const Double_t* data;
+  Double_t operator()(UInt_t index) const { return data[index]; }
+};
+
+/// Accessor of the maps stored with reduced precision for the cubic interpolation
+struct CubicPackedMap {
+  const GridMap* map;
+  Double_t operator()(UInt_t index) const { return map->value(index); }
+};
+
+/// Catmull-Rom weights of the nodes c-1, c, c+1, c+2 and their derivatives over the fractional position t.
+/// A missing node beyond the grid edge is replaced by the linear extrapolation of the two edge nodes,
+/// so its weight is moved to them.
+static void cubicWeights(Double_t t, UInt_t c, UInt_t bins, Double_t* w, Double_t* dw) {
+  Double_t t2 = t*t;
+  Double_t t3 = t2*t;
+  w[0] = 0.5*(-t3 + 2.*t2 - t);
+  w[1] = 0.5*(3.*t3 - 5.*t2 + 2.);
+  w[2] = 0.5*(-3.*t3 + 4.*t2 + t);
+  w[3] = 0.5*(t3 - t2);
+  dw[0] = 0.5*(-3.*t2 + 4.*t - 1.);
+  dw[1] = 0.5*(9.*t2 - 10.*t);
+  dw[2] = 0.5*(-9.*t2 + 8.*t + 1.);
+  dw[3] = 0.5*(3.*t2 - 2.*t);
+  if (c == 0) {
+    w[1] += 2.*w[0];
+    w[2] -= w[0];
+    w[0] = 0.;
+    dw[1] += 2.*dw[0];
+    dw[2] -= dw[0];
+    dw[0] = 0.;
+  }
+  if (c+2 >= bins) {
+    w[2] += 2.*w[3];
+    w[1] -= w[3];
+    w[3] = 0.;
+    dw[2] += 2.*dw[3];
+    dw[1] -= dw[3];
+    dw[3] = 0.;
+  }
+}
+
+/// Tensor-product sum over the 4 nodes in the variables var, var-1, ..., 0 of one or more maps.
+/// The sums are done in the nested order, so the number of operations is about 4^N.
+/// In the sparse layout the tile index is summed separately and converted to the tile base at the last variable.
+template<class Map>
+static void cubicSum(const Map* maps, UInt_t numMaps, Int_t var, UInt_t base, UInt_t tile,
+                     const UInt_t (*address)[4], const UInt_t (*tileAddress)[4], const UInt_t* tileBase,
+                     const Double_t* const* weight, Double_t* sum) {
+  UInt_t m, k;
+  for (m=0; m<numMaps; m++) sum[m] = 0.;
+  for (k=0; k<4; k++) {
+    Double_t w = weight[var][k];
+    if (w == 0.) continue;
+    UInt_t pos = base + address[var][k];
+    UInt_t t = tile + tileAddress[var][k];
+    if (var == 0) {
+      if (tileBase) pos += tileBase[t];
+      for (m=0; m<numMaps; m++) sum[m] += w*maps[m](pos);
+    } else {
+      Double_t sub[2];
+      cubicSum(maps, numMaps, var-1, pos, t, address, tileAddress, tileBase, weight, sub);
+      for (m=0; m<numMaps; m++) sum[m] += w*sub[m];
+    }
+  }
+}
+
+/// Catmull-Rom interpolation of up to two maps and, optionally, the gradient of the first one
+template<class Map>
+static Bool_t cubicInterpolate(const GridEngine &grid, const Map* maps, UInt_t numMaps, const Double_t* x,
+                               Double_t* value, Double_t* grad) {
+  UInt_t dim = grid.dimensionality();
+  if (dim > MAX_CUBIC_DIM) {
+    printf("%20.20s ERROR: Cubic interpolation is limited to %d dimensions\n", "GridEngine", MAX_CUBIC_DIM);
+    abort();
+  }
+
+  UInt_t cell[MAX_CUBIC_DIM];
+  Double_t frac[MAX_CUBIC_DIM];
+  if (!grid.locate(x, cell, frac)) return 0;
+
+  UInt_t address[MAX_CUBIC_DIM][4];
+  UInt_t tileAddress[MAX_CUBIC_DIM][4];
+  Double_t w[MAX_CUBIC_DIM][4];
+  Double_t dw[MAX_CUBIC_DIM][4];
+  const Double_t* weight[MAX_CUBIC_DIM];
+  Bool_t sparse = (grid.layout() == GridEngine::kSparse);
+  const UInt_t* tileBase = sparse ? grid.tileBases() : 0;
+  UInt_t j, k;
+  for (j=0; j<dim; j++) {
+    UInt_t bins = grid.bins(j);
+    const UInt_t* offset = grid.axisOffsets(j);
+    const UInt_t* tileOffset = sparse ? grid.tileOffsets(j) : 0;
+    cubicWeights(frac[j], cell[j], bins, w[j], dw[j]);
+    for (k=0; k<4; k++) {
+      Int_t i = (Int_t)cell[j] - 1 + (Int_t)k;
+      if (i < 0) i = 0;
+      if (i > (Int_t)bins-1) i = bins-1;
+      address[j][k] = offset[i];
+      tileAddress[j][k] = sparse ? tileOffset[i] : 0;
+    }
+    weight[j] = w[j];
+  }
+
+  cubicSum(maps, numMaps, dim-1, 0, 0, address, tileAddress, tileBase, weight, value);
+
+  if (grad) {
+    const Double_t* invStep = grid.invSteps();
+    for (j=0; j<dim; j++) {
+      weight[j] = dw[j];
+      cubicSum(maps, 1, dim-1, 0, 0, address, tileAddress, tileBase, weight, &(grad[j]));
+      grad[j] *= invStep[j];
+      weight[j] = w[j];
+    }
+  }
+  return 1;
+}
+
+Double_t GridEngine::interpolateCubic(const std::vector<Double_t> &map, const Double_t* x) const {
+  CubicDoubleMap m = { &(map[0]) };
+  Double_t value;
+  return cubicInterpolate(*this, &m, 1, x, &value, 0) ? value : 0.;
+}
+
+Double_t GridEngine::interpolateCubic(const GridMap &map, const Double_t* x) const {
+  CubicPackedMap m = { &map };
+  Double_t value;
+  return cubicInterpolate(*this, &m, 1, x, &value, 0) ? value : 0.;
+}
+
+Bool_t GridEngine::interpolateCubic(const std::vector<Double_t> &map1, const std::vector<Double_t> &map2, const Double_t* x,
+                                    Double_t* value1, Double_t* value2) const {
+  CubicDoubleMap m[2] = { { &(map1[0]) }, { &(map2[0]) } };
+  Double_t value[2];
+  if (!cubicInterpolate(*this, m, 2, x, value, 0)) return 0;
+  *value1 = value[0];
+  *value2 = value[1];
+  return 1;
+}
+
+Bool_t GridEngine::interpolateCubic(const GridMap &map1, const GridMap &map2, const Double_t* x,
+                                    Double_t* value1, Double_t* value2) const {
+  CubicPackedMap m[2] = { { &map1 }, { &map2 } };
+  Double_t value[2];
+  if (!cubicInterpolate(*this, m, 2, x, value, 0)) return 0;
+  *value1 = value[0];
+  *value2 = value[1];
+  return 1;
+}
+
+Double_t GridEngine::interpolateCubicGradient(const std::vector<Double_t> &map, const Double_t* x, Double_t* grad) const {
+  CubicDoubleMap m = { &(map[0]) };
+  Double_t value;
+  if (cubicInterpolate(*this, &m, 1, x, &value, grad)) return value;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) grad[j] = 0.;
+  return 0.;
+}
+
+Double_t GridEngine::interpolateCubicGradient(const GridMap &map, const Double_t* x, Double_t* grad) const {
+  CubicPackedMap m = { &map };
+  Double_t value;
+  if (cubicInterpolate(*this, &m, 1, x, &value, grad)) return value;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) grad[j] = 0.;
+  return 0.;
+}
+
+UInt_t GridEngine::iterToIndex(const UInt_t* iter) const {
+  UInt_t index = 0;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) index += m_axisOffset[j][iter[j]];
+  if (m_layout == kSparse) {
+    UInt_t tile = 0;
+    for (j=0; j<m_dim; j++) tile += m_tileOffset[j][iter[j]];
+    index += m_tileBase[tile];
+  }
+  return index;
+}
+
+Double_t GridEngine::nodeArea(UInt_t var, UInt_t i) const {
+  // Integral of the hat function of the node: half width for the edge nodes
+  if (i == 0 || i == m_binning[var]-1) return 0.5*m_step[var];
+  return m_step[var];
+}
+
+Bool_t GridEngine::sameNodes(const GridEngine &grid) const {
+  if (grid.m_dim != m_dim) return 0;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) {
+    if (grid.m_binning[j] != m_binning[j] || grid.m_lower[j] != m_lower[j] || grid.m_upper[j] != m_upper[j]) return 0;
+  }
+  return 1;
+}
+
+void GridEngine::convert(const GridEngine &source, const std::vector<Double_t> &sourceMap,
+                         std::vector<Double_t> &map) const {
+
+  map.assign(m_size, 0.);
+
+  std::vector<UInt_t> iter(m_dim, 0);
+  UInt_t n, j;
+  for (n=0; n<m_nodes; n++) {
+    UInt_t index = iterToIndex(&(iter[0]));
+    if (isStored(index)) map[index] = sourceMap[source.iterToIndex(&(iter[0]))];
+    for (j=0; j<m_dim; j++) {
+      if (iter[j] < m_binning[j]-1) {
+        iter[j]++;
+        break;
+      }
+      iter[j] = 0;
+    }
+  }
+}
+
+/// Maximum dimensionality of the linear binning (the point is distributed between 2^N vertices)
+#define MAX_SCATTER_DIM 16
+
+Bool_t GridEngine::scatter(std::vector<Double_t> &map, const Double_t* point, Double_t weight) const {
+
+  if (m_dim > MAX_SCATTER_DIM) {
+    printf("%20.20s ERROR: Linear binning is limited to %d dimensions\n", "GridEngine", MAX_SCATTER_DIM);
+    abort();
+  }
+
+  UInt_t cell[MAX_SCATTER_DIM];
+  Double_t frac[MAX_SCATTER_DIM];
+  UInt_t iter[MAX_SCATTER_DIM];
+  if (!locate(point, cell, frac)) return 0;
+
+  // The weights are the same as in the multilinear interpolation, so the binning is its transpose
+  UInt_t numVertices = 1 << m_dim;
+  UInt_t v, j;
+  for (v=0; v<numVertices; v++) {
+    Double_t w = weight;
+    for (j=0; j<m_dim; j++) {
+      if ((v >> j) & 1) {
+        iter[j] = cell[j] + 1;
+        w *= frac[j];
+      } else {
+        iter[j] = cell[j];
+        w *= 1. - frac[j];
+      }
+    }
+    UInt_t index = iterToIndex(iter);
+    if (isStored(index)) map[index] += w;
+  }
+  return 1;
+}
+
+/// Maximum dimensionality of the check of the cell vertices in the sparse layout
+#define MAX_SPARSE_DIM 16
+
+Bool_t GridEngine::cellStored(const Double_t* x) const {
+
+  if (m_layout != kSparse) return 1;
+  if (m_dim > MAX_SPARSE_DIM) {
+    printf("%20.20s ERROR: Sparse layout check is limited to %d dimensions\n", "GridEngine", MAX_SPARSE_DIM);
+    abort();
+  }
+
+  UInt_t cell[MAX_SPARSE_DIM];
+  Double_t frac[MAX_SPARSE_DIM];
+  UInt_t vertex[MAX_SPARSE_DIM];
+  if (!locate(x, cell, frac)) return 1;
+
+  UInt_t vertices = 1u << m_dim;
+  UInt_t v, j;
+  for (v=0; v<vertices; v++) {
+    for (j=0; j<m_dim; j++) vertex[j] = cell[j] + ((v >> j) & 1);
+    if (!isStored(iterToIndex(vertex))) return 0;
+  }
+  return 1;
+}
+
+void GridEngine::cumulate(const std::vector<Double_t> &map, std::vector<Double_t> &table) const {
+
+  if (m_layout == kSparse) {
+    printf("%20.20s ERROR: Summed-volume table is not available in the sparse layout\n", "GridEngine");
+    abort();
+  }
+
+  table.assign(m_size, 0.);
+
+  // Weight each node by the integral of its N-dimensional hat function
+  std::vector<UInt_t> iter(m_dim, 0);
+  UInt_t n, index, j, k;
+  for (n=0; n<m_nodes; n++) {
+    index = iterToIndex(&(iter[0]));
+    Double_t w = 1.;
+    for (j=0; j<m_dim; j++) w *= nodeArea(j, iter[j]);
+    table[index] = w*map[index];
+    for (j=0; j<m_dim; j++) {
+      if (iter[j] < m_binning[j]-1) {
+        iter[j]++;
+        break;
+      }
+      iter[j] = 0;
+    }
+  }
+
+  // Prefix sums along each variable in turn. Nodes are visited in the logical order,
+  // so the previous node in the variable is always summed before the current one.
+  for (k=0; k<m_dim; k++) {
+    const UInt_t* offset = &(m_axisOffset[k][0]);
+    for (n=0; n<m_nodes; n++) {
+      if (iter[k] > 0) {
+        index = iterToIndex(&(iter[0]));
+        table[index] += table[index - offset[iter[k]] + offset[iter[k]-1]];
+      }
+      for (j=0; j<m_dim; j++) {
+        if (iter[j] < m_binning[j]-1) {
+          iter[j]++;
+          break;
+        }
+        iter[j] = 0;
+      }
+    }
+  }
+}
+
+/// Add the coefficients of the prefix table in one variable that give the integral
+/// of the interpolant from the lower grid limit to x, multiplied by sign
+void GridEngine::cumulativeCoefficients(UInt_t var, Double_t x, Double_t sign,
+                                        std::vector<Int_t> &index, std::vector<Double_t> &coeff) const {
+  UInt_t bins = m_binning[var];
+  Double_t t = (x - m_lower[var])*m_invStep[var];
+  if (t <= 0.) return;
+  Int_t c = (Int_t)t;
+  if (c >= (Int_t)bins-1) c = bins-2;
+  Double_t f = t - (Double_t)c;
+  Double_t h = m_step[var];
+
+  // x lies between nodes c and c+1: nodes below c are integrated fully,
+  // node c up to u, node c+1 up to w
+  Double_t u = ((c > 0) ? 0.5*h : 0.) + h*(f - 0.5*f*f);
+  Double_t w = 0.5*h*f*f;
+  Double_t ac = nodeArea(var, c);
+  Double_t ac1 = nodeArea(var, c+1);
+
+  Double_t coeffs[3] = { 1. - u/ac, u/ac - w/ac1, w/ac1 };
+  Int_t k;
+  for (k=0; k<3; k++) {
+    Int_t i = c - 1 + k;
+    if (i < 0 || coeffs[k] == 0.) continue;
+    UInt_t n;
+    for (n=0; n<index.size(); n++) if (index[n] == i) break;
+    if (n == index.size()) {
+      index.push_back(i);
+      coeff.push_back(0.);
+    }
+    coeff[n] += sign*coeffs[k];
+  }
+}
+
+Double_t GridEngine::integrate(const std::vector<Double_t> &table, const Double_t* lower, const Double_t* upper) const {
+
+  if (m_layout == kSparse) {
+    printf("%20.20s ERROR: Summed-volume table is not available in the sparse layout\n", "GridEngine");
+    abort();
+  }
+
+  // Per-variable lists of prefix table nodes and their coefficients
+  std::vector< std::vector<Int_t> > index(m_dim);
+  std::vector< std::vector<Double_t> > coeff(m_dim);
+
+  UInt_t j;
+  for (j=0; j<m_dim; j++) {
+    Double_t a = TMath::Max(lower[j], m_lower[j]);
+    Double_t b = TMath::Min(upper[j], m_upper[j]);
+    if (a >= b) return 0.;
+    cumulativeCoefficients(j, b, 1., index[j], coeff[j]);
+    cumulativeCoefficients(j, a, -1., index[j], coeff[j]);
+    if (index[j].size() == 0) return 0.;
+  }
+
+  // Sum over all combinations of the per-variable nodes
+  std::vector<UInt_t> iter(m_dim, 0);
+  Double_t sum = 0.;
+  do {
+    Double_t c = 1.;
+    UInt_t pos = 0;
+    for (j=0; j<m_dim; j++) {
+      c *= coeff[j][iter[j]];
+      pos += m_axisOffset[j][index[j][iter[j]]];
+    }
+    sum += c*table[pos];
+
+    for (j=0; j<m_dim; j++) {
+      if (iter[j] < index[j].size()-1) {
+        iter[j]++;
+        break;
+      }
+      iter[j] = 0;
+    }
+    if (j == m_dim) break;
+  } while(1);
+
+  return sum;
+}
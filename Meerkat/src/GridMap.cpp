@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <vector>
+#include <stdlib.h>
+
+#include "TMath.h"
+
+#include "GridMap.hh"
+
+GridMap::GridMap() {
+  m_precision = kDouble;
+  m_size = 0;
+  m_offset = 0.;
+  m_scale = 0.;
+}
+
+GridMap::~GridMap() {
+
+}
+
+void GridMap::setPrecision(Precision precision) {
+  clear();
+  m_precision = precision;
+}
+
+void GridMap::clear() {
+  std::vector<Double_t>().swap(m_double);
+  std::vector<Float_t>().swap(m_float);
+  std::vector<UShort_t>().swap(m_short);
+  m_size = 0;
+  m_offset = 0.;
+  m_scale = 0.;
+}
+
+void GridMap::pack(const std::vector<Double_t> &values) {
+
+  clear();
+  m_size = values.size();
+
+  UInt_t i;
+  if (m_precision == kDouble) {
+    m_double = values;
+  } else if (m_precision == kFloat) {
+    m_float.resize(m_size);
+    for (i=0; i<m_size; i++) m_float[i] = (Float_t)values[i];
+  } else {
+    // The range always includes zero, so that the empty nodes of a non-negative map stay exactly zero
+    Double_t minValue = 0.;
+    Double_t maxValue = 0.;
+    for (i=0; i<m_size; i++) {
+      if (values[i] < minValue) minValue = values[i];
+      if (values[i] > maxValue) maxValue = values[i];
+    }
+    m_offset = minValue;
+    m_scale = (maxValue - minValue)/65535.;
+    m_short.resize(m_size);
+    for (i=0; i<m_size; i++) {
+      if (m_scale <= 0.) {
+        m_short[i] = 0;
+        continue;
+      }
+      Double_t q = TMath::Floor((values[i] - m_offset)/m_scale + 0.5);
+      if (q < 0.) q = 0.;
+      if (q > 65535.) q = 65535.;
+      m_short[i] = (UShort_t)q;
+    }
+  }
+}
+
+void GridMap::unpack(std::vector<Double_t> &values) const {
+  values.resize(m_size);
+  UInt_t i;
+  for (i=0; i<m_size; i++) values[i] = value(i);
+}
+
+ULong64_t GridMap::bytes() const {
+  if (m_precision == kFloat) return (ULong64_t)m_size*sizeof(Float_t);
+  if (m_precision == kShort) return (ULong64_t)m_size*sizeof(UShort_t);
+  return (ULong64_t)m_size*sizeof(Double_t);
+}
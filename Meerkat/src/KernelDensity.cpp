@@ -8,6 +8,55 @@
 #include "AbsPhaseSpace.hh"
 #include "AbsDensity.hh"
 #include "KernelDensity.hh"
+#include "CpuFeatures.hh"
+
+namespace KernelSumBaseline {
+#include "KernelSum.icc"
+}
+
+#ifdef MEERKAT_CPU_DISPATCH
+
+// AVX2 and AVX-512 variants, without FMA contraction to keep the sums identical to the baseline ones
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")
+namespace KernelSumAVX2 {
+#include "KernelSum.icc"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+namespace KernelSumAVX512 {
+#include "KernelSum.icc"
+}
+#pragma GCC pop_options
+
+#endif
+
+typedef Double_t (*KernelSumFunc)(Double_t sum, UInt_t size, UInt_t dim, const Double_t* const* coords, 
+                                  const Double_t* x, const Double_t* width); 
+
+/// Select the kernel sum compiled for the widest instruction set supported by the CPU
+static KernelSumFunc selectKernelSum(void) {
+  switch (CpuFeatures::level()) {
+#ifdef MEERKAT_CPU_DISPATCH
+    case CpuFeatures::kAVX512: 
+      return KernelSumAVX512::kernelSum; 
+    case CpuFeatures::kAVX2: 
+      return KernelSumAVX2::kernelSum; 
+#endif
+    default: 
+      return KernelSumBaseline::kernelSum; 
+  }
+}
+
+/// Append a point to a cell
+static void addToCell(TCell &cell, const std::vector<Double_t> &point) {
+  UInt_t var; 
+  for (var=0; var<point.size(); var++) cell[var].push_back(point[var]); 
+}
 
 KernelDensity::KernelDensity(const char* pdfname, 
                   AbsPhaseSpace* thephaseSpace, 
@@ -130,11 +179,12 @@ Bool_t KernelDensity::generateApproximation(UInt_t apprSize) {
   
   UInt_t cells = numCells(); 
   
-  m_apprVector.resize(cells); 
+  m_apprVector.assign(cells, TCell(dimensionality)); 
   
   Int_t cell;
+  UInt_t j; 
   for (cell = 0; cell < (Int_t)cells; cell++)
-    m_apprVector[cell].reserve(apprSize/cells); 
+    for (j = 0; j < dimensionality; j++) m_apprVector[cell][j].reserve(apprSize/cells); 
 
   std::vector<Double_t> point(dimensionality); 
 
@@ -172,9 +222,9 @@ Bool_t KernelDensity::generateApproximation(UInt_t apprSize) {
       m_approxDensity->generate(point); 
     }
 
-    cell = cellIndex(point); 
+    cell = cellIndex(&(point[0])); 
     if (cell < (Int_t)cells && cell >= 0)
-      m_apprVector[cell].push_back(point); 
+      addToCell(m_apprVector[cell], point); 
     else if (cell > 0) {
       printf("%20.20s WARNING: cell number %d exceeds vector size %d\n", m_name, cell, cells); 
       abort(); 
@@ -293,26 +343,21 @@ UInt_t KernelDensity::numCells(void) {
   return cells; 
 }
 
-Int_t KernelDensity::cellIndex(std::vector<Double_t>& x) {
+Int_t KernelDensity::cellIndex(const Double_t* x) const {
 
-  UInt_t dim = phaseSpace()->dimensionality(); 
+  UInt_t dim = m_phaseSpace->dimensionality(); 
 
   UInt_t i; 
   UInt_t cell = 0;
   for (i = 0; i<dim; i++) {
-    Double_t lower = phaseSpace()->lowerLimit(i); 
-    Double_t upper = phaseSpace()->upperLimit(i); 
+    Double_t lower = m_phaseSpace->lowerLimit(i); 
+    Double_t upper = m_phaseSpace->upperLimit(i); 
 
     Double_t xi = x[i];
     if (xi < lower || xi > upper) {
       return -1;
     }
 
-    if (i<dim-1) { 
-      Int_t dimCells = TMath::Ceil( (upper-lower)/m_width[i+1] ); 
-      cell *= dimCells;
-    }
-
     Int_t dimCells = TMath::Ceil( (upper-lower)/m_width[i] ); 
     Int_t dimCell  = TMath::Floor( (xi-lower)/m_width[i] ); 
     if (dimCell == dimCells) dimCell--;
@@ -327,6 +372,11 @@ Int_t KernelDensity::cellIndex(std::vector<Double_t>& x) {
 //      printf("DEBUG: CellIndex = %d, lower=%f, upper=%f, x=%f, width=%f\n", dimCell, lower, upper, xi, m_width[i]); 
 
     cell += dimCell; 
+
+    if (i<dim-1) { 
+      Int_t nextCells = TMath::Ceil( (m_phaseSpace->upperLimit(i+1)-m_phaseSpace->lowerLimit(i+1))/m_width[i+1] ); 
+      cell *= nextCells;
+    }
   }
 
   return cell; 
@@ -367,11 +417,11 @@ Bool_t KernelDensity::readTuple(TTree* tree, std::vector<TString> &vars, UInt_t
 
   UInt_t cells = numCells(); 
 
-  m_dataVector.resize(cells); 
+  m_dataVector.resize(cells, TCell(nvars)); 
   
   Int_t cell; 
   for (cell = 0; cell < (Int_t)cells; cell++) {
-    m_dataVector[cell].reserve(nentries/cells); 
+    for (n=0; n < nvars; n++) m_dataVector[cell][n].reserve(nentries/cells); 
   }
 
   UInt_t nout = 0;
@@ -392,8 +442,8 @@ Bool_t KernelDensity::readTuple(TTree* tree, std::vector<TString> &vars, UInt_t
       }
       printf(", %f%%) outside phase space\n", 100.*float(nout)/float(i));
     } else {
-      cell = cellIndex( point ); 
-      if (cell>=0) m_dataVector[cell].push_back(point); 
+      cell = cellIndex( &(point[0]) ); 
+      if (cell>=0) addToCell(m_dataVector[cell], point); 
     }
     
     if (i % 10000 == 0) {
@@ -406,13 +456,16 @@ Bool_t KernelDensity::readTuple(TTree* tree, std::vector<TString> &vars, UInt_t
   return 1;
 }
 
-Double_t KernelDensity::rawDensity(std::vector<Double_t> &x, std::vector<TCell> &vector) {
+Double_t KernelDensity::rawDensity(const Double_t* x, const std::vector<TCell> &vector) const {
 
 //  UInt_t cells = numCells(); 
 
   UInt_t dim = m_phaseSpace->dimensionality(); 
 
-  std::vector<UInt_t> iter(dim); 
+  std::vector<Int_t> iter(dim); 
+  std::vector<Double_t> point(dim); 
+  std::vector<const Double_t*> coords(dim); 
+  KernelSumFunc kernelSum = selectKernelSum(); 
   
   UInt_t j;
   for (j=0; j<dim; j++) {
@@ -430,12 +483,11 @@ Double_t KernelDensity::rawDensity(std::vector<Double_t> &x, std::vector<TCell>
 //    }
 //    printf("\n"); 
 
-    std::vector<Double_t> point(dim); 
     for (j=0; j<dim; j++) {
       point[j] = x[j] + iter[j]*m_width[j]; 
     }
 
-    Int_t cell = cellIndex(point); 
+    Int_t cell = cellIndex(&(point[0])); 
 
     //// !!!!!! Check if the cell is unique! 
 
@@ -443,20 +495,11 @@ Double_t KernelDensity::rawDensity(std::vector<Double_t> &x, std::vector<TCell>
 
     if (cell >= 0) {
 
-      UInt_t size = vector[cell].size(); 
-
-      for (UInt_t i=0; i<size; i++) {
-        Double_t sqsum = 0.;
-        for (UInt_t var=0; var < dim; var++) {
-          Double_t dx = (vector[cell][i][var] - x[var])/m_width[var];
-          if (TMath::Abs(dx) < 1.) {
-            sqsum += dx*dx;
-          } else {
-            sqsum = 1.;
-            break;
-          }
-        }
-        if (sqsum < 1.) d += (1.-sqsum); 
+      UInt_t size = vector[cell][0].size(); 
+
+      if (size > 0) {
+        for (j=0; j<dim; j++) coords[j] = &(vector[cell][j][0]); 
+        d = kernelSum(d, size, dim, &(coords[0]), x, &(m_width[0])); 
       }
 
     } // if cell >= 0
@@ -480,7 +523,7 @@ Double_t KernelDensity::rawDensity(std::vector<Double_t> &x, std::vector<TCell>
   return d;
 }
 
-Double_t KernelDensity::density(std::vector<Double_t> &x) {
+Double_t KernelDensity::density(const Double_t* x, UInt_t dim) const {
 
   Double_t rawData = rawDensity(x, m_dataVector);
   Double_t rawNorm = rawDensity(x, m_apprVector);
@@ -492,7 +535,7 @@ Double_t KernelDensity::density(std::vector<Double_t> &x) {
 
   Double_t corrEff = rawData/rawNorm; 
   if (m_approxDensity) {
-    corrEff *= m_approxDensity->density(x); 
+    corrEff *= m_approxDensity->density(x, dim); 
   }
 
 //  printf("DEBUG: %f %f %f %f\n", x[0], rawData, rawNorm, corrEff);
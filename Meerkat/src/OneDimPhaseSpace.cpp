@@ -31,7 +31,7 @@ OneDimPhaseSpace::~OneDimPhaseSpace() {
 
 }
 
-Bool_t OneDimPhaseSpace::withinLimits(std::vector<Double_t> &x) {
+Bool_t OneDimPhaseSpace::withinLimits(const Double_t* x, __attribute__((unused)) UInt_t dim) const {
   Double_t x1 = x[0];
 //  if (x1 > m_upperLimit + TOLERANCE || x1 < m_lowerLimit - TOLERANCE) return 0;
   if (x1 > m_upperLimit || x1 < m_lowerLimit) return 0;
@@ -53,8 +53,9 @@ Double_t OneDimPhaseSpace::upperLimit(UInt_t var) {
 
 }
 
-Bool_t OneDimPhaseSpace::limits(UInt_t var, __attribute__((unused)) std::vector<Double_t> &x, 
-                              Double_t* lower, Double_t* upper) {
+Bool_t OneDimPhaseSpace::limits(UInt_t var, __attribute__((unused)) const Double_t* x, 
+                                __attribute__((unused)) UInt_t dim, 
+                                Double_t* lower, Double_t* upper) const {
 
   if (var == 0) {
     *lower = m_lowerLimit;
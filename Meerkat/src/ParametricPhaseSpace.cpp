@@ -49,10 +49,10 @@ ParametricPhaseSpace::~ParametricPhaseSpace() {
 
 }
 
-Bool_t ParametricPhaseSpace::withinLimits(std::vector<Double_t> &x) {
+Bool_t ParametricPhaseSpace::withinLimits(const Double_t* x, __attribute__((unused)) UInt_t dim) const {
   Double_t x1 = x[m_dim-1];
   if (x1 > m_upperLimit || x1 < m_lowerLimit) return 0;
-  if (m_phaseSpace->withinLimits(x) == 0) return 0; 
+  if (m_phaseSpace->withinLimits(x, m_dim-1) == 0) return 0; 
   
   Double_t arg[4]; 
   UInt_t i; 
@@ -88,10 +88,10 @@ Double_t ParametricPhaseSpace::upperLimit(UInt_t var) {
 
 }
 
-Bool_t ParametricPhaseSpace::limits(UInt_t var, std::vector<Double_t> &x, 
-                              Double_t* lower, Double_t* upper) {
+Bool_t ParametricPhaseSpace::limits(UInt_t var, const Double_t* x, __attribute__((unused)) UInt_t dim, 
+                                    Double_t* lower, Double_t* upper) const {
   if (var == m_dim-1) {
-    if (m_phaseSpace->withinLimits(x)) {
+    if (m_phaseSpace->withinLimits(x, m_dim-1)) {
       Double_t arg[4]; 
       UInt_t i; 
       for (i=0; i<4; i++) arg[i] = 0; 
@@ -105,7 +105,7 @@ Bool_t ParametricPhaseSpace::limits(UInt_t var, std::vector<Double_t> &x,
     return 0; 
   }
   else if (var < m_dim-1) {
-    return limits(var, x, lower, upper);
+    return m_phaseSpace->limits(var, x, m_dim-1, lower, upper);
   }
   printf("%20.20s ERROR: var=%d for limits of parametric phase space\n", m_name, var);
   abort(); 
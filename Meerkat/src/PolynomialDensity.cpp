@@ -18,13 +18,13 @@ static std::vector<std::pair<Double_t, Double_t> > gIntegVector2D;
 static Int_t gIter;
 static const char* gName; 
 
-Double_t gPoly1D(Double_t* pars, Double_t x, Int_t pow) {
+Double_t gPoly1D(const Double_t* pars, Double_t x, Int_t pow, const Double_t* middle) {
   // Number of parameters = pow
   Int_t psum, pnum; 
   Double_t sum = 1.;
   pnum = 0;
   for (psum=1; psum<=pow; psum++) {
-    sum += pars[pnum]*TMath::Power(x - gMiddle[0], psum);
+    sum += pars[pnum]*TMath::Power(x - middle[0], psum);
     pnum ++; 
   }
 
@@ -58,7 +58,7 @@ void gPoly1DLH(Int_t &, Double_t *, Double_t &f, Double_t *pars, Int_t) {
   Double_t integ = gPoly1DInt(pars, gPower, gPhsp);
   for (i=gData.begin(); i != gData.end(); i++) {
     Double_t x = (*i)[0]; 
-    Double_t pdf = gPoly1D(pars, x, gPower); 
+    Double_t pdf = gPoly1D(pars, x, gPower, &(gMiddle[0])); 
     if (pdf < 0) {
       error = 1; 
     } else {
@@ -79,7 +79,7 @@ void gPoly1DLH(Int_t &, Double_t *, Double_t &f, Double_t *pars, Int_t) {
   }
 }
 
-Double_t gPoly2D(Double_t* pars, Double_t x, Double_t y, Int_t pow) {
+Double_t gPoly2D(const Double_t* pars, Double_t x, Double_t y, Int_t pow, const Double_t* middle) {
   // Number of parameters: 2 + 3 + ... +  (pow+1) = (pow+1)*pow/2-1
 
   Int_t psum, pnum; 
@@ -90,7 +90,7 @@ Double_t gPoly2D(Double_t* pars, Double_t x, Double_t y, Int_t pow) {
     Int_t px; 
     for (px = 0; px <= psum; px++) {
       Int_t py = psum-px; 
-      sum += pars[pnum]*TMath::Power(x - gMiddle[0], px)*TMath::Power(y - gMiddle[1], py); 
+      sum += pars[pnum]*TMath::Power(x - middle[0], px)*TMath::Power(y - middle[1], py); 
       pnum ++; 
     }
   }
@@ -106,7 +106,7 @@ Double_t gPoly2DInt(Double_t* pars, Int_t pow, __attribute__((unused)) AbsPhaseS
     Double_t x = (*i).first;
     Double_t y = (*i).second;
 
-    Double_t pdf = gPoly2D(pars, x, y, pow);
+    Double_t pdf = gPoly2D(pars, x, y, pow, &(gMiddle[0]));
     sum += pdf; 
   }
 //  sum /= (Double_t) gIntegVector2D.size(); 
@@ -124,7 +124,7 @@ void gPoly2DLH(Int_t &, Double_t *, Double_t &f, Double_t *pars, Int_t) {
   for (i=gData.begin(); i != gData.end(); i++) {
     Double_t x = (*i)[0];
     Double_t y = (*i)[1];
-    Double_t pdf = gPoly2D(pars, x, y, gPower); 
+    Double_t pdf = gPoly2D(pars, x, y, gPower, &(gMiddle[0])); 
     if (pdf < 0) {
       error = 1; 
     } else {
@@ -176,6 +176,8 @@ PolynomialDensity::PolynomialDensity(const char* pdfName,
 
   gMiddle.resize(1); 
   gMiddle[0] = (gPhsp->upperLimit(0) + gPhsp->lowerLimit(0))/2.;
+  m_middle[0] = gMiddle[0]; 
+  m_middle[1] = 0.; 
 
   std::vector<TString> vars(1); 
   vars[0] = TString(var);
@@ -232,6 +234,8 @@ PolynomialDensity::PolynomialDensity(const char* pdfName,
   gMiddle.resize(2); 
   gMiddle[0] = (gPhsp->upperLimit(0) + gPhsp->lowerLimit(0))/2.;
   gMiddle[1] = (gPhsp->upperLimit(1) + gPhsp->lowerLimit(1))/2.;
+  m_middle[0] = gMiddle[0]; 
+  m_middle[1] = gMiddle[1]; 
   
   std::vector<TString> vars(2); 
   vars[0] = TString(var1);
@@ -363,19 +367,11 @@ void PolynomialDensity::readTuple(TTree* tree, std::vector<TString> &vars, UInt_
 
 }
 
-Double_t PolynomialDensity::density(std::vector<Double_t> &x) {
-  gPhsp = m_phaseSpace; 
-  gPower = m_power; 
-  gMaximum = -1.e50;
+Double_t PolynomialDensity::density(const Double_t* x, __attribute__((unused)) UInt_t dim) const {
   if (m_dim == 1) {
-    gMiddle.resize(1); 
-    gMiddle[0] = (gPhsp->upperLimit(0) + gPhsp->lowerLimit(0))/2.;
-    return gPoly1D(m_par, x[0], m_power); 
+    return gPoly1D(m_par, x[0], m_power, m_middle); 
   } else if (m_dim == 2) {
-    gMiddle.resize(2); 
-    gMiddle[0] = (gPhsp->upperLimit(0) + gPhsp->lowerLimit(0))/2.;
-    gMiddle[1] = (gPhsp->upperLimit(1) + gPhsp->lowerLimit(1))/2.;
-    return gPoly2D(m_par, x[0], x[1], m_power); 
+    return gPoly2D(m_par, x[0], x[1], m_power, m_middle); 
   }
   return 0.;
 }
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <map>
+
+#include "TMath.h"
+
+#include "AbsPhaseSpace.hh"
+#include "AbsDensity.hh"
+#include "RefinedBinnedDensity.hh"
+
+#include "Timer.hh"
+
+/// Maximum dimensionality of the refined grid
+#define MAX_REFINED_DIM 8
+
+/// Maximum number of cells
+#define MAX_REFINED_CELLS 100000000
+
+/// Flag of the leaf cells in the cell tree
+static const UInt_t leafFlag = 0x80000000u;
+
+RefinedBinnedDensity::RefinedBinnedDensity(const char* pdfName,
+                                           AbsPhaseSpace* thePhaseSpace,
+                                           std::vector<UInt_t> &binning,
+                                           AbsDensity* d,
+                                           Double_t tolerance,
+                                           UInt_t maxDepth) : AbsDensity(pdfName) {
+
+  m_phaseSpace = thePhaseSpace;
+  m_dim = m_phaseSpace->dimensionality();
+  m_binning = binning;
+  m_depth = 0;
+
+  printf("%20.20s INFO: Creating refined binned density over %dD phase space from density \"%s\"\n", m_name, m_dim, d->name() );
+
+  if (m_binning.size() != m_dim) {
+    printf("%20.20s ERROR: Dimensionality of phase space (%d) does not match binning vector size (%d)\n",
+           m_name, m_dim, (UInt_t)m_binning.size());
+    abort();
+  }
+  if (d->phaseSpace()->dimensionality() != m_dim) {
+    printf("%20.20s ERROR: Dimensionality of density \"%s\" (%d) does not match the phase space (%d)\n",
+           m_name, d->name(), d->phaseSpace()->dimensionality(), m_dim);
+    abort();
+  }
+  if (m_dim > MAX_REFINED_DIM) {
+    printf("%20.20s ERROR: Dimensionality of phase space (%d) is larger than %d\n", m_name, m_dim, MAX_REFINED_DIM);
+    abort();
+  }
+  if (maxDepth > 20) {
+    printf("%20.20s ERROR: Maximum subdivision depth (%d) is larger than 20\n", m_name, maxDepth);
+    abort();
+  }
+
+  m_stride.resize(m_dim);
+  m_lower.resize(m_dim);
+  m_upper.resize(m_dim);
+  m_invStep.resize(m_dim);
+  UInt_t rootCells = 1;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) {
+    if (m_binning[j] < 2) {
+      printf("%20.20s ERROR: At least two bins are needed in each variable\n", m_name);
+      abort();
+    }
+    m_stride[j] = rootCells;
+    rootCells *= m_binning[j]-1;
+    m_lower[j] = m_phaseSpace->lowerLimit(j);
+    m_upper[j] = m_phaseSpace->upperLimit(j);
+    m_invStep[j] = ((Double_t)m_binning[j]-1.)/(m_upper[j] - m_lower[j]);
+  }
+
+  printf("%20.20s INFO: %d root cells, tolerance %f, maximum depth %d\n", m_name, rootCells, tolerance, maxDepth);
+
+  build(d, tolerance, maxDepth);
+
+  // Number of nodes of the uniform grid with the resolution of the finest cells
+  Double_t uniformNodes = 1.;
+  for (j=0; j<m_dim; j++) uniformNodes *= (Double_t)(m_binning[j]-1)*(Double_t)(1u << m_depth) + 1.;
+
+  printf("%20.20s INFO: %d cells, %d leaves, %d nodes, depth %d, %llu bytes (uniform grid of the same resolution: %.0f nodes)\n",
+         m_name, cells(), leaves(), nodes(), m_depth, bytes(), uniformNodes);
+}
+
+RefinedBinnedDensity::~RefinedBinnedDensity() {
+
+}
+
+ULong64_t RefinedBinnedDensity::bytes(void) const {
+  return (ULong64_t)m_cells.size()*sizeof(UInt_t) + (ULong64_t)m_vertices.size()*sizeof(UInt_t) +
+         (ULong64_t)m_values.size()*sizeof(Double_t);
+}
+
+void RefinedBinnedDensity::build(AbsDensity* d, Double_t tolerance, UInt_t maxDepth) {
+
+  const UInt_t vertices = 1u << m_dim;
+
+  // Vertices are addressed by their integer coordinates on the lattice of the finest possible cells.
+  // Density values are cached, since the vertices are shared by the neighbouring cells,
+  // and the nodes already stored for the leaf cells are indexed in the same way.
+  std::map< std::vector<UInt_t>, Double_t > cache;
+  std::map< std::vector<UInt_t>, UInt_t > stored;
+  const UInt_t scale = 1u << maxDepth;
+
+  // Numbers of the 3^N test points of a cell: offsets of 0, 1 or 2 half-cells in each variable
+  UInt_t testPoints = 1;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) testPoints *= 3;
+  std::vector< std::vector<UInt_t> > testOffset(testPoints, std::vector<UInt_t>(m_dim));
+  UInt_t t;
+  for (t=0; t<testPoints; t++) {
+    UInt_t rest = t;
+    for (j=0; j<m_dim; j++) {
+      testOffset[t][j] = rest % 3;
+      rest /= 3;
+    }
+  }
+
+  // Root cells are the cells of the first level
+  UInt_t rootCells = 1;
+  for (j=0; j<m_dim; j++) rootCells *= m_binning[j]-1;
+
+  std::vector< std::vector<UInt_t> > level(rootCells, std::vector<UInt_t>(m_dim));
+  std::vector<UInt_t> levelCell(rootCells);
+  UInt_t c;
+  for (c=0; c<rootCells; c++) {
+    UInt_t rest = c;
+    for (j=0; j<m_dim; j++) {
+      level[c][j] = (rest % (m_binning[j]-1))*scale;
+      rest /= m_binning[j]-1;
+    }
+    levelCell[c] = c;
+  }
+  m_cells.assign(rootCells, leafFlag);
+  m_vertices.clear();
+  m_values.clear();
+
+  Double_t norm = 0.;
+  std::vector< std::vector<Double_t> > nodes(m_dim);
+  std::vector<const Double_t*> nodePtr(m_dim);
+  std::vector< std::vector<UInt_t> > nodeKeys;
+  std::vector<Double_t> x(m_dim);
+  std::vector<UInt_t> key(m_dim);
+  std::vector<Double_t> value(testPoints);
+
+  set_timer();
+
+  UInt_t depth;
+  for (depth=0; level.size() > 0; depth++) {
+
+    // Cells of the last level are not split, only their vertices are needed
+    Bool_t canSplit = (depth < maxDepth);
+    UInt_t size = scale >> depth;
+
+    // Collect the vertices (and, for the cells which can be split, the test points)
+    // which are not evaluated yet and evaluate the density in one batch
+    for (j=0; j<m_dim; j++) nodes[j].clear();
+    nodeKeys.clear();
+    for (c=0; c<level.size(); c++) {
+      for (t=0; t<testPoints; t++) {
+        Bool_t vertex = 1;
+        for (j=0; j<m_dim; j++) {
+          if (testOffset[t][j] == 1) vertex = 0;
+          key[j] = level[c][j] + (testOffset[t][j]*size)/2;
+        }
+        if (!canSplit && !vertex) continue;
+        if (cache.find(key) != cache.end()) continue;
+        cache[key] = 0.;
+        nodeKeys.push_back(key);
+        for (j=0; j<m_dim; j++) {
+          // Same node coordinates as in BinnedDensity for the root grid nodes
+          Double_t lattice = (Double_t)(m_binning[j]-1)*(Double_t)scale;
+          nodes[j].push_back( m_lower[j] + (Double_t)key[j]/lattice*(m_upper[j]-m_lower[j]) );
+        }
+      }
+    }
+
+    UInt_t num = nodeKeys.size();
+    if (num > 0) {
+      for (j=0; j<m_dim; j++) nodePtr[j] = &(nodes[j][0]);
+      std::vector<Double_t> result(num);
+      d->densityBatch(num, &(nodePtr[0]), &(result[0]));
+      UInt_t i;
+      for (i=0; i<num; i++) cache[nodeKeys[i]] = result[i];
+
+      // Normalisation: average over the root grid nodes inside the phase space
+      if (depth == 0) {
+        Double_t phspSum = 0.;
+        UInt_t phspNum = 0;
+        for (i=0; i<num; i++) {
+          Bool_t root = 1;
+          for (j=0; j<m_dim; j++) {
+            x[j] = nodes[j][i];
+            if (nodeKeys[i][j] % scale != 0) root = 0;
+          }
+          if (root && m_phaseSpace->withinLimits(&(x[0]), m_dim)) {
+            phspSum += result[i];
+            phspNum++;
+          }
+        }
+        norm = (phspNum > 0 && phspSum != 0.) ? phspSum/(Double_t)phspNum : 1.;
+      }
+    }
+
+    // Test each cell and either split it or store it as a leaf
+    std::vector< std::vector<UInt_t> > nextLevel;
+    std::vector<UInt_t> nextCell;
+    for (c=0; c<level.size(); c++) {
+
+      for (t=0; t<testPoints; t++) {
+        Bool_t vertex = 1;
+        for (j=0; j<m_dim; j++) {
+          if (testOffset[t][j] == 1) vertex = 0;
+          key[j] = level[c][j] + (testOffset[t][j]*size)/2;
+        }
+        value[t] = (canSplit || vertex) ? cache[key] : 0.;
+      }
+
+      // Vertex values of the cell, vertex v has bit j set for the upper vertex in variable j
+      Double_t corner[1u << MAX_REFINED_DIM];
+      UInt_t cornerPoint[1u << MAX_REFINED_DIM];
+      UInt_t v;
+      for (v=0; v<vertices; v++) {
+        UInt_t index = 0;
+        UInt_t power = 1;
+        for (j=0; j<m_dim; j++) {
+          if (v & (1u << j)) index += 2*power;
+          power *= 3;
+        }
+        corner[v] = value[index];
+        cornerPoint[v] = index;
+      }
+
+      Bool_t split = 0;
+      if (canSplit && m_cells.size() + vertices <= MAX_REFINED_CELLS) {
+        for (t=0; t<testPoints && !split; t++) {
+          // Multilinear interpolation of the vertices at the test point
+          Double_t e = 0.;
+          for (v=0; v<vertices; v++) {
+            Double_t w = 1.;
+            for (j=0; j<m_dim; j++) {
+              Double_t f = 0.5*(Double_t)testOffset[t][j];
+              w *= (v & (1u << j)) ? f : 1.-f;
+            }
+            e += w*corner[v];
+          }
+          if (TMath::Abs(e - value[t]) > tolerance*norm) split = 1;
+        }
+      }
+
+      UInt_t cell = levelCell[c];
+      if (split) {
+        m_cells[cell] = m_cells.size();
+        for (v=0; v<vertices; v++) {
+          std::vector<UInt_t> lower(level[c]);
+          for (j=0; j<m_dim; j++) if (v & (1u << j)) lower[j] += size/2;
+          nextLevel.push_back(lower);
+          nextCell.push_back(m_cells.size());
+          m_cells.push_back(leafFlag);
+        }
+      } else {
+        m_cells[cell] = leafFlag | (UInt_t)(m_vertices.size() >> m_dim);
+        for (v=0; v<vertices; v++) {
+          for (j=0; j<m_dim; j++) key[j] = level[c][j] + (testOffset[cornerPoint[v]][j]*size)/2;
+          std::map< std::vector<UInt_t>, UInt_t >::iterator node = stored.find(key);
+          if (node == stored.end()) {
+            if (m_values.size() >= 0xFFFFFFFFu) {
+              printf("%20.20s ERROR: Number of nodes exceeds the range of the node indices\n", m_name);
+              abort();
+            }
+            node = stored.insert(std::make_pair(key, (UInt_t)m_values.size())).first;
+            m_values.push_back(corner[v]/norm);
+          }
+          m_vertices.push_back(node->second);
+        }
+        if (depth > m_depth) m_depth = depth;
+      }
+    }
+
+    if (timer(2))
+      printf("%20.20s INFO: Level %d, %d cells, %d cached values, %d stored nodes\n", m_name, depth, (UInt_t)level.size(),
+             (UInt_t)cache.size(), (UInt_t)m_values.size());
+
+    level.swap(nextLevel);
+    levelCell.swap(nextCell);
+  }
+}
+
+UInt_t RefinedBinnedDensity::locate(const Double_t* x, Double_t* frac, UInt_t* level, Bool_t* found) const {
+
+  UInt_t cell = 0;
+  UInt_t j;
+  for (j=0; j<m_dim; j++) {
+    Double_t xj = x[j];
+    if (xj < m_lower[j] || xj > m_upper[j]) {
+      *found = 0;
+      return 0;
+    }
+    Double_t t = (xj - m_lower[j])*m_invStep[j];
+    Int_t ij = (Int_t)t;
+    if (ij >= (Int_t)m_binning[j]-1) ij = m_binning[j]-2;
+    frac[j] = t - (Double_t)ij;
+    cell += ij*m_stride[j];
+  }
+
+  // Descend to the leaf. Doubling of the fractions is exact.
+  UInt_t depth = 0;
+  while (!(m_cells[cell] & leafFlag)) {
+    UInt_t sub = 0;
+    for (j=0; j<m_dim; j++) {
+      Double_t f = 2.*frac[j];
+      if (f >= 1.) {
+        sub |= (1u << j);
+        f -= 1.;
+      }
+      frac[j] = f;
+    }
+    cell = m_cells[cell] + sub;
+    depth++;
+  }
+  *level = depth;
+  *found = 1;
+  return m_cells[cell] & ~leafFlag;
+}
+
+Double_t RefinedBinnedDensity::density(const Double_t* x, __attribute__((unused)) UInt_t dim) const {
+
+  Double_t frac[MAX_REFINED_DIM];
+  UInt_t level;
+  Bool_t found;
+  UInt_t leaf = locate(x, frac, &level, &found);
+  if (!found) return 0.;
+
+  // Multilinear weights of the vertices are built up one variable at a time
+  Double_t weight[1u << MAX_REFINED_DIM];
+  weight[0] = 1.;
+  UInt_t j, v;
+  for (j=0; j<m_dim; j++) {
+    const UInt_t half = 1u << j;
+    for (v=0; v<half; v++) {
+      weight[v+half] = weight[v]*frac[j];
+      weight[v] *= (1.-frac[j]);
+    }
+  }
+
+  const UInt_t* c = &(m_vertices[(size_t)leaf << m_dim]);
+  Double_t e = 0.;
+  for (v=0; v < (1u << m_dim); v++) e += weight[v]*m_values[c[v]];
+  return e;
+}
+
+Double_t RefinedBinnedDensity::densityGradient(const Double_t* x, __attribute__((unused)) UInt_t dim, Double_t* grad) const {
+
+  UInt_t j, k, v;
+  for (j=0; j<m_dim; j++) grad[j] = 0.;
+
+  Double_t frac[MAX_REFINED_DIM];
+  UInt_t level;
+  Bool_t found;
+  UInt_t leaf = locate(x, frac, &level, &found);
+  if (!found) return 0.;
+
+  const UInt_t* c = &(m_vertices[(size_t)leaf << m_dim]);
+  Double_t e = 0.;
+  for (v=0; v < (1u << m_dim); v++) {
+    Double_t value = m_values[c[v]];
+    Double_t w = 1.;
+    for (j=0; j<m_dim; j++) w *= (v & (1u << j)) ? frac[j] : 1.-frac[j];
+    e += w*value;
+
+    // Derivative of the vertex weight over each variable
+    for (j=0; j<m_dim; j++) {
+      Double_t dw = (v & (1u << j)) ? 1. : -1.;
+      for (k=0; k<m_dim; k++) if (k != j) dw *= (v & (1u << k)) ? frac[k] : 1.-frac[k];
+      grad[j] += dw*value;
+    }
+  }
+
+  // Convert from the derivatives over the fractional positions in the leaf cell
+  Double_t cellScale = (Double_t)(1u << level);
+  for (j=0; j<m_dim; j++) grad[j] *= m_invStep[j]*cellScale;
+
+  return e;
+}
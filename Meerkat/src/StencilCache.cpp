@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <vector>
+#include <stdlib.h>
+#include <math.h>
+
+#include "TMath.h"
+
+#include "GridEngine.hh"
+#include "BinnedOptions.hh"
+#include "StencilCache.hh"
+
+/// Maximum dimensionality of the stencil deposition (size of the arrays on the stack)
+#define MAX_STENCIL_DIM 16
+
+StencilCache::StencilCache() {
+  m_grid = 0;
+  m_subdivisions = 0;
+  m_scaleSteps = 0;
+  m_phases = 0;
+  m_minIndex = 0;
+  m_levels = 0;
+  m_memory = 0;
+  m_misses = 0;
+  m_errorBound = 0.;
+  m_name = "";
+}
+
+StencilCache::~StencilCache() {
+  UInt_t i;
+  for (i=0; i<m_stencils.size(); i++) delete m_stencils[i];
+}
+
+void StencilCache::init(const GridEngine* grid, const Double_t* width, Double_t minScale, Double_t maxScale,
+                        const BinnedOptions &options, const char* name) {
+
+  UInt_t i;
+  for (i=0; i<m_stencils.size(); i++) delete m_stencils[i];
+  m_stencils.clear();
+
+  m_grid = grid;
+  m_name = name;
+  m_subdivisions = options.stencilSubdivisions;
+  Bool_t adaptive = (minScale != 1. || maxScale != 1.);
+  m_scaleSteps = adaptive ? ((options.stencilScaleSteps > 0) ? options.stencilScaleSteps : 1) : 0;
+  m_phases = 0;
+  m_minIndex = 0;
+  m_levels = 0;
+  m_memory = 0;
+  m_misses = 0;
+
+  if (m_subdivisions == 0) return;
+
+  UInt_t dim = grid->dimensionality();
+  ULong64_t maxMemory = options.stencilMaxMemory;
+
+  if (dim > MAX_STENCIL_DIM) {
+    printf("%20.20s WARNING: Stencil deposition is limited to %d dimensions, stencil cache disabled\n",
+           m_name, MAX_STENCIL_DIM);
+    m_subdivisions = 0;
+    return;
+  }
+
+  // The table has an entry for each combination of the sub-node phases in all variables
+  if (pow((Double_t)m_subdivisions, (Double_t)dim)*sizeof(Stencil*) > (Double_t)maxMemory) {
+    printf("%20.20s WARNING: Too many sub-node phases (%d sub-nodes in %d variables) for the memory limit, stencil cache disabled\n",
+           m_name, m_subdivisions, dim);
+    m_subdivisions = 0;
+    return;
+  }
+  m_phases = 1;
+  UInt_t n;
+  for (n=0; n<dim; n++) m_phases *= m_subdivisions;
+
+  // The kernel 1-r^2 changes by at most 2 per unit shift of r, the snapping shifts the event by at most
+  // half a sub-node in each variable and changes the width scale by at most half a lattice step
+  m_width.assign(width, width + dim);
+  m_radius.resize(dim);
+  Double_t shift2 = 0.;
+  for (n=0; n<dim; n++) {
+    m_radius[n] = width[n]*grid->invSteps()[n];
+    Double_t shift = 0.5/(Double_t)m_subdivisions/m_radius[n];
+    shift2 += shift*shift;
+  }
+  m_errorBound = 2.*sqrt(shift2);
+  if (m_scaleSteps > 0) m_errorBound += pow(2., 1./(Double_t)m_scaleSteps) - 1.;
+
+  if (m_scaleSteps == 0) {
+    // All stencils of the fixed-width kernels are calculated here in the order of the table,
+    // the ones beyond the memory limit are not cached
+    m_levels = 1;
+    m_stencils.assign(m_phases, 0);
+    m_memory = (ULong64_t)m_phases*sizeof(Stencil*);
+    UInt_t key;
+    for (key=0; key<m_phases; key++) {
+      Stencil* s = buildStencil(key);
+      ULong64_t bytes = sizeof(Stencil) + dim*(sizeof(Int_t) + sizeof(UInt_t)) + s->values.size()*sizeof(Double_t);
+      if (m_memory + bytes > maxMemory) {
+        delete s;
+        printf("%20.20s WARNING: Memory limit reached after %d of %d stencils, the other events are deposited directly\n",
+               m_name, key, m_phases);
+        break;
+      }
+      m_stencils[key] = s;
+      m_memory += bytes;
+    }
+  } else {
+    // Width scale levels from the smallest scale, as long as all their stencils fit into the memory
+    Double_t lo = TMath::Min(minScale, maxScale);
+    Double_t hi = TMath::Max(minScale, maxScale);
+    m_minIndex = (Int_t)floor(log(lo)/log(2.)*(Double_t)m_scaleSteps + 0.5);
+    Int_t maxIndex = (Int_t)floor(log(hi)/log(2.)*(Double_t)m_scaleSteps + 0.5);
+    UInt_t allLevels = (UInt_t)(maxIndex - m_minIndex) + 1;
+    Double_t memory = 0.;
+    while (m_levels < allLevels) {
+      Double_t bytes = levelMemory(m_levels);
+      if (memory + bytes > (Double_t)maxMemory) break;
+      memory += bytes;
+      m_levels++;
+    }
+    if (m_levels == 0) {
+      printf("%20.20s WARNING: Stencils of the smallest width scale do not fit into the memory limit, stencil cache disabled\n",
+             m_name);
+      m_subdivisions = 0;
+      return;
+    }
+    if (m_levels < allLevels) {
+      printf("%20.20s WARNING: %d of %d width scale levels fit into the memory limit, the other events are deposited directly\n",
+             m_name, m_levels, allLevels);
+    }
+    m_stencils.assign((ULong64_t)m_levels*m_phases, 0);
+    m_memory = (ULong64_t)m_stencils.size()*sizeof(Stencil*);
+  }
+
+  printf("%20.20s INFO: Stencil deposition with %d sub-nodes per cell", m_name, m_subdivisions);
+  if (m_scaleSteps > 0) printf(" and %d width scale steps per factor 2", m_scaleSteps);
+  printf(", kernel value error < %f\n", m_errorBound);
+}
+
+void StencilCache::release() {
+  if (m_subdivisions == 0) return;
+
+  UInt_t cached = 0;
+  UInt_t i;
+  for (i=0; i<m_stencils.size(); i++) {
+    if (m_stencils[i] == 0) continue;
+    cached++;
+    delete m_stencils[i];
+  }
+  printf("%20.20s INFO: %d stencils (%lld bytes), %lld events deposited directly\n",
+         m_name, cached, (Long64_t)m_memory, (Long64_t)m_misses);
+
+  m_stencils.clear();
+  m_memory = 0;
+  m_subdivisions = 0;
+}
+
+Double_t StencilCache::levelScale(UInt_t level) const {
+  if (m_scaleSteps == 0) return 1.;
+  return pow(2., (Double_t)(m_minIndex + (Int_t)level)/(Double_t)m_scaleSteps);
+}
+
+Double_t StencilCache::levelMemory(UInt_t level) const {
+
+  // The footprint of a kernel of the radius r has at most floor(2r)+1 nodes in each variable
+  UInt_t dim = m_grid->dimensionality();
+  Double_t scale = levelScale(level);
+  Double_t values = 1.;
+  UInt_t n;
+  for (n=0; n<dim; n++) values *= TMath::Floor(2.*m_radius[n]*scale) + 1.;
+  Double_t bytes = sizeof(Stencil*) + sizeof(Stencil) + dim*(sizeof(Int_t) + sizeof(UInt_t)) + values*sizeof(Double_t);
+  return bytes*(Double_t)m_phases;
+}
+
+Bool_t StencilCache::deposit(std::vector<Double_t> &map, const Double_t* point, Double_t widthScale, Double_t weight) {
+
+  UInt_t dim = m_grid->dimensionality();
+  const Double_t* lower = m_grid->lowerLimits();
+  const Double_t* invStep = m_grid->invSteps();
+  Long64_t q = m_subdivisions;
+
+  // Snap the event to the sub-node lattice
+  Long64_t cell[MAX_STENCIL_DIM];
+  UInt_t key = 0;
+  UInt_t factor = 1;
+  UInt_t n;
+  for (n=0; n<dim; n++) {
+    Long64_t m = (Long64_t)floor((point[n] - lower[n])*invStep[n]*(Double_t)q + 0.5);
+    Long64_t c = (m >= 0) ? m/q : -((q - 1 - m)/q);
+    cell[n] = c;
+    key += (UInt_t)(m - c*q)*factor;
+    factor *= (UInt_t)q;
+  }
+
+  // Snap the width scale to the logarithmic lattice. The levels which are not cached are deposited directly.
+  Bool_t cached = 1;
+  if (m_scaleSteps > 0) {
+    Int_t level = (Int_t)floor(log(widthScale)/log(2.)*(Double_t)m_scaleSteps + 0.5) - m_minIndex;
+    if (level < 0 || level >= (Int_t)m_levels) cached = 0;
+    else key += (UInt_t)level*m_phases;
+  }
+
+  Stencil* stencil = cached ? __atomic_load_n(&(m_stencils[key]), __ATOMIC_ACQUIRE) : 0;
+
+  // The stencils of the adaptive kernels are calculated on the first use. If several threads calculate
+  // the same stencil, the one published first is used (they are identical).
+  if (stencil == 0 && cached && m_scaleSteps > 0) {
+    Stencil* s = buildStencil(key);
+    Stencil* expected = 0;
+    if (__atomic_compare_exchange_n(&(m_stencils[key]), &expected, s, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      ULong64_t bytes = sizeof(Stencil) + dim*(sizeof(Int_t) + sizeof(UInt_t)) + s->values.size()*sizeof(Double_t);
+      __atomic_add_fetch(&m_memory, bytes, __ATOMIC_RELAXED);
+      stencil = s;
+    } else {
+      delete s;
+      stencil = expected;
+    }
+  }
+
+  if (stencil == 0) {
+    __atomic_add_fetch(&m_misses, 1, __ATOMIC_RELAXED);
+    return m_grid->deposit(map, point, &(m_width[0]), widthScale, weight);
+  }
+
+  return addStencil(map, cell, *stencil, weight);
+}
+
+StencilCache::Stencil* StencilCache::buildStencil(UInt_t key) const {
+
+  UInt_t dim = m_grid->dimensionality();
+  Double_t scale = levelScale(key/m_phases);
+  UInt_t phases = key%m_phases;
+
+  Stencil* stencil = new Stencil;
+  stencil->first.resize(dim);
+  stencil->length.resize(dim);
+
+  // Squared scaled distances to the nodes of the footprint along each variable. The footprint and the
+  // distances follow GridEngine::deposit(), with the event at the snapped position in the cell.
+  std::vector< std::vector<Double_t> > sq(dim);
+  UInt_t size = 1;
+  UInt_t n;
+  for (n=0; n<dim; n++) {
+    Double_t r = m_radius[n]*scale;
+    Double_t p = (Double_t)(phases%m_subdivisions)/(Double_t)m_subdivisions;
+    phases /= m_subdivisions;
+    Int_t k1 = (Int_t)TMath::Ceil(p - r);
+    Int_t k2 = (Int_t)TMath::Floor(p + r);
+    stencil->first[n] = k1;
+    stencil->length[n] = (k2 >= k1) ? k2 - k1 + 1 : 0;
+    Int_t k;
+    for (k=k1; k<=k2; k++) {
+      Double_t dx = ((Double_t)k - p)/r;
+      sq[n].push_back( (fabs(dx) < 1.) ? dx*dx : 0. );
+    }
+    size *= stencil->length[n];
+  }
+
+  stencil->values.resize(size);
+  if (size == 0) return stencil;
+
+  std::vector<UInt_t> iter(dim, 0);
+  UInt_t i;
+  for (i=0; i<size; i++) {
+    Double_t s = 0.;
+    for (n=0; n<dim; n++) s += sq[n][iter[n]];
+    stencil->values[i] = (s < 1.) ? 1. - s : 0.;
+    for (n=0; n<dim; n++) {
+      if (iter[n] < stencil->length[n]-1) {
+        iter[n]++;
+        break;
+      }
+      iter[n] = 0;
+    }
+  }
+  return stencil;
+}
+
+Bool_t StencilCache::addStencil(std::vector<Double_t> &map, const Long64_t* cell,
+                                const Stencil &stencil, Double_t weight) const {
+
+  UInt_t dim = m_grid->dimensionality();
+  const UInt_t* binning = m_grid->binning();
+  GridEngine::Layout layout = m_grid->layout();
+  Bool_t sparse = (layout == GridEngine::kSparse);
+
+  // Part of the footprint inside the grid
+  UInt_t lo[MAX_STENCIL_DIM];
+  UInt_t hi[MAX_STENCIL_DIM];
+  UInt_t iter[MAX_STENCIL_DIM];
+  UInt_t stride[MAX_STENCIL_DIM];
+  UInt_t start = 0;
+  UInt_t size = 1;
+  UInt_t n;
+  for (n=0; n<dim; n++) {
+    Long64_t a = cell[n] + stencil.first[n];
+    Long64_t b = a + (Long64_t)stencil.length[n] - 1;
+    Long64_t i1 = (a < 0) ? 0 : a;
+    Long64_t i2 = (b >= (Long64_t)binning[n]) ? (Long64_t)binning[n] - 1 : b;
+    if (i1 > i2) return 0;
+    lo[n] = (UInt_t)i1;
+    hi[n] = (UInt_t)i2;
+    iter[n] = lo[n];
+    stride[n] = size;
+    start += (UInt_t)(i1 - a)*size;
+    size *= stencil.length[n];
+  }
+
+  // Map index of the row along the 1st variable (and its tile index in the sparse layout)
+  UInt_t index = 0;
+  UInt_t tile = 0;
+  for (n=1; n<dim; n++) {
+    index += m_grid->axisOffsets(n)[lo[n]];
+    if (sparse) tile += m_grid->tileOffsets(n)[lo[n]];
+  }
+
+  UInt_t length = hi[0] - lo[0] + 1;
+  const UInt_t* offset = m_grid->axisOffsets(0) + lo[0];
+  const UInt_t* tileOffset = sparse ? m_grid->tileOffsets(0) + lo[0] : 0;
+  const UInt_t* tileBase = sparse ? m_grid->tileBases() : 0;
+  Double_t* data = &(map[0]);
+
+  do {
+    const Double_t* v = &(stencil.values[start]);
+    UInt_t k;
+    if (layout == GridEngine::kRowMajor) {
+      Double_t* row = data + index + lo[0];
+      for (k=0; k<length; k++) row[k] += weight*v[k];
+    } else if (layout == GridEngine::kTiled) {
+      Double_t* row = data + index;
+      for (k=0; k<length; k++) row[offset[k]] += weight*v[k];
+    } else {
+      // The shared zero tile of the sparse layout is never written
+      for (k=0; k<length; k++) {
+        UInt_t b = tileBase[tile + tileOffset[k]];
+        if (b > 0) data[b + index + offset[k]] += weight*v[k];
+      }
+    }
+
+    for (n=1; n<dim; n++) {
+      const UInt_t* axisOffset = m_grid->axisOffsets(n);
+      if (iter[n] < hi[n]) {
+        index += axisOffset[iter[n]+1] - axisOffset[iter[n]];
+        if (sparse) tile += m_grid->tileOffsets(n)[iter[n]+1] - m_grid->tileOffsets(n)[iter[n]];
+        start += stride[n];
+        iter[n]++;
+        break;
+      }
+      index -= axisOffset[iter[n]] - axisOffset[lo[n]];
+      if (sparse) tile -= m_grid->tileOffsets(n)[iter[n]] - m_grid->tileOffsets(n)[lo[n]];
+      start -= (iter[n] - lo[n])*stride[n];
+      iter[n] = lo[n];
+    }
+    if (n >= dim) break;
+  } while(1);
+
+  return 1;
+}
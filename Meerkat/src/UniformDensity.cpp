@@ -15,7 +15,8 @@ UniformDensity::~UniformDensity() {
 
 }
 
-Double_t UniformDensity::density(__attribute__((unused)) std::vector<Double_t> &x) {  
+Double_t UniformDensity::density(__attribute__((unused)) const Double_t* x, 
+                                 __attribute__((unused)) UInt_t dim) const {  
 
   return 1.; 
 